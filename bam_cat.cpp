@@ -0,0 +1,140 @@
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/bgzf.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bgzf_splice.h"
+#include "tool_stats.h"
+#include "big_hfile.h"
+
+// Concatenate BAMs that share reference sequences, e.g. the outputs of workers given bam_split
+// shards, copying their compressed records rather than decoding and re-encoding them: each input's
+// header is read and dropped, and the rest of the file follows the first input's header (or
+// another file's, with -h) block-for-block, with only the block each header ends in recompressed.
+
+static void usage() {
+
+  fprintf(stderr, "Usage: bam_cat [-h header.xam] [-o out.bam] in1.bam [in2.bam ...]\n");
+  fprintf(stderr, "\t-h\tTake the output header from header.xam rather than in1.bam\n");
+  fprintf(stderr, "\t-o\tOutput file (default stdout)\n");
+  exit(1);
+
+}
+
+static htsFile* open_bam_or_die(const char* fname, bam_hdr_t** header) {
+
+  htsFile* hf = hts_open_tuned(fname, "r");
+  if(!hf) {
+    fprintf(stderr, "Failed to open %s\n", fname);
+    exit(1);
+  }
+
+  if(hf->format.format != bam || hf->format.compression != bgzf) {
+    fprintf(stderr, "%s is not a BGZF-compressed BAM file\n", fname);
+    exit(1);
+  }
+
+  *header = sam_hdr_read(hf);
+  if(!*header) {
+    fprintf(stderr, "Failed to read header from %s\n", fname);
+    exit(1);
+  }
+
+  return hf;
+
+}
+
+static void check_same_contigs(const char* aname, const bam_hdr_t* a, const char* bname, const bam_hdr_t* b) {
+
+  bool same = a->n_targets == b->n_targets;
+  for(int32_t i = 0; same && i < a->n_targets; ++i)
+    same = !strcmp(a->target_name[i], b->target_name[i]) && a->target_len[i] == b->target_len[i];
+
+  if(!same) {
+    fprintf(stderr, "%s and %s have different reference sequences\n", aname, bname);
+    exit(1);
+  }
+
+}
+
+int main(int argc, char** argv) {
+
+  const char* header_name = 0;
+  const char* out_name = "-";
+
+  int c;
+  while((c = getopt(argc, argv, "h:o:")) >= 0) {
+    switch(c) {
+    case 'h':
+      header_name = optarg;
+      break;
+    case 'o':
+      out_name = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(optind == argc)
+    usage();
+
+  tool_stats_init("bam_cat");
+
+  if(!header_name)
+    header_name = argv[optind];
+
+  // Any format will do for the header alone.
+  htsFile* hfh = hts_open_tuned(header_name, "r");
+  bam_hdr_t* header = hfh ? sam_hdr_read(hfh) : 0;
+  if(!header) {
+    fprintf(stderr, "Failed to read header from %s\n", header_name);
+    exit(1);
+  }
+  hts_close(hfh);
+
+  htsFile* hfo = hts_open_tuned(out_name, "wb");
+  if(!hfo) {
+    fprintf(stderr, "Failed to open %s\n", out_name);
+    exit(1);
+  }
+
+  if(sam_hdr_write(hfo, header)) {
+    fprintf(stderr, "Failed to write header to %s\n", out_name);
+    exit(1);
+  }
+
+  for(int i = optind; i < argc; ++i) {
+
+    bam_hdr_t* in_header;
+    htsFile* hf = open_bam_or_die(argv[i], &in_header);
+    check_same_contigs(header_name, header, argv[i], in_header);
+
+    StageTimer timer(tool_stage_write);
+    if(!bgzf_splice_body(hf->fp.bgzf, hfo->fp.bgzf)) {
+      fprintf(stderr, "Failed to copy records from %s to %s\n", argv[i], out_name);
+      exit(1);
+    }
+
+    bam_hdr_destroy(in_header);
+    hts_close(hf);
+
+  }
+
+  if(hts_close(hfo)) {
+    fprintf(stderr, "Failed to close %s\n", out_name);
+    exit(1);
+  }
+
+  bam_hdr_destroy(header);
+
+  fprintf(stderr, "Concatenated %d files\n", argc - optind);
+  tool_stats_finish();
+  return 0;
+
+}
@@ -0,0 +1,286 @@
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "parallel_records.h"
+#include "stable_hash.h"
+#include "tool_stats.h"
+#include "big_hfile.h"
+
+// Order-independent checksums of a SAM / BAM / CRAM file's records, for checking that a parallel
+// or sharded run wrote the same records as a serial one without sorting both. Each field of each
+// record is hashed with stable_hash and the hashes summed (mod 2^64) per field, so the digest
+// doesn't depend on record order but does count duplicates. The "record" sum hashes each record's
+// field hashes together, catching fields that moved between records. Contigs are hashed by name,
+// so outputs whose headers number them differently still match, and aux tags are summed per
+// record, so their order within a record doesn't matter either.
+
+enum checksum_field {
+
+  field_qname,
+  field_flag,
+  field_pos,
+  field_mate,
+  field_seq,
+  field_qual,
+  field_aux,
+  field_record,
+  n_fields
+
+};
+
+static const char* const field_names[n_fields] = { "qname", "flag", "pos", "mate", "seq", "qual", "aux", "record" };
+
+struct Checksum {
+
+  uint64_t records;
+  uint64_t sums[n_fields];
+  // Workers' checksums sit side by side; keep them off each other's cache lines.
+  char pad[64];
+
+  Checksum() : records(0) {
+    memset(sums, 0, sizeof(sums));
+  }
+
+  void add(const Checksum& other) {
+    records += other.records;
+    for(int i = 0; i < n_fields; ++i)
+      sums[i] += other.sums[i];
+  }
+
+  bool operator==(const Checksum& other) const {
+    return records == other.records && !memcmp(sums, other.sums, sizeof(sums));
+  }
+
+};
+
+static void usage() {
+
+  fprintf(stderr, "Usage: bam_checksum [-@ threads] in.xam [other.xam]\n");
+  fprintf(stderr, "\tPrints record count and per-field order-independent checksums of in.xam (- for stdin).\n");
+  fprintf(stderr, "\tWith two files, prints both side by side and exits 1 if they differ.\n");
+  fprintf(stderr, "\t-@\tThreads for hashing and for BGZF decoding\n");
+  exit(1);
+
+}
+
+static inline void put_le32(uint8_t* p, uint32_t x) {
+
+  p[0] = x;
+  p[1] = x >> 8;
+  p[2] = x >> 16;
+  p[3] = x >> 24;
+
+}
+
+static inline void put_le64(uint8_t* p, uint64_t x) {
+
+  put_le32(p, (uint32_t)x);
+  put_le32(p + 4, (uint32_t)(x >> 32));
+
+}
+
+// A contig by name, with * for none.
+static inline uint64_t contig_hash(const bam_hdr_t* header, int32_t tid, uint64_t seed) {
+
+  if(tid < 0 || tid >= header->n_targets)
+    return stable_hash("*", 1, seed);
+  const char* name = header->target_name[tid];
+  return stable_hash(name, strlen(name), seed);
+
+}
+
+// Length of the aux field starting at p (tag, type and value), or 0 if it's malformed.
+static size_t aux_field_len(const uint8_t* p, const uint8_t* end) {
+
+  if(end - p < 3)
+    return 0;
+
+  const uint8_t* val = p + 3;
+  size_t size = 0;
+  switch(p[2]) {
+  case 'A': case 'c': case 'C':
+    size = 1;
+    break;
+  case 's': case 'S':
+    size = 2;
+    break;
+  case 'i': case 'I': case 'f':
+    size = 4;
+    break;
+  case 'd':
+    size = 8;
+    break;
+  case 'Z': case 'H': {
+    const uint8_t* nul = (const uint8_t*)memchr(val, 0, end - val);
+    if(!nul)
+      return 0;
+    size = nul - val + 1;
+    break;
+  }
+  case 'B': {
+    if(end - val < 5)
+      return 0;
+    size_t elem;
+    switch(val[0]) {
+    case 'c': case 'C': elem = 1; break;
+    case 's': case 'S': elem = 2; break;
+    case 'i': case 'I': case 'f': elem = 4; break;
+    default: return 0;
+    }
+    uint32_t n = val[1] | val[2] << 8 | val[3] << 16 | (uint32_t)val[4] << 24;
+    size = 5 + elem * n;
+    break;
+  }
+  default:
+    return 0;
+  }
+
+  return size <= (size_t)(end - val) ? 3 + size : 0;
+
+}
+
+static void checksum_record(const bam_hdr_t* header, const bam1_t* rec, Checksum& sum) {
+
+  const bam1_core_t* c = &rec->core;
+  uint64_t h[n_fields];
+
+  const char* qname = bam_get_qname(rec);
+  h[field_qname] = stable_hash(qname, strlen(qname), field_qname);
+
+  uint8_t buf[8];
+  put_le32(buf, c->flag);
+  h[field_flag] = stable_hash(buf, 4, field_flag);
+
+  // Where and how it's aligned: contig, position, mapping quality and CIGAR.
+  put_le32(buf, (uint32_t)c->pos);
+  put_le32(buf + 4, c->qual);
+  uint64_t pos = stable_hash(buf, 8, contig_hash(header, c->tid, field_pos));
+  const uint32_t* cigar = bam_get_cigar(rec);
+  for(uint32_t i = 0; i < c->n_cigar; ++i) {
+    put_le32(buf, cigar[i]);
+    pos = stable_hash(buf, 4, pos);
+  }
+  h[field_pos] = pos;
+
+  put_le32(buf, (uint32_t)c->mpos);
+  put_le32(buf + 4, (uint32_t)c->isize);
+  h[field_mate] = stable_hash(buf, 8, contig_hash(header, c->mtid, field_mate));
+
+  h[field_seq] = stable_hash(bam_get_seq(rec), (c->l_qseq + 1) / 2, field_seq);
+  h[field_qual] = stable_hash(bam_get_qual(rec), c->l_qseq, field_qual);
+
+  uint64_t aux = 0;
+  const uint8_t* p = bam_get_aux(rec);
+  const uint8_t* end = rec->data + rec->l_data;
+  while(p < end) {
+    size_t len = aux_field_len(p, end);
+    if(!len) {
+      fprintf(stderr, "Malformed aux data in record %s\n", qname);
+      exit(1);
+    }
+    aux += stable_hash(p, len, field_aux);
+    p += len;
+  }
+  h[field_aux] = aux;
+
+  uint8_t fields[8 * field_record];
+  for(int i = 0; i < field_record; ++i)
+    put_le64(fields + 8 * i, h[i]);
+  h[field_record] = stable_hash(fields, sizeof(fields), field_record);
+
+  ++sum.records;
+  for(int i = 0; i < n_fields; ++i)
+    sum.sums[i] += h[i];
+
+}
+
+static Checksum checksum_file(const char* fname, int nthreads) {
+
+  htsFile* hf = hts_open_tuned(fname, "r");
+  if(!hf) {
+    fprintf(stderr, "Failed to open %s\n", fname);
+    exit(1);
+  }
+
+  if(nthreads > 1)
+    hts_set_threads(hf, nthreads);
+
+  bam_hdr_t* header = sam_hdr_read(hf);
+  if(!header) {
+    fprintf(stderr, "Failed to read header from %s\n", fname);
+    exit(1);
+  }
+
+  std::vector<Checksum> sums(nthreads > 1 ? nthreads : 1);
+
+  process_record_batches(hf, header, nthreads,
+			 [&](BatchRecord& br, int worker) {
+			   checksum_record(header, br.rec, sums[worker]);
+			 },
+			 [&](BatchRecord& br) {});
+
+  Checksum total;
+  for(size_t i = 0; i < sums.size(); ++i)
+    total.add(sums[i]);
+
+  bam_hdr_destroy(header);
+  hts_close(hf);
+  return total;
+
+}
+
+int main(int argc, char** argv) {
+
+  int nthreads = 1;
+
+  int c;
+  while((c = getopt(argc, argv, "@:")) >= 0) {
+    switch(c) {
+    case '@':
+      nthreads = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+
+  int nfiles = argc - optind;
+  if(nfiles < 1 || nfiles > 2)
+    usage();
+
+  tool_stats_init("bam_checksum");
+
+  Checksum a = checksum_file(argv[optind], nthreads);
+
+  if(nfiles == 1) {
+
+    printf("%-8s %llu\n", "records", (unsigned long long)a.records);
+    for(int i = 0; i < n_fields; ++i)
+      printf("%-8s %016llx\n", field_names[i], (unsigned long long)a.sums[i]);
+    tool_stats_finish();
+    return 0;
+
+  }
+
+  Checksum b = checksum_file(argv[optind + 1], nthreads);
+
+  printf("%-8s %16llu %16llu%s\n", "records", (unsigned long long)a.records, (unsigned long long)b.records,
+	 a.records == b.records ? "" : "  differs");
+  for(int i = 0; i < n_fields; ++i) {
+    printf("%-8s %016llx %016llx%s\n", field_names[i], (unsigned long long)a.sums[i], (unsigned long long)b.sums[i],
+	   a.sums[i] == b.sums[i] ? "" : "  differs");
+  }
+
+  tool_stats_finish();
+  return a == b ? 0 : 1;
+
+}
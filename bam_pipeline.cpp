@@ -0,0 +1,188 @@
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/thread_pool.h>
+
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "record_transforms.h"
+#include "parallel_records.h"
+#include "tool_stats.h"
+#include "big_hfile.h"
+
+// Run several of the single-purpose transforms in one process, e.g. instead of
+//   remove_qname_suffix | reorder_chroms | filter_match_ratio 0.5 | filter_attr AS '>' BS
+// use
+//   bam_pipeline strip_suffix reorder_chroms match_ratio:0.5 'filter_attr:AS>BS'
+// Records are decoded once, passed through every stage in memory and encoded once at the end.
+// Stages run on worker threads, a batch of records at a time.
+
+static void usage() {
+
+  fprintf(stderr, "Usage: bam_pipeline [-@ threads] [-i in.xam] [-o out.bam] [-O output_mode] stage [stage ...]\n");
+  fprintf(stderr, "\tStages are applied in the order given:\n");
+  fprintf(stderr, "\tstrip_suffix\tRemove /1, /2 etc suffixes from qnames (as remove_qname_suffix)\n");
+  fprintf(stderr, "\treorder_chroms\tRenumber contigs into 1..22, X, Y, MT order (as reorder_chroms)\n");
+  fprintf(stderr, "\tmatch_ratio:P\tMark records with less than proportion P of the read matched unmapped (as filter_match_ratio)\n");
+  fprintf(stderr, "\tfilter_attr:EXPR\tKeep records where EXPR holds, e.g. AS>BS or AS==5 (as filter_attr)\n");
+  fprintf(stderr, "\t-i\tInput file (default stdin)\n");
+  fprintf(stderr, "\t-o\tOutput file (default stdout)\n");
+  fprintf(stderr, "\t-O\tOutput mode as for hts_open (default wb; wb0 for uncompressed BAM)\n");
+  fprintf(stderr, "\t-@\tWorker threads for the stages, and for BGZF decoding / encoding\n");
+  exit(1);
+
+}
+
+static RecordStage* parse_stage(const char* arg) {
+
+  std::string spec = arg;
+  size_t colon = spec.find(':');
+  std::string name = spec.substr(0, colon);
+  std::string param = colon == std::string::npos ? "" : spec.substr(colon + 1);
+
+  if(name == "strip_suffix" && colon == std::string::npos)
+    return new StripQnameSuffixStage();
+
+  if(name == "reorder_chroms" && colon == std::string::npos)
+    return new ReorderContigsStage(default_contig_order());
+
+  if(name == "match_ratio" && !param.empty()) {
+    double required_prop = atof(param.c_str());
+    if(required_prop <= 0 || required_prop > 1) {
+      fprintf(stderr, "Match proportion must be a real number > 0 and <= 1\n");
+      exit(1);
+    }
+    return new MatchRatioStage(required_prop);
+  }
+
+  if(name == "filter_attr" && !param.empty()) {
+    size_t opstart = param.find_first_of("<>=!");
+    size_t opend = param.find_first_not_of("<>=!", opstart);
+    if(opstart == 0 || opstart == std::string::npos || opend == std::string::npos) {
+      fprintf(stderr, "Expected an expression like AS>BS, not %s\n", param.c_str());
+      exit(1);
+    }
+    return new AttrFilterStage(param.substr(0, opstart).c_str(), param.substr(opstart, opend - opstart).c_str(), param.substr(opend).c_str());
+  }
+
+  fprintf(stderr, "Unknown stage %s\n", arg);
+  usage();
+  return 0;
+
+}
+
+int main(int argc, char** argv) {
+
+  int nthreads = 1;
+  const char* in_name = "-";
+  const char* out_name = "-";
+  const char* out_mode = "wb";
+
+  int c;
+  while((c = getopt(argc, argv, "@:i:o:O:")) >= 0) {
+    switch(c) {
+    case '@':
+      nthreads = atoi(optarg);
+      break;
+    case 'i':
+      in_name = optarg;
+      break;
+    case 'o':
+      out_name = optarg;
+      break;
+    case 'O':
+      out_mode = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(optind == argc)
+    usage();
+
+  tool_stats_init("bam_pipeline");
+
+  std::vector<RecordStage*> stages;
+  for(int i = optind; i < argc; ++i)
+    stages.push_back(parse_stage(argv[i]));
+
+  htsFile* hfi = hts_open_tuned(in_name, "r");
+  if(!hfi) {
+    fprintf(stderr, "Failed to open %s\n", in_name);
+    exit(1);
+  }
+
+  htsFile* hfo = hts_open_tuned(out_name, out_mode);
+  if(!hfo) {
+    fprintf(stderr, "Failed to open %s\n", out_name);
+    exit(1);
+  }
+
+  htsThreadPool pool = { 0, 0 };
+  if(nthreads > 1) {
+    pool.pool = hts_tpool_init(nthreads);
+    if(!pool.pool) {
+      fprintf(stderr, "Failed to start thread pool\n");
+      exit(1);
+    }
+    hts_set_thread_pool(hfi, &pool);
+    hts_set_thread_pool(hfo, &pool);
+  }
+
+  bam_hdr_t* header = sam_hdr_read(hfi);
+  if(!header) {
+    fprintf(stderr, "Failed to read header from %s\n", in_name);
+    exit(1);
+  }
+
+  bam_hdr_t* outheader = header;
+  for(int i = 0, ilim = stages.size(); i != ilim; ++i)
+    outheader = stages[i]->init(outheader);
+
+  if(sam_hdr_write(hfo, outheader)) {
+    fprintf(stderr, "Failed to write header to %s\n", out_name);
+    exit(1);
+  }
+
+  unsigned long total = 0, kept = 0;
+
+  process_record_batches(hfi, header, nthreads,
+			 [&](BatchRecord& br, int worker) {
+			   for(size_t i = 0; i != stages.size() && br.keep; ++i)
+			     br.keep = stages[i]->apply(br.rec);
+			 },
+			 [&](BatchRecord& br) {
+			   ++total;
+			   if(!br.keep)
+			     return;
+			   if(sam_write1(hfo, outheader, br.rec) < 0) {
+			     fprintf(stderr, "Failed to write BAM record\n");
+			     exit(1);
+			   }
+			   ++kept;
+			 });
+
+  hts_close(hfi);
+  if(hts_close(hfo)) {
+    fprintf(stderr, "Failed to close %s\n", out_name);
+    exit(1);
+  }
+
+  if(pool.pool)
+    hts_tpool_destroy(pool.pool);
+
+  for(int i = 0, ilim = stages.size(); i != ilim; ++i)
+    delete stages[i];
+
+  fprintf(stderr, "%lu / %lu records retained\n", kept, total);
+  tool_stats_finish();
+  return 0;
+
+}
@@ -0,0 +1,555 @@
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+#include "bgzf_splice.h"
+#include "record_index.h"
+#include "tool_stats.h"
+#include "big_hfile.h"
+
+// Split a BAM into shards for scatter across processes or nodes without decoding it. plan picks
+// record-aligned virtual offsets splitting the file into roughly equal compressed byte ranges (or
+// equal record counts, given a record_index .ri) and writes them to a manifest; each worker then
+// extracts its own shard, which copies whole BGZF blocks and recompresses only the two partial
+// blocks at its ends. Gather the results with bam_cat.
+//
+// To find a split point, plan seeks to the target byte, scans for the next BGZF block header
+// (checking that another follows it) and then looks for an offset within that block where a run
+// of plausible BAM records starts, as the header's contig count and each record's field lengths
+// make a chance match vanishingly unlikely. For name-sorted or qname-grouped input, split points
+// move forward to the next change of qname so no worker sees part of a read's group.
+//
+// Manifest: a # comment, then per shard a tab-separated line of shard number, start and end
+// virtual offsets, and the compressed bytes between them.
+
+static void usage() {
+
+  fprintf(stderr, "Usage: bam_split plan [-n shards] [-r] [-q | -Q] [-m manifest] [-w prefix] in.bam\n");
+  fprintf(stderr, "       bam_split extract [-o out.bam] in.bam manifest shard\n");
+  fprintf(stderr, "\tplan writes the manifest (default in.bam.shards); extract writes one shard (default stdout)\n");
+  fprintf(stderr, "\t-n\tNumber of shards (default 8)\n");
+  fprintf(stderr, "\t-r\tBalance record counts rather than bytes, using in.bam.ri from record_index build\n");
+  fprintf(stderr, "\t-q\tKeep qname groups whole (the default if the header says SO:queryname or GO:query)\n");
+  fprintf(stderr, "\t-Q\tDon't keep qname groups whole\n");
+  fprintf(stderr, "\t-w\tAlso write each shard to prefix.NNNN.bam\n");
+  exit(1);
+
+}
+
+static inline uint32_t get_le16(const uint8_t* p) {
+  return p[0] | p[1] << 8;
+}
+
+static inline uint32_t get_le32(const uint8_t* p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// As bgzf_write_block writes them: gzip with FEXTRA holding just the BC subfield.
+static inline bool is_bgzf_header(const uint8_t* p) {
+
+  return p[0] == 31 && p[1] == 139 && p[2] == 8 && (p[3] & 4) && get_le16(p + 10) == 6 &&
+    p[12] == 'B' && p[13] == 'C' && get_le16(p + 14) == 2;
+
+}
+
+static const int bgzf_header_len = 18;
+
+struct BlockPos {
+
+  int64_t coffset;
+  uint32_t clen, isize;
+
+};
+
+// The first BGZF block starting at or after byte pos and before limit, confirmed by another block
+// header (or limit) directly after it. Returns false if there's none.
+
+static bool find_block(hFILE* raw, int64_t pos, int64_t limit, BlockPos& block) {
+
+  std::vector<uint8_t> buf(4 * BGZF_MAX_BLOCK_SIZE);
+
+  while(pos < limit) {
+
+    if(hseek(raw, pos, SEEK_SET) < 0)
+      return false;
+    ssize_t n = hread(raw, &buf[0], std::min((int64_t)buf.size(), limit - pos));
+    if(n <= 0)
+      return false;
+    bool to_limit = pos + n == limit;
+
+    // Leave room to see the whole block and the header after it, unless the buffer reaches limit.
+    ssize_t scan_end = to_limit ? n - bgzf_header_len : n - BGZF_MAX_BLOCK_SIZE - bgzf_header_len;
+    for(ssize_t i = 0; i <= scan_end; ++i) {
+
+      if(!is_bgzf_header(&buf[i]))
+	continue;
+      uint32_t clen = get_le16(&buf[i + 16]) + 1;
+      if(i + clen > (size_t)n)
+	continue;
+      if(!(i + clen == (size_t)n && to_limit) && !(i + clen + bgzf_header_len <= (size_t)n && is_bgzf_header(&buf[i + clen])))
+	continue;
+
+      block.coffset = pos + i;
+      block.clen = clen;
+      block.isize = get_le32(&buf[i + clen - 4]);
+      return true;
+
+    }
+
+    if(to_limit)
+      return false;
+    pos += scan_end + 1;
+
+  }
+
+  return false;
+
+}
+
+// Whether r, of length len, looks like a BAM record (less its length field) for this header.
+
+static bool plausible_record(const uint8_t* r, uint32_t len, int32_t n_targets) {
+
+  if(len < 32)
+    return false;
+
+  int32_t tid = get_le32(r), pos = get_le32(r + 4);
+  uint32_t l_qname = r[8];
+  uint32_t n_cigar = get_le16(r + 12);
+  int32_t l_seq = get_le32(r + 16);
+  int32_t mtid = get_le32(r + 20), mpos = get_le32(r + 24);
+
+  if(tid < -1 || tid >= n_targets || mtid < -1 || mtid >= n_targets || pos < -1 || mpos < -1 || l_qname < 1 || l_seq < 0)
+    return false;
+  if(32 + l_qname + 4 * (uint64_t)n_cigar + (l_seq + 1) / 2 + (uint64_t)l_seq > len)
+    return false;
+
+  const uint8_t* qname = r + 32;
+  if(qname[l_qname - 1])
+    return false;
+  for(uint32_t i = 0; i + 1 < l_qname; ++i) {
+    if(qname[i] < '!' || qname[i] > '~')
+      return false;
+  }
+
+  const uint8_t* cigar = qname + l_qname;
+  for(uint32_t i = 0; i < n_cigar; ++i) {
+    if((cigar[4 * i] & 0xf) > BAM_CBACK)
+      return false;
+  }
+
+  return true;
+
+}
+
+// Whether a run of plausible records starts at buf[start]: eight in a row, or as many as fit
+// before the end of buf, if that's the end of the file or they're too long for more to fit.
+
+static bool record_run_at(const std::vector<uint8_t>& buf, size_t n, size_t start, bool to_eof, int32_t n_targets) {
+
+  size_t p = start;
+  int valid = 0;
+
+  while(valid < 8) {
+
+    if(p == n)
+      return to_eof && valid;
+    if(n - p < 4 + 32 || p + 4 + get_le32(&buf[p]) > n)
+      return !to_eof && valid >= 2;
+
+    uint32_t len = get_le32(&buf[p]);
+    if(!plausible_record(&buf[p + 4], len, n_targets))
+      return false;
+    ++valid;
+    p += 4 + len;
+
+  }
+
+  return true;
+
+}
+
+struct BamFile {
+
+  const char* fname;
+  htsFile* hf;
+  bam_hdr_t* header;
+  hFILE* raw;
+  int64_t data_start;
+  // The virtual offset of the EOF marker block, or of the end of the file if there's none.
+  int64_t data_end;
+
+};
+
+static void open_bam(const char* fname, BamFile& in) {
+
+  in.fname = fname;
+
+  // Seeking around, so big buffers and readahead would be waste.
+  in.hf = hts_open(fname, "r");
+  if(!in.hf) {
+    fprintf(stderr, "Failed to open %s\n", fname);
+    exit(1);
+  }
+  if(in.hf->format.format != bam || in.hf->format.compression != bgzf) {
+    fprintf(stderr, "%s is not a BGZF-compressed BAM file\n", fname);
+    exit(1);
+  }
+
+  in.header = sam_hdr_read(in.hf);
+  if(!in.header) {
+    fprintf(stderr, "Failed to read header from %s\n", fname);
+    exit(1);
+  }
+  in.data_start = bgzf_tell(in.hf->fp.bgzf);
+
+  struct stat st;
+  in.raw = hopen(fname, "r");
+  if(!in.raw || stat(fname, &st)) {
+    fprintf(stderr, "Failed to open %s\n", fname);
+    exit(1);
+  }
+
+  int64_t size = st.st_size;
+  uint8_t tail[sizeof(bgzf_eof_marker)];
+  if(size >= (int64_t)sizeof(tail) && hseek(in.raw, size - sizeof(tail), SEEK_SET) >= 0 &&
+     hread(in.raw, tail, sizeof(tail)) == sizeof(tail) && !memcmp(tail, bgzf_eof_marker, sizeof(tail)))
+    size -= sizeof(tail);
+  in.data_end = size << 16;
+
+}
+
+static void close_bam(BamFile& in) {
+
+  hclose(in.raw);
+  bam_hdr_destroy(in.header);
+  hts_close(in.hf);
+
+}
+
+// The first record starting in or after the block at or after byte target, or data_end.
+
+static int64_t record_start_after(BamFile& in, int64_t target) {
+
+  BGZF* bgzf = in.hf->fp.bgzf;
+  std::vector<uint8_t> buf(4 * 1024 * 1024);
+  int64_t pos = target;
+  int64_t limit = in.data_end >> 16;
+
+  // A few blocks' grace in case one holds nothing but the middle of a long record.
+  for(int tries = 0; tries < 64; ++tries) {
+
+    BlockPos block;
+    if(!find_block(in.raw, pos, limit, block))
+      return in.data_end;
+
+    if(bgzf_seek(bgzf, block.coffset << 16, SEEK_SET) < 0) {
+      fprintf(stderr, "Failed to seek in %s\n", in.fname);
+      exit(1);
+    }
+    ssize_t n = bgzf_read(bgzf, &buf[0], buf.size());
+    if(n < 0) {
+      fprintf(stderr, "Failed to read %s\n", in.fname);
+      exit(1);
+    }
+    bool to_eof = (size_t)n < buf.size();
+
+    for(uint32_t u = 0; u < block.isize; ++u) {
+      if(record_run_at(buf, n, u, to_eof, in.header->n_targets))
+	return block.coffset << 16 | u;
+    }
+
+    pos = block.coffset + block.clen;
+
+  }
+
+  fprintf(stderr, "Failed to find a record boundary in %s after byte %lld\n", in.fname, (long long)target);
+  exit(1);
+
+}
+
+// The first record at or after start whose qname differs from the one at start, or data_end.
+
+static int64_t next_qname_group(BamFile& in, int64_t start) {
+
+  BGZF* bgzf = in.hf->fp.bgzf;
+  if(bgzf_seek(bgzf, start, SEEK_SET) < 0) {
+    fprintf(stderr, "Failed to seek in %s\n", in.fname);
+    exit(1);
+  }
+
+  bam1_t* rec = bam_init1();
+  std::string qname;
+  int64_t voffset = start;
+  int ret;
+
+  while((ret = sam_read1(in.hf, in.header, rec)) >= 0) {
+    if(voffset == start)
+      qname = bam_get_qname(rec);
+    else if(qname != bam_get_qname(rec))
+      break;
+    voffset = bgzf_tell(bgzf);
+  }
+
+  if(ret < -1) {
+    fprintf(stderr, "Failed to read %s\n", in.fname);
+    exit(1);
+  }
+
+  bam_destroy1(rec);
+  return ret < 0 ? in.data_end : voffset;
+
+}
+
+static bool header_says_grouped(const bam_hdr_t* header) {
+
+  if(!header->text || strncmp(header->text, "@HD", 3))
+    return false;
+  const char* eol = strchr(header->text, '\n');
+  std::string hd(header->text, eol ? eol - header->text : strlen(header->text));
+  return hd.find("\tSO:queryname") != std::string::npos || hd.find("\tGO:query") != std::string::npos;
+
+}
+
+// Write records [start, end) of in, under its header, to out_name.
+
+static void write_shard(BamFile& in, int64_t start, int64_t end, const char* out_name) {
+
+  htsFile* hfo = hts_open_tuned(out_name, "wb");
+  if(!hfo) {
+    fprintf(stderr, "Failed to open %s\n", out_name);
+    exit(1);
+  }
+  if(sam_hdr_write(hfo, in.header)) {
+    fprintf(stderr, "Failed to write header to %s\n", out_name);
+    exit(1);
+  }
+
+  StageTimer timer(tool_stage_write);
+  if(bgzf_seek(in.hf->fp.bgzf, start, SEEK_SET) < 0 || !bgzf_splice_range(in.hf->fp.bgzf, hfo->fp.bgzf, end)) {
+    fprintf(stderr, "Failed to copy records from %s to %s\n", in.fname, out_name);
+    exit(1);
+  }
+
+  if(hts_close(hfo)) {
+    fprintf(stderr, "Failed to close %s\n", out_name);
+    exit(1);
+  }
+
+}
+
+static int plan(int argc, char** argv) {
+
+  int nshards = 8;
+  bool by_records = false;
+  int grouped = -1;
+  std::string manifest_name;
+  const char* prefix = 0;
+
+  int c;
+  while((c = getopt(argc, argv, "n:rqQm:w:")) >= 0) {
+    switch(c) {
+    case 'n':
+      nshards = atoi(optarg);
+      break;
+    case 'r':
+      by_records = true;
+      break;
+    case 'q':
+      grouped = 1;
+      break;
+    case 'Q':
+      grouped = 0;
+      break;
+    case 'm':
+      manifest_name = optarg;
+      break;
+    case 'w':
+      prefix = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(optind + 1 != argc || nshards < 1)
+    usage();
+
+  const char* fname = argv[optind];
+  if(manifest_name.empty())
+    manifest_name = std::string(fname) + ".shards";
+
+  BamFile in;
+  open_bam(fname, in);
+  if(grouped == -1)
+    grouped = header_says_grouped(in.header);
+
+  std::vector<int64_t> splits;
+  splits.push_back(in.data_start);
+
+  {
+    StageTimer timer(tool_stage_compute);
+
+    if(by_records) {
+
+      RecordIndex index;
+      std::string ri_name = record_index_filename(fname);
+      const char* err = index.load(ri_name.c_str());
+      if(err) {
+	fprintf(stderr, "Failed to load %s: %s\n", ri_name.c_str(), err);
+	exit(1);
+      }
+      for(int i = 1; i < nshards; ++i) {
+	uint64_t rec = index.size() * i / nshards;
+	splits.push_back(rec < index.size() ? (int64_t)index.offset(rec) : in.data_end);
+      }
+
+    }
+    else {
+
+      int64_t first = in.data_start >> 16, last = in.data_end >> 16;
+      for(int i = 1; i < nshards; ++i)
+	splits.push_back(record_start_after(in, first + (last - first) * i / nshards));
+
+    }
+
+    if(grouped) {
+      for(int i = 1; i < nshards; ++i) {
+	if(splits[i] != in.data_end)
+	  splits[i] = next_qname_group(in, splits[i]);
+      }
+    }
+
+  }
+
+  splits.push_back(in.data_end);
+
+  // Shards made empty by ties (e.g. one qname group spanning several targets) are dropped.
+  std::vector<std::pair<int64_t, int64_t> > shards;
+  for(int i = 0; i < nshards; ++i) {
+    int64_t end = std::max(splits[i + 1], splits[i]);
+    splits[i + 1] = end;
+    if(end > splits[i])
+      shards.push_back(std::make_pair(splits[i], end));
+  }
+
+  FILE* manifest = fopen(manifest_name.c_str(), "w");
+  if(!manifest) {
+    fprintf(stderr, "Failed to open %s\n", manifest_name.c_str());
+    exit(1);
+  }
+
+  fprintf(manifest, "# bam_split %s: %lu shards by %s%s; shard, start and end virtual offsets, compressed bytes\n", fname,
+	  (unsigned long)shards.size(), by_records ? "records" : "bytes", grouped ? ", qname groups kept whole" : "");
+  for(size_t i = 0; i < shards.size(); ++i) {
+    fprintf(manifest, "%lu\t%lld\t%lld\t%lld\n", (unsigned long)i, (long long)shards[i].first, (long long)shards[i].second,
+	    (long long)((shards[i].second >> 16) - (shards[i].first >> 16)));
+  }
+
+  if(fclose(manifest)) {
+    fprintf(stderr, "Failed to write %s\n", manifest_name.c_str());
+    exit(1);
+  }
+
+  fprintf(stderr, "Wrote %lu shards to %s\n", (unsigned long)shards.size(), manifest_name.c_str());
+
+  if(prefix) {
+    for(size_t i = 0; i < shards.size(); ++i) {
+      char out_name[4096];
+      snprintf(out_name, sizeof(out_name), "%s.%04lu.bam", prefix, (unsigned long)i);
+      write_shard(in, shards[i].first, shards[i].second, out_name);
+    }
+  }
+
+  close_bam(in);
+  return 0;
+
+}
+
+static int extract(int argc, char** argv) {
+
+  const char* out_name = "-";
+
+  int c;
+  while((c = getopt(argc, argv, "o:")) >= 0) {
+    switch(c) {
+    case 'o':
+      out_name = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(optind + 3 != argc)
+    usage();
+
+  const char* fname = argv[optind];
+  const char* manifest_name = argv[optind + 1];
+  unsigned long want = strtoul(argv[optind + 2], 0, 10);
+
+  FILE* manifest = fopen(manifest_name, "r");
+  if(!manifest) {
+    fprintf(stderr, "Failed to open %s\n", manifest_name);
+    exit(1);
+  }
+
+  char line[256];
+  bool found = false;
+  long long start, end;
+  while(!found && fgets(line, sizeof(line), manifest)) {
+    unsigned long shard;
+    if(line[0] != '#' && sscanf(line, "%lu\t%lld\t%lld", &shard, &start, &end) == 3 && shard == want)
+      found = true;
+  }
+  fclose(manifest);
+
+  if(!found) {
+    fprintf(stderr, "Shard %lu isn't in %s\n", want, manifest_name);
+    exit(1);
+  }
+
+  BamFile in;
+  open_bam(fname, in);
+  if(end > in.data_end) {
+    fprintf(stderr, "%s doesn't match %s (shard %lu ends past the end of the file)\n", manifest_name, fname, want);
+    exit(1);
+  }
+  write_shard(in, start, end, out_name);
+  close_bam(in);
+  return 0;
+
+}
+
+int main(int argc, char** argv) {
+
+  if(argc < 2)
+    usage();
+
+  tool_stats_init("bam_split");
+
+  std::string cmd = argv[1];
+  int ret = 1;
+  if(cmd == "plan")
+    ret = plan(argc - 1, argv + 1);
+  else if(cmd == "extract")
+    ret = extract(argc - 1, argv + 1);
+  else
+    usage();
+
+  tool_stats_finish();
+  return ret;
+
+}
@@ -0,0 +1,369 @@
+#ifndef SAMTOYS_BAM_VIEW_H
+#define SAMTOYS_BAM_VIEW_H
+
+// Read-only, mostly zero-copy iteration over an uncompressed ("wb0") BAM file. The file is mmapped
+// and each BGZF block whose deflate stream is a single stored block is used in place, so a record
+// that lies within one block is handed out as a bam1_t whose data points straight into the mapping.
+// Records that straddle a block boundary, and blocks that really are compressed (such as the EOF
+// marker, or a file that's only partly level 0), are gathered / inflated into a scratch buffer.
+//
+// BamView::open returns 0 (having consumed nothing) unless the input is a regular file holding BGZF
+// BAM whose first block is stored, so callers can fall back to sam_read1 for pipes, SAM, CRAM and
+// compressed BAM. The record is only valid until the next call to next(), and must not be modified:
+// the mapping is read-only. Unlike sam_read1, views don't expand CG tags on records with more than
+// 65535 CIGAR operations, so tools that look at long reads' CIGARs shouldn't use them.
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+// CIGARs are read as uint32_t; these can do that unaligned, so in-place records needn't be padded.
+#define BAM_VIEW_UNALIGNED_OK 1
+#else
+#define BAM_VIEW_UNALIGNED_OK 0
+#endif
+
+struct BamRecordView {
+
+  // The record as stored in the file, including its 4-byte length, for forwarding unchanged.
+  const uint8_t* raw;
+  uint32_t raw_len;
+  // Decoded core fields, with data pointing into raw where possible.
+  bam1_t* rec;
+
+};
+
+static inline uint32_t bam_view_le32(const uint8_t* p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint16_t bam_view_le16(const uint8_t* p) {
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+class BamView {
+
+  std::string fname;
+  const uint8_t* map;
+  size_t map_len;
+  size_t next_block;
+
+  // The current block's uncompressed bytes not yet consumed, in the mapping or in block_buf.
+  const uint8_t* cur;
+  const uint8_t* cur_end;
+  std::vector<uint8_t> block_buf, record_buf, padded_buf;
+  z_stream zs;
+
+  bam1_t* rec;
+  uint64_t n_in_place, n_copied;
+
+  BamView(const char* _fname, const uint8_t* _map, size_t _map_len) :
+    fname(_fname), map(_map), map_len(_map_len), next_block(0), cur(0), cur_end(0), n_in_place(0), n_copied(0) {
+
+    memset(&zs, 0, sizeof(zs));
+    if(inflateInit2(&zs, -15) != Z_OK) {
+      fprintf(stderr, "Failed to initialise zlib\n");
+      exit(1);
+    }
+    rec = bam_init1();
+
+  }
+
+  void corrupt(const char* what) {
+    fprintf(stderr, "%s: %s at offset %lu\n", fname.c_str(), what, (unsigned long)next_block);
+    exit(1);
+  }
+
+  // Find the deflate data of the BGZF block at offset; returns its total length, or 0 if it isn't one.
+  static size_t parse_block(const uint8_t* map, size_t map_len, size_t offset, const uint8_t** cdata, size_t* clen, uint32_t* isize) {
+
+    const uint8_t* p = map + offset;
+    size_t avail = map_len - offset;
+    if(avail < 18 || p[0] != 31 || p[1] != 139 || p[2] != 8 || !(p[3] & 4))
+      return 0;
+
+    size_t xlen = bam_view_le16(p + 10);
+    if(12 + xlen > avail)
+      return 0;
+
+    size_t bsize = 0;
+    for(size_t x = 12; x + 4 <= 12 + xlen; x += 4 + bam_view_le16(p + x + 2)) {
+      if(p[x] == 'B' && p[x + 1] == 'C' && bam_view_le16(p + x + 2) == 2) {
+	bsize = bam_view_le16(p + x + 4) + 1;
+	break;
+      }
+    }
+    if(!bsize || bsize > avail || bsize < 12 + xlen + 8)
+      return 0;
+
+    *cdata = p + 12 + xlen;
+    *clen = bsize - (12 + xlen) - 8;
+    *isize = bam_view_le32(p + bsize - 4);
+    return bsize;
+
+  }
+
+  // A deflate stream that is one final stored block: its payload can be used as is.
+  static bool is_single_stored(const uint8_t* cdata, size_t clen, uint32_t isize) {
+    return clen == isize + 5 && cdata[0] == 1 && bam_view_le16(cdata + 1) == isize && bam_view_le16(cdata + 3) == (uint16_t)~isize;
+  }
+
+  // Make the next block current. Returns false at the end of the file.
+  bool load_block() {
+
+    while(next_block < map_len) {
+
+      const uint8_t* cdata;
+      size_t clen;
+      uint32_t isize;
+      size_t bsize = parse_block(map, map_len, next_block, &cdata, &clen, &isize);
+      if(!bsize)
+	corrupt("Bad BGZF block");
+
+      next_block += bsize;
+      // Empty blocks, such as the EOF marker, have nothing to decompress.
+      if(!isize)
+	continue;
+
+      if(is_single_stored(cdata, clen, isize)) {
+	cur = cdata + 5;
+      }
+      else {
+	block_buf.resize(isize);
+	if(inflateReset(&zs) != Z_OK)
+	  corrupt("Failed to reset zlib");
+	zs.next_in = (Bytef*)cdata;
+	zs.avail_in = clen;
+	zs.next_out = &block_buf[0];
+	zs.avail_out = isize;
+	if(inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.avail_out)
+	  corrupt("Failed to decompress BGZF block");
+	cur = &block_buf[0];
+      }
+
+      cur_end = cur + isize;
+      return true;
+
+    }
+
+    return false;
+
+  }
+
+  // Append n bytes of the stream to record_buf, across blocks as needed.
+  void take(size_t n) {
+
+    while(n) {
+      if(cur == cur_end && !load_block())
+	corrupt("Truncated record");
+      size_t k = std::min(n, (size_t)(cur_end - cur));
+      record_buf.insert(record_buf.end(), cur, cur + k);
+      cur += k;
+      n -= k;
+    }
+
+  }
+
+  void decode(const uint8_t* raw, uint32_t raw_len) {
+
+    if(raw_len < 36)
+      corrupt("Record too short");
+
+    const uint8_t* p = raw + 4;
+    bam1_core_t* c = &rec->core;
+    c->tid = (int32_t)bam_view_le32(p);
+    c->pos = (int32_t)bam_view_le32(p + 4);
+    c->l_qname = p[8];
+    c->qual = p[9];
+    c->bin = bam_view_le16(p + 10);
+    c->n_cigar = bam_view_le16(p + 12);
+    c->flag = bam_view_le16(p + 14);
+    c->l_qseq = (int32_t)bam_view_le32(p + 16);
+    c->mtid = (int32_t)bam_view_le32(p + 20);
+    c->mpos = (int32_t)bam_view_le32(p + 24);
+    c->isize = (int32_t)bam_view_le32(p + 28);
+    c->l_extranul = 0;
+
+    uint32_t l_data = raw_len - 36;
+    if(!c->l_qname || c->l_qseq < 0 ||
+       (uint64_t)c->l_qname + 4 * (uint64_t)c->n_cigar + (c->l_qseq + 1) / 2 + c->l_qseq > l_data)
+      corrupt("Malformed record");
+
+    rec->data = (uint8_t*)(p + 32);
+    rec->l_data = l_data;
+    rec->m_data = l_data;
+
+  }
+
+public:
+
+  static BamView* open(const char* fname, bam_hdr_t** header) {
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    return 0;
+#endif
+
+    bool is_stdin = !strcmp(fname, "-");
+    int fd = is_stdin ? STDIN_FILENO : ::open(fname, O_RDONLY);
+    if(fd < 0)
+      return 0;
+
+    struct stat st;
+    if(fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size < 28) {
+      if(!is_stdin)
+	close(fd);
+      return 0;
+    }
+
+    const uint8_t* map = (const uint8_t*)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(!is_stdin)
+      close(fd);
+    if(map == MAP_FAILED)
+      return 0;
+
+    const uint8_t* cdata;
+    size_t clen;
+    uint32_t isize;
+    if(!parse_block(map, st.st_size, 0, &cdata, &clen, &isize) || !is_single_stored(cdata, clen, isize)) {
+      munmap((void*)map, st.st_size);
+      return 0;
+    }
+
+    // Let htslib parse the header, through a dup so closing it leaves stdin alone, then start
+    // from wherever that left off.
+    hFILE* hfile;
+    if(is_stdin) {
+      int hfd = dup(STDIN_FILENO);
+      hfile = hfd >= 0 ? hdopen(hfd, "r") : 0;
+    }
+    else
+      hfile = hopen(fname, "r");
+    htsFile* hf = hfile ? hts_hopen(hfile, fname, "r") : 0;
+    if(!hf) {
+      fprintf(stderr, "Failed to open %s\n", fname);
+      exit(1);
+    }
+    if(hf->format.format != bam) {
+      hts_close(hf);
+      munmap((void*)map, st.st_size);
+      if(is_stdin)
+	lseek(STDIN_FILENO, 0, SEEK_SET);
+      return 0;
+    }
+
+    *header = sam_hdr_read(hf);
+    if(!*header) {
+      fprintf(stderr, "Failed to read header from %s\n", fname);
+      exit(1);
+    }
+    uint64_t voffset = bgzf_tell(hf->fp.bgzf);
+    hts_close(hf);
+
+    BamView* view = new BamView(fname, map, st.st_size);
+    madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+    view->next_block = voffset >> 16;
+    if(view->load_block())
+      view->cur += voffset & 0xffff;
+    return view;
+
+  }
+
+  ~BamView() {
+
+    // The data belongs to the mapping or our buffers, not to rec.
+    rec->data = 0;
+    bam_destroy1(rec);
+    inflateEnd(&zs);
+    munmap((void*)map, map_len);
+
+  }
+
+  // Fills v with the next record; returns false at EOF.
+  bool next(BamRecordView& v) {
+
+    while(cur == cur_end) {
+      if(!load_block())
+	return false;
+    }
+
+    const uint8_t* raw;
+    uint32_t raw_len;
+
+    if(cur_end - cur >= 4 && (size_t)(cur_end - cur) >= 4 + (size_t)bam_view_le32(cur)) {
+      raw = cur;
+      raw_len = 4 + bam_view_le32(cur);
+      cur += raw_len;
+      ++n_in_place;
+    }
+    else {
+      record_buf.clear();
+      take(4);
+      take(bam_view_le32(&record_buf[0]));
+      raw = &record_buf[0];
+      raw_len = record_buf.size();
+      ++n_copied;
+    }
+
+    decode(raw, raw_len);
+
+#if !BAM_VIEW_UNALIGNED_OK
+    // Pad the qname as sam_read1 does so the CIGAR is 4-byte aligned.
+    uint32_t extranul = (4 - ((uintptr_t)(rec->data + rec->core.l_qname) & 3)) & 3;
+    if(extranul) {
+      padded_buf.assign(rec->data, rec->data + rec->core.l_qname);
+      padded_buf.insert(padded_buf.end(), extranul, 0);
+      padded_buf.insert(padded_buf.end(), rec->data + rec->core.l_qname, rec->data + rec->l_data);
+      rec->data = &padded_buf[0];
+      rec->l_data += extranul;
+      rec->m_data = rec->l_data;
+      rec->core.l_qname += extranul;
+      rec->core.l_extranul = extranul;
+    }
+#endif
+
+    v.raw = raw;
+    v.raw_len = raw_len;
+    v.rec = rec;
+    return true;
+
+  }
+
+  uint64_t in_place() const {
+    return n_in_place;
+  }
+
+  uint64_t copied() const {
+    return n_copied;
+  }
+
+};
+
+// Forward a record unchanged to a BAM output whose header has the same references, starting a new
+// BGZF block first if it would otherwise straddle one, as bam_write1 does.
+
+static int bam_view_write(BGZF* out, const BamRecordView& v) {
+
+  if(bgzf_flush_try(out, v.raw_len) < 0)
+    return -1;
+  return bgzf_write(out, v.raw, v.raw_len) == (ssize_t)v.raw_len ? 0 : -1;
+
+}
+
+#endif
@@ -13,6 +13,13 @@
 #include <htslib/sam.h>
 #include <htslib/bgzf.h>
 
+#include "cigar_stats.h"
+#include "tool_stats.h"
+#include "big_hfile.h"
+#include "output_level.h"
+#include "mem_stats.h"
+#include "qname_cmp.h"
+
 enum scoringmethods {
   
   scoringmethod_nmatches,
@@ -22,32 +29,6 @@ enum scoringmethods {
 
 };
 
-// Borrowed from Samtools source, since samtools sort -n uses this ordering:
-
-static int strnum_cmp(const char *_a, const char *_b)
-{
-    const unsigned char *a = (const unsigned char*)_a, *b = (const unsigned char*)_b;
-    const unsigned char *pa = a, *pb = b;
-    while (*pa && *pb) {
-        if (isdigit(*pa) && isdigit(*pb)) {
-            while (*pa == '0') ++pa;
-            while (*pb == '0') ++pb;
-            while (isdigit(*pa) && isdigit(*pb) && *pa == *pb) ++pa, ++pb;
-            if (isdigit(*pa) && isdigit(*pb)) {
-                int i = 0;
-                while (isdigit(pa[i]) && isdigit(pb[i])) ++i;
-                return isdigit(pa[i])? 1 : isdigit(pb[i])? -1 : (int)*pa - (int)*pb;
-            } else if (isdigit(*pa)) return 1;
-            else if (isdigit(*pb)) return -1;
-            else if (pa - a != pb - b) return pa - a < pb - b? 1 : -1;
-        } else {
-            if (*pa != *pb) return (int)*pa - (int)*pb;
-            ++pa; ++pb;
-        }
-    }
-    return *pa? 1 : *pb? -1 : 0;
-}
-
 static bool mixed_ordering = true;
 
 static int qname_cmp(const char* qa, const char* qb) {
@@ -74,7 +55,7 @@ static void usage() {
 
 static htsFile* hts_begin_or_die(const char* filename, const char* mode, bam_hdr_t* header, int nthreads) {
 
-  htsFile* hf = hts_open(filename, mode);
+  htsFile* hf = hts_open_output(filename, mode);
   if(!hf) {
     fprintf(stderr, "Failed to open %s\n", filename);
     exit(1);
@@ -134,7 +115,7 @@ public:
     checkStarted();
 
     if(refCount == 1)
-      hts_close(hts);
+      hts_close_output(hts);
 
     return --refCount;
 
@@ -336,6 +317,7 @@ public:
       }
 
       headerout->text[headerout->l_text] = '\0';
+      mem_stats_header(headerout);
 				
     }
 
@@ -362,7 +344,7 @@ public:
 	rec->core.mtid += header2_offset;
     }
 
-    sam_write1(hts, headerout, rec);
+    output_write1(hts, headerout, rec);
 
     if(headerNum == 2) {
       if(rec->core.tid != -1)
@@ -444,49 +426,18 @@ static uint32_t get_alignment_score(bam1_t* rec, bool is_input_a) {
   case scoringmethod_nmatches:
     {
 
-      bool seen_equal_or_diff = false;
-      int32_t cigar_total = 0;
-      const uint32_t* cigar = bam_get_cigar(rec);
-
-      int32_t indel_edit_distance = 0;
-
-      for(int i = 0; i < rec->core.n_cigar; ++i) {
-
-	// CIGAR scoring: score points for matching bases, and negatives for deletions
-	// since otherwise 10M10D10M would score the same as 20M. Insertions, clipping etc
-	// don't need to score a penalty since they skip bases in the query.
-	// CREF_SKIP (N / intron-skip operator) is acceptable: 10M1000N10M is as good as 20M.
-	// Insertions are counted to correct the NM tag below only.
-	
-	int32_t n = bam_cigar_oplen(cigar[i]);
-	switch(bam_cigar_op(cigar[i])) {
-
-	case BAM_CEQUAL:
-	  seen_equal_or_diff = true;
-	  // fall through
-	case BAM_CMATCH:
-	  cigar_total += n;
-	  break;
+      // CIGAR scoring: score points for matching bases, and negatives for deletions
+      // since otherwise 10M10D10M would score the same as 20M. Insertions, clipping etc
+      // don't need to score a penalty since they skip bases in the query.
+      // CREF_SKIP (N / intron-skip operator) is acceptable: 10M1000N10M is as good as 20M.
+      // Insertions are counted to correct the NM tag below only.
 
-	case BAM_CDEL:
-	  indel_edit_distance += n;
-	  cigar_total -= n;
-	  break;
+      CigarStats cigar;
+      cigar_stats(rec, &cigar);
 
-	case BAM_CDIFF:
-	  seen_equal_or_diff = true;
-	  break;
-
-	case BAM_CINS:
-	  indel_edit_distance += n;
-	  break;
-
-	default:
-	  break;
-
-	}
-
-      }
+      bool seen_equal_or_diff = cigar.has(BAM_CEQUAL) || cigar.has(BAM_CDIFF);
+      int32_t cigar_total = (int32_t)cigar.matched() - (int32_t)cigar.deleted();
+      int32_t indel_edit_distance = (int32_t)(cigar.inserted() + cigar.deleted());
 
       // The BAM_CMATCH operator (unlike BAM_CEQUAL or BAM_CDIFF) could mean a match or a mismatch
       // with same length (e.g. a SNP). If the file doesn't seem to use the advanced operators try to
@@ -632,7 +583,7 @@ struct SamReader {
     if(rec->data)
       bam_copy1(prev_rec, rec);
 
-    if(sam_read1(hf, header, rec) < 0)
+    if(tool_stats_read1(hf, header, rec) < 0)
       eof = true;
     
     if(prev_rec->data && (!eof) && qname_cmp(bam_get_qname(rec), bam_get_qname(prev_rec)) < 0) {
@@ -650,7 +601,8 @@ struct SamReader {
 
 struct BamRecVector {
 
-  std::vector<bam1_t*> recs;
+  typedef std::vector<bam1_t*, CountingAllocator<bam1_t*, mem_groups> > rec_list;
+  rec_list recs;
 
   BamRecVector() {}
   ~BamRecVector() {
@@ -658,16 +610,17 @@ struct BamRecVector {
   }
 
   void take_add(bam1_t* src) {
+    mem_stats_alloc(mem_records, sizeof(bam1_t) + src->m_data);
     recs.push_back(src);
   }
 
   void copy_add(bam1_t* src) {
-    recs.push_back(bam_dup1(src));
+    recs.push_back(mem_stats_bam_dup1(src));
   }
 
   void clear() {
-    for(std::vector<bam1_t*>::iterator it = recs.begin(), itend = recs.end(); it != itend; ++it)
-      bam_destroy1(*it);
+    for(rec_list::iterator it = recs.begin(), itend = recs.end(); it != itend; ++it)
+      mem_stats_bam_destroy1(*it);
     recs.clear();
   }
 
@@ -677,12 +630,14 @@ struct BamRecVector {
 
 };
 
-static bool uniqueValue(const std::vector<htsFileWrapper*>& in) {
+typedef std::vector<htsFileWrapper*, CountingAllocator<htsFileWrapper*, mem_groups> > file_list;
+
+static bool uniqueValue(const file_list& in) {
 
   bool outValid = false;
   htsFileWrapper* out = 0;
 
-  for(std::vector<htsFileWrapper*>::const_iterator it = in.begin(), itend = in.end(); it != itend; ++it) {
+  for(file_list::const_iterator it = in.begin(), itend = in.end(); it != itend; ++it) {
 
     if(!outValid) {
       out = *it;
@@ -703,7 +658,7 @@ static void clearMateInfo(BamRecVector& v) {
   for(int i = 0, ilim = v.recs.size(); i != ilim; ++i) {
     
     uint32_t maten = (uint32_t)flag2mate(v.recs[i]);
-    bam_aux_append(v.recs[i], "om", 'i', sizeof(uint32_t), (uint8_t*)&maten);  
+    mem_stats_bam_aux_append(v.recs[i], "om", 'i', sizeof(uint32_t), (uint8_t*)&maten);  
 
     v.recs[i]->core.flag &= ~(BAM_FPROPER_PAIR | BAM_FMREVERSE | BAM_FPAIRED | BAM_FMUNMAP | BAM_FREAD1 | BAM_FREAD2);
     v.recs[i]->core.mtid = -1;
@@ -787,6 +742,9 @@ int main(int argc, char** argv) {
   else
     usage();
 
+  tool_stats_init("bamcmp");
+  mem_stats_init("bamcmp");
+
   htsFile *in1hf = 0, *in2hf = 0;
   htsFileWrapper *firstbetter_out = 0, *secondbetter_out = 0, *firstworse_out = 0, *secondworse_out = 0, *first_out = 0, *second_out = 0;
   in1hf = hts_begin_or_die(in1_name, "r", 0, nthreads);
@@ -794,6 +752,8 @@ int main(int argc, char** argv) {
 
   bam_hdr_t* header1 = sam_hdr_read(in1hf);
   bam_hdr_t* header2 = sam_hdr_read(in2hf);
+  mem_stats_header(header1);
+  mem_stats_header(header2);
 
   // Permit the outputs using like headers to share a file if they gave the same name.
 
@@ -814,7 +774,7 @@ int main(int argc, char** argv) {
   SamReader in2(in2hf, header2, in2_name);
 
   BamRecVector seqs1, seqs2;
-  std::vector<htsFileWrapper*> seqs1Files, seqs2Files;
+  file_list seqs1Files, seqs2Files;
 
   while((!in1.is_eof()) && (!in2.is_eof())) {
 
@@ -872,13 +832,13 @@ int main(int argc, char** argv) {
 	  }
 	  	  
 	  for(uint32_t i = group_start_idx1; i <= idx1; ++i) {
-	    bam_aux_append(seqs1.recs[i], "as", 'i', sizeof(uint32_t), (uint8_t*)&score1);  
-	    bam_aux_append(seqs1.recs[i], "bs", 'i', sizeof(uint32_t), (uint8_t*)&score2);  
+	    mem_stats_bam_aux_append(seqs1.recs[i], "as", 'i', sizeof(uint32_t), (uint8_t*)&score1);  
+	    mem_stats_bam_aux_append(seqs1.recs[i], "bs", 'i', sizeof(uint32_t), (uint8_t*)&score2);  
 	  }
 
 	  for(uint32_t i = group_start_idx2; i <= idx2; ++i) {
-	    bam_aux_append(seqs2.recs[i], "as", 'i', sizeof(uint32_t), (uint8_t*)&score1);  
-	    bam_aux_append(seqs2.recs[i], "bs", 'i', sizeof(uint32_t), (uint8_t*)&score2);  
+	    mem_stats_bam_aux_append(seqs2.recs[i], "as", 'i', sizeof(uint32_t), (uint8_t*)&score1);  
+	    mem_stats_bam_aux_append(seqs2.recs[i], "bs", 'i', sizeof(uint32_t), (uint8_t*)&score2);  
 	  }
 
 	  htsFileWrapper *firstRecordsFile, *secondRecordsFile;
@@ -990,4 +950,6 @@ int main(int argc, char** argv) {
   if(secondworse_out)
     htswrapper_close(secondworse_out);
 
+  tool_stats_finish();
+
 }
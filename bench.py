@@ -0,0 +1,324 @@
+#!/usr/bin/env python3
+
+# Throughput benchmarks for the tools: generate synthetic BAMs with gen_bam, run each tool over
+# them and report records/sec, MB/s, peak RSS and CPU utilisation as JSON, so runs from different
+# builds can be compared (--compare old.json new.json). --cold evicts the inputs from the page
+# cache before every run, and --io-compare runs everything with SAMTOYS_IO=off and with the default
+# big-buffer / readahead I/O to show what big_hfile.h buys on data that has to come off disk.
+# --pipe-compare runs with and without SAMTOYS_IO=vmsplice=1; the pipe_* benchmarks chain two
+# tools through a pipe, where that makes a difference.
+
+import argparse
+import json
+import os
+import platform
+import subprocess
+import sys
+import tempfile
+import time
+
+def run_pipeline(cmds, stdin=None, stdout=None, cwd=None, env=None):
+
+    """Run cmds (a list of lists) as a shell pipeline would, returning wall time, user + sys CPU
+    time summed over the processes and the largest peak RSS among them."""
+
+    fin = open(stdin, "rb") if stdin else subprocess.DEVNULL
+    fout = open(stdout, "wb") if stdout else subprocess.DEVNULL
+    start = time.monotonic()
+
+    procs = []
+    prev = fin
+    for i, cmd in enumerate(cmds):
+        last = i == len(cmds) - 1
+        # stderr goes to a file so a chatty stage can't block on a full pipe while we wait for another.
+        err = tempfile.TemporaryFile()
+        proc = subprocess.Popen(cmd, stdin=prev, stdout=fout if last else subprocess.PIPE, stderr=err, cwd=cwd, env=env)
+        if procs:
+            prev.close()
+        prev = proc.stdout
+        procs.append((cmd, proc, err))
+
+    user = sys_time = 0.0
+    max_rss = 0
+    stderr = ""
+    failed = None
+    for cmd, proc, err in procs:
+        _, status, rusage = os.wait4(proc.pid, 0)
+        user += rusage.ru_utime
+        sys_time += rusage.ru_stime
+        # ru_maxrss is in kilobytes on Linux.
+        max_rss = max(max_rss, rusage.ru_maxrss)
+        err.seek(0)
+        stderr += err.read().decode(errors="replace")
+        err.close()
+        rc = os.waitstatus_to_exitcode(status) if hasattr(os, "waitstatus_to_exitcode") else status >> 8
+        if rc != 0 and not failed:
+            failed = (cmd, rc)
+
+    wall = time.monotonic() - start
+    if stdin:
+        fin.close()
+    if stdout:
+        fout.close()
+
+    if failed:
+        sys.stderr.write(stderr)
+        raise Exception("%s failed with status %d" % (" ".join(failed[0]), failed[1]))
+
+    return {
+        "wall_s": wall,
+        "user_s": user,
+        "sys_s": sys_time,
+        "max_rss_kb": max_rss,
+        "stderr": stderr,
+    }
+
+def run_timed(cmd, stdin=None, stdout=None, cwd=None, env=None):
+
+    """Run cmd (a list), returning wall time, user + sys CPU time and peak RSS of the process."""
+
+    return run_pipeline([cmd], stdin=stdin, stdout=stdout, cwd=cwd, env=env)
+
+def evict(paths):
+
+    """Drop paths from the page cache so the next run reads them from disk. Needs no privileges,
+    unlike writing to /proc/sys/vm/drop_caches, but only drops clean pages, hence the fsync."""
+
+    for path in paths:
+        fd = os.open(path, os.O_RDONLY)
+        try:
+            os.fsync(fd)
+            os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+        finally:
+            os.close(fd)
+
+def io_modes(args):
+
+    """(label, environment) pairs to run each benchmark under."""
+
+    if not args.io_compare and not args.pipe_compare:
+        return [(None, None)]
+
+    tuned = dict(os.environ)
+    tuned.pop("SAMTOYS_IO", None)
+    modes = []
+    if args.io_compare:
+        modes += [("off", dict(os.environ, SAMTOYS_IO="off")), ("tuned", tuned)]
+    if args.pipe_compare:
+        if not args.io_compare:
+            modes.append(("tuned", tuned))
+        modes.append(("vmsplice", dict(os.environ, SAMTOYS_IO="vmsplice=1")))
+    return modes
+
+def tool(args, name):
+    return os.path.join(args.bin, name)
+
+def generate(args, work):
+
+    """Write the benchmark inputs to work, returning a dict of their paths and record counts."""
+
+    gen = tool(args, "gen_bam")
+    common = ["-n", str(args.pairs), "-c", str(args.contigs), "-L", str(args.contig_len),
+              "-m", str(args.multimap_rate), "-t", args.tags, "-s", str(args.seed), "-@", str(args.threads)]
+
+    files = {
+        "name_a": os.path.join(work, "name_a.bam"),
+        "name_b": os.path.join(work, "name_b.bam"),
+        "coord": os.path.join(work, "coord.bam"),
+        "coord_numeric": os.path.join(work, "coord_numeric.bam"),
+        "qnames": os.path.join(work, "qnames.txt"),
+    }
+
+    counts = {}
+    for key, extra in [("name_a", ["-q", files["qnames"]]),
+                       ("name_b", ["-a", str(args.seed + 1)]),
+                       ("coord", ["-C"]),
+                       ("coord_numeric", ["-C", "-b"])]:
+        res = run_timed([gen] + common + extra + ["-o", files[key]])
+        # "Wrote N records for M read pairs"
+        counts[key] = int(res["stderr"].split("Wrote ")[1].split()[0])
+
+    # Text pileups for the pileup tools, made by sample_pileup's own BAM mode.
+    files["pileup"] = os.path.join(work, "all.pileup")
+    files["pileup_sample"] = os.path.join(work, "sample.pileup")
+    run_timed([tool(args, "sample_pileup"), "-b", files["coord"], "1"], stdout=files["pileup"])
+    run_timed([tool(args, "sample_pileup"), "-b", files["coord"], "0.1"], stdout=files["pileup_sample"])
+    with open(files["pileup"], "rb") as f:
+        counts["pileup"] = sum(1 for _ in f)
+
+    # tag_and_merge_lanes wants lane-style filenames.
+    files["lanes"] = []
+    for lane in ("L001", "L002"):
+        path = os.path.join(work, "SIM_%s_R1_001.bam" % lane)
+        if os.path.lexists(path):
+            os.unlink(path)
+        os.symlink(os.path.basename(files["coord"]), path)
+        files["lanes"].append(path)
+
+    return files, counts
+
+def benchmarks(args, files, counts, work):
+
+    """(name, command, stdin, stdout, input files, records processed) for each benchmark. A command
+    that is a list of lists is a pipeline."""
+
+    t = str(args.threads)
+    out = lambda name: os.path.join(work, name)
+    na, nb, co, con = files["name_a"], files["name_b"], files["coord"], files["coord_numeric"]
+    nrecs, crecs = counts["name_a"], counts["coord"]
+
+    return [
+        ("bamcmp", [tool(args, "bamcmp"), "-1", na, "-2", nb, "-A", out("a_better.bam"), "-B", out("b_better.bam"), "-t", t],
+         None, None, [na, nb], counts["name_a"] + counts["name_b"]),
+        ("subset", [tool(args, "subset"), files["qnames"], t], na, out("subset.bam"), [na], nrecs),
+        ("filter_attr", [tool(args, "filter_attr"), "AS", ">", "BS"], na, out("filter_attr.bam"), [na], nrecs),
+        ("filter_match_ratio", [tool(args, "filter_match_ratio"), "-@", t, "0.5"], na, out("filter_match_ratio.bam"), [na], nrecs),
+        ("filter_hits", [tool(args, "filter_hits"), na, out("filter_hits.bam"), "2"], None, None, [na], nrecs),
+        ("contig_pileup", [tool(args, "contig_pileup"), na, out("contig_pileup.txt")], None, None, [na], nrecs),
+        ("remove_qname_suffix", [tool(args, "remove_qname_suffix"), "-@", t, na], None, out("remove_qname_suffix.bam"), [na], nrecs),
+        ("bam_pipeline", [tool(args, "bam_pipeline"), "-@", t, "-i", na, "-o", out("bam_pipeline.bam"),
+                          "strip_suffix", "match_ratio:0.5", "filter_attr:AS>BS"], None, None, [na], nrecs),
+        ("samflags", [tool(args, "samflags"), "-@", t, na], None, out("samflags.sam"), [na], nrecs),
+        ("bam_checksum", [tool(args, "bam_checksum"), "-@", t, na], None, None, [na], nrecs),
+        ("sort_qname", [tool(args, "sort_qname"), "-@", t, "-m", "64M", "-o", out("sort_qname.bam"), co], None, None, [co], crecs),
+        ("sample_reads", [tool(args, "sample_reads"), "-@", t, co, "0.1:" + out("sample_reads_10.bam"),
+                          "0.01:" + out("sample_reads_1.bam")], None, None, [co], crecs),
+        ("sample_pileup_bam", [tool(args, "sample_pileup"), "-@", t, "-b", co, "0.1"], None, out("sampled_bam.pileup"), [co], crecs),
+        ("sample_pileup_text", [tool(args, "sample_pileup"), "-@", t, "0.1"], files["pileup"], out("sampled_text.pileup"),
+         [files["pileup"]], counts["pileup"]),
+        ("filter_pileup", [tool(args, "filter_pileup"), files["pileup_sample"], files["pileup"]], None, out("filtered.pileup"),
+         [files["pileup_sample"], files["pileup"]], counts["pileup"]),
+        ("rename_chroms", [tool(args, "rename_chroms"), "-s", "-o", out("renamed.bam"), co], None, None, [co], crecs),
+        ("reorder_chroms", [tool(args, "reorder_chroms"), "-o", out("reordered_stream.bam"), con], None, None, [con], crecs),
+        ("reorder_chroms_indexed", [tool(args, "reorder_chroms"), "-i", "-@", t, "-o", out("reordered.bam"), con], None, None, [con], crecs),
+        ("tag_and_merge_lanes", [tool(args, "tag_and_merge_lanes"), "-@", t, out("merged.bam")] + files["lanes"], None, None,
+         files["lanes"], 2 * crecs),
+        ("bam_split", [tool(args, "bam_split"), "plan", "-n", "8", "-m", out("shards.txt"), "-w", out("shard"), na], None, None, [na], nrecs),
+        ("bam_cat", [tool(args, "bam_cat"), "-o", out("bam_cat.bam"), na, na], None, None, [na, na], 2 * nrecs),
+        ("record_index", [tool(args, "record_index"), "build", "-@", t, na], None, None, [na], nrecs),
+        # Two-stage pipelines: uncompressed and compressed BAM going through a pipe.
+        ("pipe_subset_filter_attr", [[tool(args, "subset"), files["qnames"], t], [tool(args, "filter_attr"), "AS", ">", "BS"]],
+         na, out("pipe_subset_filter_attr.bam"), [na], nrecs),
+        ("pipe_strip_match_ratio", [[tool(args, "remove_qname_suffix"), "-@", t, na], [tool(args, "filter_match_ratio"), "-@", t, "0.5"]],
+         None, out("pipe_strip_match_ratio.bam"), [na], nrecs),
+    ]
+
+def run_benchmarks(args):
+
+    work = os.path.abspath(args.workdir)
+    os.makedirs(work, exist_ok=True)
+
+    files, counts = generate(args, work)
+
+    results = []
+    for name, cmd, stdin, stdout, inputs, nrecs in benchmarks(args, files, counts, work):
+
+        if args.tools and not any(name == t or name.startswith(t + "_") for t in args.tools):
+            continue
+
+        input_bytes = sum(os.path.getsize(f) for f in inputs)
+
+        for io, env in io_modes(args):
+
+            best = None
+            for _ in range(args.repeats):
+                if args.cold:
+                    evict(inputs)
+                res = run_pipeline(cmd if isinstance(cmd[0], list) else [cmd], stdin=stdin, stdout=stdout, env=env)
+                if best is None or res["wall_s"] < best["wall_s"]:
+                    best = res
+
+            label = name if io is None else "%s[io=%s]" % (name, io)
+            wall = best["wall_s"]
+            entry = {
+                "tool": label,
+                "cmd": " | ".join(" ".join(c) for c in cmd) if isinstance(cmd[0], list) else " ".join(cmd),
+                "records": nrecs,
+                "input_bytes": input_bytes,
+                "wall_s": round(wall, 4),
+                "user_s": round(best["user_s"], 4),
+                "sys_s": round(best["sys_s"], 4),
+                "cpu_util": round((best["user_s"] + best["sys_s"]) / wall, 3) if wall else None,
+                "max_rss_kb": best["max_rss_kb"],
+                "records_per_s": round(nrecs / wall) if wall else None,
+                "mb_per_s": round(input_bytes / 1e6 / wall, 2) if wall else None,
+            }
+            results.append(entry)
+            sys.stderr.write("%-36s %8.2fs %12s rec/s %8s MB/s  cpu %5.2f  rss %d kB\n" %
+                             (label, wall, entry["records_per_s"], entry["mb_per_s"], entry["cpu_util"] or 0, entry["max_rss_kb"]))
+
+    try:
+        rev = subprocess.check_output(["git", "rev-parse", "HEAD"], cwd=os.path.dirname(os.path.abspath(__file__)),
+                                      stderr=subprocess.DEVNULL).decode().strip()
+    except Exception:
+        rev = None
+
+    report = {
+        "git_rev": rev,
+        "host": platform.node(),
+        "cpus": os.cpu_count(),
+        "time": time.strftime("%Y-%m-%dT%H:%M:%S"),
+        "params": {
+            "pairs": args.pairs, "contigs": args.contigs, "contig_len": args.contig_len,
+            "multimap_rate": args.multimap_rate, "tags": args.tags, "seed": args.seed,
+            "threads": args.threads, "repeats": args.repeats, "cold": args.cold,
+        },
+        "inputs": counts,
+        "results": results,
+    }
+
+    text = json.dumps(report, indent=2)
+    if args.out:
+        with open(args.out, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+
+def compare(old_name, new_name):
+
+    with open(old_name) as f:
+        old = json.load(f)
+    with open(new_name) as f:
+        new = json.load(f)
+
+    if old["params"] != new["params"]:
+        print("Warning: runs used different parameters; ratios may not be meaningful", file=sys.stderr)
+
+    old_results = dict((r["tool"], r) for r in old["results"])
+    print("%-24s %14s %14s %8s %10s" % ("tool", "old rec/s", "new rec/s", "speedup", "rss ratio"))
+    for r in new["results"]:
+        o = old_results.get(r["tool"])
+        if not o:
+            continue
+        speedup = r["records_per_s"] / o["records_per_s"] if o["records_per_s"] else float("nan")
+        rss = r["max_rss_kb"] / o["max_rss_kb"] if o["max_rss_kb"] else float("nan")
+        print("%-24s %14d %14d %7.2fx %9.2fx" % (r["tool"], o["records_per_s"], r["records_per_s"], speedup, rss))
+
+def main():
+
+    parser = argparse.ArgumentParser(description="Benchmark the samtoys tools on synthetic data")
+    parser.add_argument("--bin", default=os.path.dirname(os.path.abspath(__file__)), help="Directory holding the built tools")
+    parser.add_argument("--workdir", default="bench_data", help="Where to write generated inputs and outputs")
+    parser.add_argument("--out", help="Write the JSON report here (default stdout)")
+    parser.add_argument("--pairs", type=int, default=200000, help="Read pairs per generated BAM")
+    parser.add_argument("--contigs", type=int, default=25)
+    parser.add_argument("--contig-len", type=int, default=200000)
+    parser.add_argument("--multimap-rate", type=float, default=0.1)
+    parser.add_argument("--tags", default="AS,BS,NM,MD,NH")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--threads", type=int, default=4)
+    parser.add_argument("--repeats", type=int, default=3, help="Runs per benchmark; the fastest is reported")
+    parser.add_argument("--tools", nargs="*", help="Only run these benchmarks")
+    parser.add_argument("--cold", action="store_true", help="Evict inputs from the page cache before every run")
+    parser.add_argument("--io-compare", action="store_true", help="Run each benchmark with SAMTOYS_IO=off and with the default tuned I/O")
+    parser.add_argument("--pipe-compare", action="store_true", help="Run each benchmark with and without SAMTOYS_IO=vmsplice=1")
+    parser.add_argument("--compare", nargs=2, metavar=("OLD", "NEW"), help="Compare two reports instead of running")
+    args = parser.parse_args()
+
+    if args.compare:
+        compare(*args.compare)
+    else:
+        run_benchmarks(args)
+
+if __name__ == "__main__":
+    main()
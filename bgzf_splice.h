@@ -0,0 +1,115 @@
+#ifndef SAMTOYS_BGZF_SPLICE_H
+#define SAMTOYS_BGZF_SPLICE_H
+
+// Copy the body of a BGZF file without decompressing it: once the header has been read from in
+// (and a new one written to out), only the remainder of the block the header ended in needs
+// recompressing; every later block is copied byte-for-byte.
+
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+#include <algorithm>
+
+static const uint8_t bgzf_eof_marker[28] = {
+  0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+  0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+// Copy in's remaining contents to out, leaving in at EOF. Neither may be using threads, since
+// out's blocks must reach its hFILE in order; out may already hold e.g. a new header. in's EOF
+// marker block is dropped, since closing out writes its own. Returns false on I/O error.
+
+static bool bgzf_splice_body(BGZF* in, BGZF* out) {
+
+  // The tail of the current block, recompressed and flushed so that out is on a block boundary.
+  if(in->block_offset < in->block_length) {
+    int len = in->block_length - in->block_offset;
+    if(bgzf_write(out, (char*)in->uncompressed_block + in->block_offset, len) != len)
+      return false;
+    in->block_offset = in->block_length;
+  }
+
+  if(bgzf_flush(out))
+    return false;
+
+  // Everything after it, verbatim. Hold back the last 28 bytes until we know whether they're
+  // the EOF marker.
+  std::vector<char> buf(4 * 1024 * 1024 + sizeof(bgzf_eof_marker));
+  size_t held = 0;
+  ssize_t n;
+
+  while((n = hread(in->fp, &buf[held], buf.size() - held)) > 0) {
+
+    held += n;
+    if(held > sizeof(bgzf_eof_marker)) {
+      size_t writelen = held - sizeof(bgzf_eof_marker);
+      if(hwrite(out->fp, &buf[0], writelen) != (ssize_t)writelen)
+	return false;
+      memmove(&buf[0], &buf[writelen], sizeof(bgzf_eof_marker));
+      held = sizeof(bgzf_eof_marker);
+    }
+
+  }
+
+  if(n < 0)
+    return false;
+
+  if(held && !(held == sizeof(bgzf_eof_marker) && !memcmp(&buf[0], bgzf_eof_marker, held))) {
+    if(hwrite(out->fp, &buf[0], held) != (ssize_t)held)
+      return false;
+  }
+
+  in->block_length = in->block_offset = 0;
+  return true;
+
+}
+
+// Copy in's records from its current position, just set by bgzf_seek, up to the virtual offset
+// end, as bgzf_splice_body does: only the partial blocks at either end are recompressed, and
+// whole blocks in between are copied byte-for-byte. Returns false on I/O error.
+
+static bool bgzf_splice_range(BGZF* in, BGZF* out, int64_t end) {
+
+  int64_t end_block = end >> 16;
+  int end_offset = end & 0xffff;
+
+  if(bgzf_tell(in) >= end)
+    return true;
+
+  // bgzf_seek leaves the block unread; peeking reads it without moving the offset within it.
+  if(bgzf_peek(in) < -1)
+    return false;
+
+  if(in->block_address == end_block) {
+    int len = end_offset - in->block_offset;
+    return bgzf_write(out, (char*)in->uncompressed_block + in->block_offset, len) == len;
+  }
+
+  int len = in->block_length - in->block_offset;
+  if(bgzf_write(out, (char*)in->uncompressed_block + in->block_offset, len) != len || bgzf_flush(out))
+    return false;
+
+  // in's hFILE is now just past that block.
+  std::vector<char> buf(4 * 1024 * 1024);
+  int64_t remaining = end_block - htell(in->fp);
+  while(remaining > 0) {
+    ssize_t n = hread(in->fp, &buf[0], std::min((int64_t)buf.size(), remaining));
+    if(n <= 0 || hwrite(out->fp, &buf[0], n) != n)
+      return false;
+    remaining -= n;
+  }
+
+  if(!end_offset)
+    return true;
+
+  if(bgzf_seek(in, end_block << 16, SEEK_SET) < 0 || bgzf_peek(in) < -1)
+    return false;
+  return bgzf_write(out, (char*)in->uncompressed_block, end_offset) == end_offset;
+
+}
+
+#endif
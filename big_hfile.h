@@ -0,0 +1,851 @@
+#ifndef SAMTOYS_BIG_HFILE_H
+#define SAMTOYS_BIG_HFILE_H
+
+// An hFILE backend for local files and pipes with multi-MB buffers, posix_fadvise sequential hints
+// and a readahead thread, usable with stock htslib. This replaces the forked htslib's
+// hts_set_opt(HTS_FILEIO_BUFFER_SIZE) that some tools used to rely on. Tools open files with
+// hts_open_tuned instead of hts_open; it's configured by SAMTOYS_IO:
+//   SAMTOYS_IO=off                       plain hts_open
+//   SAMTOYS_IO=buffer=8M,readahead=4,fadvise=1   (the defaults are 4M, 4 and 1)
+// buffer is the hFILE buffer and readahead chunk size; readahead is how many chunks a background
+// thread may read ahead of the tool (0 for none). The window starts at one chunk after every seek
+// and doubles as the tool keeps reading sequentially, so index-driven seeks don't drag in
+// megabytes that are never used. fadvise does nothing where posix_fadvise isn't available (macOS).
+// URLs and other non-local names go to hts_open as usual.
+//
+// SAMTOYS_IO=vmsplice=1 also makes output to a pipe go through vmsplice (Linux only): see
+// PipeSplicer. It's off by default because it's only safe if the reading end copies the data out
+// with read(), as samtoys, samtools and most tools do; a reader that splices the pages onwards
+// (pv, for one, unless given -C) could see them change under it.
+//
+// htslib's backend interface (hfile_internal.h) isn't installed with the library, but hfile_init
+// and hfile_destroy are exported for plugins and the backend struct has been stable since 1.3,
+// so the declarations are repeated here.
+
+#include <htslib/hts.h>
+#include <htslib/hfile.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <deque>
+#endif
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+struct hFILE_backend {
+
+  ssize_t (*read)(hFILE* fp, void* buffer, size_t nbytes);
+  ssize_t (*write)(hFILE* fp, const void* buffer, size_t nbytes);
+  off_t (*seek)(hFILE* fp, off_t offset, int whence);
+  int (*flush)(hFILE* fp);
+  int (*close)(hFILE* fp);
+
+};
+
+extern "C" {
+  hFILE* hfile_init(size_t struct_size, const char* mode, size_t capacity);
+  void hfile_destroy(hFILE* fp);
+}
+
+struct IoOptions {
+
+  bool enabled;
+  size_t buffer_size;
+  int readahead;
+  bool fadvise;
+  bool vmsplice;
+
+};
+
+static size_t parse_io_size(const char* s) {
+
+  char* end;
+  double val = strtod(s, &end);
+  switch(*end) {
+  case 'k': case 'K':
+    val *= 1024;
+    break;
+  case 'm': case 'M':
+    val *= 1024 * 1024;
+    break;
+  case 'g': case 'G':
+    val *= 1024 * 1024 * 1024;
+    break;
+  }
+  return (size_t)val;
+
+}
+
+static const IoOptions& io_options() {
+
+  static IoOptions opts;
+  static bool parsed = false;
+  if(parsed)
+    return opts;
+
+  opts.enabled = true;
+  opts.buffer_size = 4 << 20;
+  opts.readahead = 4;
+  opts.fadvise = true;
+  opts.vmsplice = false;
+
+  const char* env = getenv("SAMTOYS_IO");
+  if(env && (!strcmp(env, "off") || !strcmp(env, "0")))
+    opts.enabled = false;
+  else if(env && *env) {
+
+    std::string spec = env;
+    size_t start = 0;
+    while(start <= spec.size()) {
+
+      size_t end = spec.find(',', start);
+      if(end == std::string::npos)
+	end = spec.size();
+      std::string opt = spec.substr(start, end - start);
+      start = end + 1;
+
+      if(!opt.compare(0, 7, "buffer="))
+	opts.buffer_size = parse_io_size(opt.c_str() + 7);
+      else if(!opt.compare(0, 10, "readahead="))
+	opts.readahead = atoi(opt.c_str() + 10);
+      else if(!opt.compare(0, 8, "fadvise="))
+	opts.fadvise = atoi(opt.c_str() + 8) != 0;
+      else if(!opt.compare(0, 9, "vmsplice="))
+	opts.vmsplice = atoi(opt.c_str() + 9) != 0;
+      else if(!opt.empty()) {
+	fprintf(stderr, "Unknown SAMTOYS_IO option %s (expected buffer=, readahead=, fadvise= or vmsplice=, or off)\n", opt.c_str());
+	exit(1);
+      }
+
+    }
+
+    if(opts.buffer_size < 65536)
+      opts.buffer_size = 65536;
+    if(opts.readahead < 0)
+      opts.readahead = 0;
+
+  }
+
+  parsed = true;
+  return opts;
+
+}
+
+// The readahead thread fills a ring of chunks from the fd; the backend's read copies out of them.
+// From a pipe it passes on whatever has arrived as soon as the pipe runs dry, rather than waiting
+// for a whole chunk, so a slow producer's records still stream through; and it waits in poll()
+// alongside wake_fds, so closing doesn't hang on a producer that's gone quiet.
+
+class Readahead {
+
+  struct Chunk {
+    std::vector<char> data;
+    size_t len, pos;
+  };
+
+  int fd;
+  bool seekable;
+  std::vector<Chunk> chunks;
+  int max_window;
+
+  std::mutex lock;
+  std::condition_variable filled_cond, space_cond;
+  // Chunks [head, head + nfilled) hold data; the producer fills chunk head + nfilled next.
+  int head, nfilled, window;
+  off_t next_offset;
+  unsigned long generation;
+  bool eof, stopping;
+  int error;
+  // A pipe the destructor writes to, to interrupt a wait for the fd; -1s if seekable.
+  int wake_fds[2];
+  std::thread thread;
+
+  // Wait up to timeout_ms (-1 for ever) for the fd to be readable, or at EOF. Returns false on a
+  // timeout, a wake-up or an error (setting *err).
+  bool wait_readable(int timeout_ms, int* err) {
+
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_fds[0];
+    fds[1].events = POLLIN;
+
+    while(true) {
+      fds[0].revents = fds[1].revents = 0;
+      int ret = poll(fds, 2, timeout_ms);
+      if(ret < 0 && errno == EINTR)
+	continue;
+      if(ret < 0) {
+	*err = errno;
+	return false;
+      }
+      return ret > 0 && !fds[1].revents && fds[0].revents;
+    }
+
+  }
+
+  void run() {
+
+    std::unique_lock<std::mutex> guard(lock);
+
+    while(true) {
+
+      while(!stopping && (eof || error || nfilled >= window))
+	space_cond.wait(guard);
+      if(stopping)
+	return;
+
+      Chunk& c = chunks[(head + nfilled) % chunks.size()];
+      unsigned long gen = generation;
+      off_t offset = next_offset;
+      guard.unlock();
+
+      ssize_t n;
+      size_t got = 0;
+      int err = 0;
+      // Fill the whole chunk unless we hit EOF. From a pipe, wait for the first bytes, then take
+      // only what's already there, so small writes coalesce while the producer is ahead of us
+      // without holding records back when it isn't.
+      while(got < c.data.size()) {
+	if(!seekable && !wait_readable(got ? 0 : -1, &err))
+	  break;
+	n = seekable ? ::pread(fd, &c.data[got], c.data.size() - got, offset + got) : ::read(fd, &c.data[got], c.data.size() - got);
+	if(n < 0 && errno == EINTR)
+	  continue;
+	if(n < 0)
+	  err = errno;
+	if(n <= 0)
+	  break;
+	got += n;
+      }
+
+      guard.lock();
+      // A seek while we were reading makes this chunk stale.
+      if(gen != generation)
+	continue;
+
+      if(err)
+	error = err;
+      else if(!got)
+	eof = true;
+      else {
+	c.len = got;
+	c.pos = 0;
+	++nfilled;
+	next_offset += got;
+	if(got < c.data.size() && seekable)
+	  eof = true;
+      }
+      filled_cond.notify_one();
+
+    }
+
+  }
+
+public:
+
+  Readahead(int _fd, bool _seekable, off_t start, size_t chunk_size, int _max_window) :
+    fd(_fd), seekable(_seekable), chunks(_max_window), max_window(_max_window),
+    head(0), nfilled(0), window(1), next_offset(start), generation(0), eof(false), stopping(false), error(0) {
+
+    for(size_t i = 0; i < chunks.size(); ++i)
+      chunks[i].data.resize(chunk_size);
+    // poll() skips a -1, so if the pipe can't be made, closing just waits for the producer.
+    wake_fds[0] = wake_fds[1] = -1;
+    if(!seekable && pipe(wake_fds))
+      wake_fds[0] = wake_fds[1] = -1;
+    thread = std::thread(&Readahead::run, this);
+
+  }
+
+  ~Readahead() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    space_cond.notify_one();
+    if(wake_fds[1] >= 0) {
+      char c = 0;
+      while(write(wake_fds[1], &c, 1) < 0 && errno == EINTR);
+    }
+    thread.join();
+    for(int i = 0; i < 2; ++i) {
+      if(wake_fds[i] >= 0)
+	close(wake_fds[i]);
+    }
+  }
+
+  ssize_t read(void* buffer, size_t nbytes) {
+
+    std::unique_lock<std::mutex> guard(lock);
+    while(!nfilled && !eof && !error)
+      filled_cond.wait(guard);
+
+    if(!nfilled) {
+      if(error) {
+	errno = error;
+	return -1;
+      }
+      return 0;
+    }
+
+    Chunk& c = chunks[head];
+    size_t n = std::min(nbytes, c.len - c.pos);
+    memcpy(buffer, &c.data[c.pos], n);
+    c.pos += n;
+
+    if(c.pos == c.len) {
+      head = (head + 1) % chunks.size();
+      --nfilled;
+      // Reading on sequentially: let the producer get further ahead.
+      window = std::min(window * 2, max_window);
+      space_cond.notify_one();
+    }
+
+    return n;
+
+  }
+
+  // Discard anything read ahead and start again from offset.
+  void restart(off_t offset) {
+
+    std::lock_guard<std::mutex> guard(lock);
+    ++generation;
+    head = 0;
+    nfilled = 0;
+    window = 1;
+    next_offset = offset;
+    eof = false;
+    error = 0;
+    space_cond.notify_one();
+
+  }
+
+};
+
+#ifdef __linux__
+
+// Output to a pipe without write()'s copy into the kernel. When htslib flushes the hFILE's buffer,
+// the buffer itself is queued for a writer thread to vmsplice into the pipe and the hFILE carries
+// on filling a fresh one, so the reader's read() is the only copy made. The pipe holds references
+// to the buffer's pages until they're read, so a buffer is only refilled once FIONREAD shows the
+// reader has got past its last byte. Buffers are page-aligned mmaps, which may be unmapped while
+// the pipe still references them; the hFILE gets its own buffer back before htslib frees it.
+
+class PipeSplicer {
+
+  struct Buffer {
+    char* data;
+    size_t len;
+    // Bytes spliced into the pipe in all, up to and including this buffer.
+    uint64_t end;
+  };
+
+  int fd;
+  size_t capacity;
+  char* original;
+  std::vector<char*> mapped;
+  std::vector<char*> free_buffers;
+  std::deque<Buffer> queued, in_pipe;
+
+  std::mutex lock;
+  std::condition_variable queued_cond, done_cond;
+  uint64_t spliced;
+  bool busy, stopping;
+  int error;
+  std::thread thread;
+
+  // One filling, one queued, one being spliced and one the reader is still reading.
+  static const size_t max_buffers = 4;
+
+  void run() {
+
+    std::unique_lock<std::mutex> guard(lock);
+
+    while(true) {
+
+      while(!stopping && queued.empty())
+	queued_cond.wait(guard);
+      // Stopping only once everything queued has gone.
+      if(queued.empty())
+	return;
+
+      Buffer b = queued.front();
+      queued.pop_front();
+      busy = true;
+      bool failed = error != 0;
+      guard.unlock();
+
+      size_t done = 0;
+      int err = 0;
+      while(!failed && done < b.len) {
+	struct iovec iov = { b.data + done, b.len - done };
+	ssize_t n = ::vmsplice(fd, &iov, 1, 0);
+	if(n < 0 && errno == EINTR)
+	  continue;
+	if(n < 0) {
+	  err = errno;
+	  break;
+	}
+	done += n;
+      }
+
+      guard.lock();
+      busy = false;
+      spliced += done;
+      b.end = spliced;
+      in_pipe.push_back(b);
+      if(err && !error)
+	error = err;
+      done_cond.notify_all();
+
+    }
+
+  }
+
+  // Return buffers the reader has finished with to the free list. Reading spliced before FIONREAD
+  // errs on the safe side if the thread is part way through a vmsplice.
+  void reclaim() {
+
+    int unread;
+    if(in_pipe.empty() || ioctl(fd, FIONREAD, &unread) < 0)
+      return;
+
+    while(!in_pipe.empty() && in_pipe.front().end + unread <= spliced) {
+      free_buffers.push_back(in_pipe.front().data);
+      in_pipe.pop_front();
+    }
+
+  }
+
+  // A buffer the caller can fill, or 0 after an error. Called with lock held.
+  char* acquire(std::unique_lock<std::mutex>& guard) {
+
+    while(!error) {
+
+      if(free_buffers.empty())
+	reclaim();
+
+      if(!free_buffers.empty()) {
+	char* b = free_buffers.back();
+	free_buffers.pop_back();
+	return b;
+      }
+
+      if(mapped.size() < max_buffers) {
+	void* b = mmap(0, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(b == MAP_FAILED) {
+	  fprintf(stderr, "Failed to allocate a %lu byte output buffer\n", (unsigned long)capacity);
+	  exit(1);
+	}
+	mapped.push_back((char*)b);
+	return (char*)b;
+      }
+
+      // Everything is waiting on the reader. If the thread has work, its progress may free
+      // something; otherwise only the reader can, and it doesn't tell us when.
+      if(busy || !queued.empty())
+	done_cond.wait(guard);
+      else {
+	guard.unlock();
+	usleep(100);
+	guard.lock();
+      }
+
+    }
+
+    return 0;
+
+  }
+
+  void install(hFILE* hf, char* b) {
+
+    hf->buffer = hf->begin = hf->end = b;
+    hf->limit = b + capacity;
+
+  }
+
+  void queue(char* b, size_t len) {
+
+    Buffer q = { b, len, 0 };
+    queued.push_back(q);
+    queued_cond.notify_one();
+
+  }
+
+public:
+
+  // Takes over hf's buffering; hf must be open for writing on fd, a pipe.
+  PipeSplicer(int _fd, hFILE* hf) :
+    fd(_fd), capacity(hf->limit - hf->buffer), original(hf->buffer), spliced(0), busy(false), stopping(false), error(0) {
+
+    // A pipe the size of a buffer lets the reader and the writer thread each have one. Unprivileged
+    // processes can't go beyond pipe-max-size, so fall back to that.
+    if(fcntl(fd, F_SETPIPE_SZ, (int)capacity) < 0) {
+      FILE* f = fopen("/proc/sys/fs/pipe-max-size", "r");
+      int max_size;
+      if(f && fscanf(f, "%d", &max_size) == 1 && (size_t)max_size < capacity)
+	fcntl(fd, F_SETPIPE_SZ, max_size);
+      if(f)
+	fclose(f);
+    }
+
+    std::unique_lock<std::mutex> guard(lock);
+    install(hf, acquire(guard));
+    guard.unlock();
+    thread = std::thread(&PipeSplicer::run, this);
+
+  }
+
+  ~PipeSplicer() {
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    queued_cond.notify_one();
+    thread.join();
+
+    // Any pages still in the pipe keep their contents after munmap; the kernel holds references.
+    for(size_t i = 0; i < mapped.size(); ++i)
+      munmap(mapped[i], capacity);
+
+  }
+
+  ssize_t write(hFILE* hf, const void* buffer, size_t nbytes) {
+
+    std::unique_lock<std::mutex> guard(lock);
+    if(error) {
+      errno = error;
+      return -1;
+    }
+
+    if(buffer == hf->buffer) {
+
+      // The usual case, hflush emptying the hFILE's buffer: hand it over and swap in another.
+      // begin is left alone, as htslib's loop compares its progress with it before resetting it
+      // to the new buffer.
+      queue(hf->buffer, nbytes);
+      char* next = acquire(guard);
+      if(!next) {
+	errno = error;
+	return -1;
+      }
+      hf->buffer = hf->end = next;
+      hf->limit = next + capacity;
+      return nbytes;
+
+    }
+
+    // A write big enough that htslib skipped its buffer: copy it into ours.
+    size_t done = 0;
+    while(done < nbytes) {
+
+      char* b = acquire(guard);
+      if(!b) {
+	errno = error;
+	return done ? (ssize_t)done : -1;
+      }
+      size_t n = std::min(capacity, nbytes - done);
+      guard.unlock();
+      memcpy(b, (const char*)buffer + done, n);
+      guard.lock();
+      queue(b, n);
+      done += n;
+
+    }
+
+    return done;
+
+  }
+
+  // Wait for everything queued to reach the pipe.
+  int flush() {
+
+    std::unique_lock<std::mutex> guard(lock);
+    while(busy || !queued.empty())
+      done_cond.wait(guard);
+    if(error) {
+      errno = error;
+      return -1;
+    }
+    return 0;
+
+  }
+
+  // Flush and give hf back the buffer it was created with, for hfile_destroy to free.
+  int close(hFILE* hf) {
+
+    int ret = flush();
+    install(hf, original);
+    return ret;
+
+  }
+
+};
+
+#else
+
+// vmsplice is Linux-only; elsewhere SAMTOYS_IO=vmsplice=1 is accepted but does nothing.
+class PipeSplicer {
+
+public:
+
+  PipeSplicer(int, hFILE*) {}
+  ssize_t write(hFILE*, const void*, size_t) { return -1; }
+  int flush() { return 0; }
+  int close(hFILE*) { return 0; }
+
+};
+
+#endif
+
+struct BigHFile {
+
+  hFILE base;
+  int fd;
+  bool seekable;
+  // Logical position of the next byte read() returns; the fd's own offset is meaningless with pread.
+  off_t pos;
+  Readahead* readahead;
+  PipeSplicer* splicer;
+  // Time spent in write, i.e. waiting for whatever is downstream; see big_hfile_write_ns.
+  uint64_t write_ns;
+
+};
+
+static inline uint64_t big_hfile_now() {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+}
+
+static ssize_t big_hfile_read(hFILE* fpv, void* buffer, size_t nbytes) {
+
+  BigHFile* fp = (BigHFile*)fpv;
+  ssize_t n;
+  if(fp->readahead)
+    n = fp->readahead->read(buffer, nbytes);
+  else {
+    do {
+      n = read(fp->fd, buffer, nbytes);
+    } while(n < 0 && errno == EINTR);
+  }
+  if(n > 0)
+    fp->pos += n;
+  return n;
+
+}
+
+static ssize_t big_hfile_write_fd(BigHFile* fp, const void* buffer, size_t nbytes) {
+
+  if(fp->splicer)
+    return fp->splicer->write(&fp->base, buffer, nbytes);
+
+  size_t done = 0;
+  while(done < nbytes) {
+    ssize_t n = write(fp->fd, (const char*)buffer + done, nbytes - done);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0)
+      return done ? (ssize_t)done : -1;
+    done += n;
+  }
+  return done;
+
+}
+
+static ssize_t big_hfile_write(hFILE* fpv, const void* buffer, size_t nbytes) {
+
+  BigHFile* fp = (BigHFile*)fpv;
+  uint64_t start = big_hfile_now();
+  ssize_t n = big_hfile_write_fd(fp, buffer, nbytes);
+  // Written by htslib's BGZF writer thread when there is one, and read by the tool's.
+  __atomic_fetch_add(&fp->write_ns, big_hfile_now() - start, __ATOMIC_RELAXED);
+  if(n > 0)
+    fp->pos += n;
+  return n;
+
+}
+
+static off_t big_hfile_seek(hFILE* fpv, off_t offset, int whence) {
+
+  BigHFile* fp = (BigHFile*)fpv;
+  if(!fp->seekable) {
+    errno = ESPIPE;
+    return -1;
+  }
+
+  off_t target;
+  if(whence == SEEK_SET)
+    target = offset;
+  else if(whence == SEEK_CUR)
+    target = fp->pos + offset;
+  else {
+    struct stat st;
+    if(fstat(fp->fd, &st))
+      return -1;
+    target = st.st_size + offset;
+  }
+
+  if(target < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if(fp->readahead)
+    fp->readahead->restart(target);
+  else if(lseek(fp->fd, target, SEEK_SET) < 0)
+    return -1;
+
+  fp->pos = target;
+  return target;
+
+}
+
+// hflush has already handed the buffer to write(); nothing is held back here unless it's queued
+// for vmsplice, and unlike fsync there's no reason to wait for the disk.
+static int big_hfile_flush(hFILE* fpv) {
+
+  BigHFile* fp = (BigHFile*)fpv;
+  return fp->splicer ? fp->splicer->flush() : 0;
+
+}
+
+static int big_hfile_close(hFILE* fpv) {
+
+  BigHFile* fp = (BigHFile*)fpv;
+  delete fp->readahead;
+  fp->readahead = 0;
+  if(fp->splicer) {
+    int ret = fp->splicer->close(fpv);
+    delete fp->splicer;
+    fp->splicer = 0;
+    if(ret < 0)
+      return -1;
+  }
+  // Leave stdin / stdout open for anything else that wants them, as htslib does for "-".
+  if(fp->fd > 2 && close(fp->fd) < 0)
+    return -1;
+  return 0;
+
+}
+
+static const struct hFILE_backend big_hfile_backend = {
+  big_hfile_read, big_hfile_write, big_hfile_seek, big_hfile_flush, big_hfile_close
+};
+
+// Names hts_open would hand to a plugin or treat specially.
+static bool is_local_name(const char* fname) {
+
+  if(strstr(fname, "##idx##"))
+    return false;
+  const char* p = fname;
+  while(isalnum((unsigned char)*p) || *p == '+' || *p == '.' || *p == '-')
+    ++p;
+  return !(p != fname && p[0] == ':' && p[1] == '/' && p[2] == '/');
+
+}
+
+// hopen for a local file or "-" with the SAMTOYS_IO settings; mode is "r" or "w" (plus htslib's
+// format letters, which are ignored here).
+static hFILE* big_hopen(const char* fname, const char* mode) {
+
+  const IoOptions& opts = io_options();
+  bool writing = strchr(mode, 'w') || strchr(mode, 'a');
+
+  int fd;
+  if(!strcmp(fname, "-"))
+    fd = writing ? STDOUT_FILENO : STDIN_FILENO;
+  else {
+    int flags = writing ? (O_WRONLY | O_CREAT | (strchr(mode, 'a') ? O_APPEND : O_TRUNC)) : O_RDONLY;
+    fd = open(fname, flags, 0666);
+    if(fd < 0)
+      return 0;
+  }
+
+  struct stat st;
+  bool have_stat = fstat(fd, &st) == 0;
+  bool seekable = have_stat && S_ISREG(st.st_mode);
+
+  BigHFile* fp = (BigHFile*)hfile_init(sizeof(BigHFile), writing ? "w" : "r", opts.buffer_size);
+  if(!fp) {
+    if(fd > 2)
+      close(fd);
+    return 0;
+  }
+
+  fp->base.backend = &big_hfile_backend;
+  fp->fd = fd;
+  fp->seekable = seekable;
+  fp->pos = seekable ? lseek(fd, 0, SEEK_CUR) : 0;
+  fp->readahead = 0;
+  fp->splicer = 0;
+  fp->write_ns = 0;
+
+  if(!writing) {
+#ifdef POSIX_FADV_SEQUENTIAL
+    if(seekable && opts.fadvise)
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    if(opts.readahead)
+      fp->readahead = new Readahead(fd, seekable, fp->pos, opts.buffer_size, opts.readahead);
+  }
+#ifdef __linux__
+  else if(opts.vmsplice && have_stat && S_ISFIFO(st.st_mode))
+    fp->splicer = new PipeSplicer(fd, &fp->base);
+#endif
+
+  return &fp->base;
+
+}
+
+// Nanoseconds hf's writes have spent blocked so far, or false if hf isn't ours.
+static bool big_hfile_write_ns(hFILE* hf, uint64_t* ns) {
+
+  if(!hf || hf->backend != &big_hfile_backend)
+    return false;
+  *ns = __atomic_load_n(&((BigHFile*)hf)->write_ns, __ATOMIC_RELAXED);
+  return true;
+
+}
+
+// hts_open, reading and writing local files and pipes through big_hopen unless SAMTOYS_IO=off.
+static htsFile* hts_open_tuned(const char* fname, const char* mode) {
+
+  if(!io_options().enabled || !is_local_name(fname))
+    return hts_open(fname, mode);
+
+  hFILE* hfile = big_hopen(fname, mode);
+  if(!hfile)
+    return 0;
+
+  htsFile* hf = hts_hopen(hfile, fname, mode);
+  if(!hf)
+    hclose_abruptly(hfile);
+  return hf;
+
+}
+
+#endif
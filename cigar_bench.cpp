@@ -0,0 +1,254 @@
+
+#include <htslib/sam.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+#include <chrono>
+
+#include "cigar_stats.h"
+
+// Microbenchmark for cigar_stats against the op-at-a-time switch it replaced, on synthetic
+// short-read (a few ops per read) and long-read (thousands of ops per read) CIGAR corpora.
+// Both are checked to agree before anything is timed.
+
+static void usage() {
+
+  fprintf(stderr, "Usage: cigar_bench [-r rounds] [-s short_reads] [-l long_reads] [-n long_read_ops]\n");
+  fprintf(stderr, "\t-r\tTimes to summarise each corpus (default 5)\n");
+  fprintf(stderr, "\t-s\tShort-read CIGARs in the first corpus (default 2000000)\n");
+  fprintf(stderr, "\t-l\tLong-read CIGARs in the second corpus (default 2000)\n");
+  fprintf(stderr, "\t-n\tOps per long-read CIGAR (default 5000)\n");
+  exit(1);
+
+}
+
+// CIGARs packed back to back, as they are in records.
+
+struct CigarCorpus {
+
+  const char* name;
+  std::vector<uint32_t> ops;
+  std::vector<size_t> starts;
+
+  size_t size() const { return starts.size() - 1; }
+  const uint32_t* cigar(size_t i) const { return &ops[starts[i]]; }
+  uint32_t n_cigar(size_t i) const { return starts[i + 1] - starts[i]; }
+
+};
+
+// xorshift64*, so that corpora are the same from run to run.
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t rand_below(uint32_t n) {
+
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return (uint32_t)((rng_state * 0x2545f4914f6cdd1dULL) >> 32) % n;
+
+}
+
+static void push_op(CigarCorpus& corpus, int op, uint32_t len) {
+  corpus.ops.push_back(bam_cigar_gen(len, op));
+}
+
+// 150bp reads: mostly 150M, some soft-clipped, some with a small indel, as from a short-read aligner.
+
+static void make_short_reads(CigarCorpus& corpus, size_t n) {
+
+  corpus.name = "short-read";
+  for(size_t i = 0; i < n; ++i) {
+
+    corpus.starts.push_back(corpus.ops.size());
+    uint32_t kind = rand_below(10);
+    if(kind < 6) {
+      push_op(corpus, BAM_CMATCH, 150);
+    }
+    else if(kind < 8) {
+      uint32_t clip = 1 + rand_below(40);
+      push_op(corpus, BAM_CSOFT_CLIP, clip);
+      push_op(corpus, BAM_CMATCH, 150 - clip);
+    }
+    else {
+      uint32_t left = 20 + rand_below(100);
+      uint32_t indel = 1 + rand_below(5);
+      push_op(corpus, BAM_CMATCH, left);
+      if(kind == 8) {
+	push_op(corpus, BAM_CINS, indel);
+	push_op(corpus, BAM_CMATCH, 150 - left - indel);
+      }
+      else {
+	push_op(corpus, BAM_CDEL, indel);
+	push_op(corpus, BAM_CMATCH, 150 - left);
+      }
+      push_op(corpus, BAM_CHARD_CLIP, rand_below(3) * 10);
+    }
+
+  }
+  corpus.starts.push_back(corpus.ops.size());
+
+}
+
+// Long reads with =/X and frequent short indels, as from a long-read aligner with --eqx.
+
+static void make_long_reads(CigarCorpus& corpus, size_t n, uint32_t ops_per_read) {
+
+  static const int long_ops[] = { BAM_CEQUAL, BAM_CEQUAL, BAM_CEQUAL, BAM_CDIFF, BAM_CINS, BAM_CDEL };
+
+  corpus.name = "long-read";
+  for(size_t i = 0; i < n; ++i) {
+
+    corpus.starts.push_back(corpus.ops.size());
+    push_op(corpus, BAM_CSOFT_CLIP, 1 + rand_below(500));
+    for(uint32_t j = 2; j < ops_per_read; ++j) {
+      int op = long_ops[rand_below(6)];
+      push_op(corpus, op, op == BAM_CEQUAL ? 1 + rand_below(60) : 1 + rand_below(3));
+    }
+    push_op(corpus, BAM_CSOFT_CLIP, 1 + rand_below(500));
+
+  }
+  corpus.starts.push_back(corpus.ops.size());
+
+}
+
+// The per-op switch filter_match_ratio and bamcmp used before cigar_stats.
+
+static void cigar_stats_switch(const uint32_t* cigar, uint32_t n_cigar, CigarStats* stats) {
+
+  memset(stats, 0, sizeof(*stats));
+
+  for(uint32_t i = 0; i != n_cigar; ++i) {
+
+    uint32_t len = bam_cigar_oplen(cigar[i]);
+    int op = bam_cigar_op(cigar[i]);
+    stats->present |= 1u << op;
+
+    switch(op) {
+    case BAM_CMATCH:
+      stats->op_len[BAM_CMATCH] += len;
+      break;
+    case BAM_CEQUAL:
+      stats->op_len[BAM_CEQUAL] += len;
+      break;
+    case BAM_CDIFF:
+      stats->op_len[BAM_CDIFF] += len;
+      break;
+    case BAM_CINS:
+      stats->op_len[BAM_CINS] += len;
+      break;
+    case BAM_CDEL:
+      stats->op_len[BAM_CDEL] += len;
+      break;
+    case BAM_CSOFT_CLIP:
+      stats->op_len[BAM_CSOFT_CLIP] += len;
+      break;
+    case BAM_CHARD_CLIP:
+      stats->op_len[BAM_CHARD_CLIP] += len;
+      break;
+    default:
+      stats->op_len[op] += len;
+      break;
+    }
+
+  }
+
+}
+
+typedef void (*cigar_stats_fn)(const uint32_t*, uint32_t, CigarStats*);
+
+// Summarise the whole corpus, folding the results into a checksum so none of it is optimised away.
+
+static uint64_t summarise(const CigarCorpus& corpus, cigar_stats_fn fn) {
+
+  uint64_t check = 0;
+  CigarStats stats;
+  for(size_t i = 0, ilim = corpus.size(); i != ilim; ++i) {
+    fn(corpus.cigar(i), corpus.n_cigar(i), &stats);
+    check = check * 31 + stats.matched() + 3 * stats.mismatched() + 5 * stats.inserted() + 7 * stats.deleted()
+      + 11 * stats.soft_clipped() + 13 * stats.hard_clipped() + stats.present;
+  }
+  return check;
+
+}
+
+static void bench(const CigarCorpus& corpus, const char* kernel, cigar_stats_fn fn, int rounds) {
+
+  double best = 0;
+  uint64_t check = 0;
+
+  for(int i = 0; i < rounds; ++i) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    check ^= summarise(corpus, fn);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if(i == 0 || secs < best)
+      best = secs;
+  }
+
+  printf("%-10s %-8s %8lu cigars %10lu ops  %8.3f ms  %7.2f ns/cigar  %6.3f ns/op  (check %016lx)\n",
+	 corpus.name, kernel, (unsigned long)corpus.size(), (unsigned long)corpus.ops.size(), best * 1e3,
+	 best * 1e9 / corpus.size(), best * 1e9 / corpus.ops.size(), (unsigned long)check);
+
+}
+
+static void verify(const CigarCorpus& corpus) {
+
+  CigarStats a, b;
+  for(size_t i = 0, ilim = corpus.size(); i != ilim; ++i) {
+    cigar_stats_switch(corpus.cigar(i), corpus.n_cigar(i), &a);
+    cigar_stats(corpus.cigar(i), corpus.n_cigar(i), &b);
+    if(memcmp(a.op_len, b.op_len, sizeof(a.op_len)) || a.present != b.present) {
+      fprintf(stderr, "cigar_stats disagrees with the reference on %s CIGAR %lu\n", corpus.name, (unsigned long)i);
+      exit(1);
+    }
+  }
+
+}
+
+int main(int argc, char** argv) {
+
+  int rounds = 5;
+  size_t short_reads = 2000000, long_reads = 2000;
+  uint32_t long_read_ops = 5000;
+
+  int c;
+  while((c = getopt(argc, argv, "r:s:l:n:")) >= 0) {
+    switch(c) {
+    case 'r':
+      rounds = atoi(optarg);
+      break;
+    case 's':
+      short_reads = strtoul(optarg, 0, 10);
+      break;
+    case 'l':
+      long_reads = strtoul(optarg, 0, 10);
+      break;
+    case 'n':
+      long_read_ops = strtoul(optarg, 0, 10);
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(rounds < 1 || long_read_ops < 2)
+    usage();
+
+  CigarCorpus corpora[2];
+  make_short_reads(corpora[0], short_reads);
+  make_long_reads(corpora[1], long_reads, long_read_ops);
+
+  for(int i = 0; i < 2; ++i) {
+    verify(corpora[i]);
+    bench(corpora[i], "switch", cigar_stats_switch, rounds);
+    bench(corpora[i], "table", cigar_stats, rounds);
+  }
+
+  return 0;
+
+}
@@ -0,0 +1,82 @@
+#ifndef SAMTOYS_CIGAR_STATS_H
+#define SAMTOYS_CIGAR_STATS_H
+
+// Single-pass CIGAR summary shared by filter_match_ratio (MatchRatioStage) and bamcmp's
+// match-counting score. Rather than switching on each op, every op's length is added to a
+// per-op-code total: the op code is already the low 4 bits of the packed CIGAR word, so
+// classification is a table index with no branches. Four interleaved sets of totals keep
+// consecutive ops of the same kind from queueing up behind one another's stores, which matters
+// for long-read CIGARs with thousands of ops.
+
+#include <htslib/sam.h>
+
+#include <stdint.h>
+#include <string.h>
+
+struct CigarStats {
+
+  // Total length per op code (BAM_CMATCH .. BAM_CBACK; codes 9-15 are invalid but harmless).
+  uint64_t op_len[16];
+  // Bit (1 << op) is set for each op code that appears.
+  uint32_t present;
+
+  uint64_t matched() const { return op_len[BAM_CMATCH] + op_len[BAM_CEQUAL]; }
+  uint64_t mismatched() const { return op_len[BAM_CDIFF]; }
+  uint64_t inserted() const { return op_len[BAM_CINS]; }
+  uint64_t deleted() const { return op_len[BAM_CDEL]; }
+  uint64_t skipped() const { return op_len[BAM_CREF_SKIP]; }
+  uint64_t soft_clipped() const { return op_len[BAM_CSOFT_CLIP]; }
+  uint64_t hard_clipped() const { return op_len[BAM_CHARD_CLIP]; }
+
+  bool has(int op) const { return present & (1u << op); }
+
+};
+
+static inline void cigar_stats(const uint32_t* cigar, uint32_t n_cigar, CigarStats* stats) {
+
+  // Short-read CIGARs are too short for the interleaving to pay for clearing and summing it.
+  if(n_cigar < 16) {
+
+    memset(stats->op_len, 0, sizeof(stats->op_len));
+    uint32_t present = 0;
+    for(uint32_t i = 0; i < n_cigar; ++i) {
+      stats->op_len[cigar[i] & BAM_CIGAR_MASK] += cigar[i] >> BAM_CIGAR_SHIFT;
+      present |= 1u << (cigar[i] & BAM_CIGAR_MASK);
+    }
+    stats->present = present;
+    return;
+
+  }
+
+  uint64_t lens[4][16];
+  memset(lens, 0, sizeof(lens));
+  uint32_t present = 0;
+
+  uint32_t i = 0;
+  for(; i + 4 <= n_cigar; i += 4) {
+
+    uint32_t c0 = cigar[i], c1 = cigar[i + 1], c2 = cigar[i + 2], c3 = cigar[i + 3];
+    lens[0][c0 & BAM_CIGAR_MASK] += c0 >> BAM_CIGAR_SHIFT;
+    lens[1][c1 & BAM_CIGAR_MASK] += c1 >> BAM_CIGAR_SHIFT;
+    lens[2][c2 & BAM_CIGAR_MASK] += c2 >> BAM_CIGAR_SHIFT;
+    lens[3][c3 & BAM_CIGAR_MASK] += c3 >> BAM_CIGAR_SHIFT;
+    present |= (1u << (c0 & BAM_CIGAR_MASK)) | (1u << (c1 & BAM_CIGAR_MASK)) | (1u << (c2 & BAM_CIGAR_MASK)) | (1u << (c3 & BAM_CIGAR_MASK));
+
+  }
+
+  for(; i < n_cigar; ++i) {
+    lens[0][cigar[i] & BAM_CIGAR_MASK] += cigar[i] >> BAM_CIGAR_SHIFT;
+    present |= 1u << (cigar[i] & BAM_CIGAR_MASK);
+  }
+
+  for(int op = 0; op < 16; ++op)
+    stats->op_len[op] = lens[0][op] + lens[1][op] + lens[2][op] + lens[3][op];
+  stats->present = present;
+
+}
+
+static inline void cigar_stats(const bam1_t* rec, CigarStats* stats) {
+  cigar_stats(bam_get_cigar(rec), rec->core.n_cigar, stats);
+}
+
+#endif
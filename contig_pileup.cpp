@@ -9,34 +9,12 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <ctype.h>
 #include <string.h>
 
-// Borrowed from Samtools source, since samtools sort -n uses this ordering:
-
-static int strnum_cmp(const char *_a, const char *_b)
-{
-    const unsigned char *a = (const unsigned char*)_a, *b = (const unsigned char*)_b;
-    const unsigned char *pa = a, *pb = b;
-    while (*pa && *pb) {
-        if (isdigit(*pa) && isdigit(*pb)) {
-            while (*pa == '0') ++pa;
-            while (*pb == '0') ++pb;
-            while (isdigit(*pa) && isdigit(*pb) && *pa == *pb) ++pa, ++pb;
-            if (isdigit(*pa) && isdigit(*pb)) {
-                int i = 0;
-                while (isdigit(pa[i]) && isdigit(pb[i])) ++i;
-                return isdigit(pa[i])? 1 : isdigit(pb[i])? -1 : (int)*pa - (int)*pb;
-            } else if (isdigit(*pa)) return 1;
-            else if (isdigit(*pb)) return -1;
-            else if (pa - a != pb - b) return pa - a < pb - b? 1 : -1;
-        } else {
-            if (*pa != *pb) return (int)*pa - (int)*pb;
-            ++pa; ++pb;
-        }
-    }
-    return *pa? 1 : *pb? -1 : 0;
-}
+#include "tool_stats.h"
+#include "big_hfile.h"
+#include "mem_stats.h"
+#include "qname_cmp.h"
 
 static int flag2mate(const bam1_t* rec) {
 
@@ -62,7 +40,8 @@ static bool mate_lt(const bam1_t* a, const bam1_t* b) {
 
 struct BamRecVector {
 
-  std::vector<bam1_t*> recs;
+  typedef std::vector<bam1_t*, CountingAllocator<bam1_t*, mem_groups> > rec_list;
+  rec_list recs;
 
   BamRecVector() {}
   ~BamRecVector() {
@@ -70,12 +49,12 @@ struct BamRecVector {
   }
 
   void copy_add(bam1_t* src) {
-    recs.push_back(bam_dup1(src));
+    recs.push_back(mem_stats_bam_dup1(src));
   }
 
   void clear() {
-    for(std::vector<bam1_t*>::iterator it = recs.begin(), itend = recs.end(); it != itend; ++it)
-      bam_destroy1(*it);
+    for(rec_list::iterator it = recs.begin(), itend = recs.end(); it != itend; ++it)
+      mem_stats_bam_destroy1(*it);
     recs.clear();
   }
 
@@ -87,7 +66,8 @@ struct BamRecVector {
 
 struct CmpIntVector {
 
-  std::vector<int> data;
+  typedef std::vector<int, CountingAllocator<int, mem_tables> > int_list;
+  int_list data;
 
   bool operator==(const CmpIntVector& other) const {
 
@@ -119,6 +99,8 @@ struct CmpIntVector {
 
 };
 
+typedef std::map<CmpIntVector, int, std::less<CmpIntVector>, CountingAllocator<std::pair<const CmpIntVector, int>, mem_tables> > contig_counts;
+
 int main(int argc, char** argv) {
   
   if(argc < 3) {
@@ -128,7 +110,10 @@ int main(int argc, char** argv) {
 
   }
 
-  htsFile* hfi = hts_open(argv[1], "r");
+  tool_stats_init("contig_pileup");
+  mem_stats_init("contig_pileup");
+
+  htsFile* hfi = hts_open_tuned(argv[1], "r");
   if(!hfi) {
     fprintf(stderr, "Failed to open %s\n", argv[1]);
     exit(1);
@@ -141,11 +126,12 @@ int main(int argc, char** argv) {
   }
 
   bam_hdr_t* header = sam_hdr_read(hfi);
+  mem_stats_header(header);
 
   bam1_t* prevrec = bam_init1();
   bam1_t* rec = bam_init1();
 
-  std::map<CmpIntVector, int> counts;
+  contig_counts counts;
 
   CmpIntVector contigs;
 
@@ -153,7 +139,7 @@ int main(int argc, char** argv) {
 
   do {
 
-    if(sam_read1(hfi, header, rec) < 0) {
+    if(tool_stats_read1(hfi, header, rec) < 0) {
       bam_destroy1(rec);
       rec = 0; // Exit after this iteration.
     }
@@ -194,7 +180,7 @@ int main(int argc, char** argv) {
 	  contigs.data.push_back(matchingRecs.recs[i]->core.tid);
 
 	std::sort(contigs.data.begin(), contigs.data.end());
-	std::vector<int>::iterator uniqit = std::unique(contigs.data.begin(), contigs.data.end());
+	CmpIntVector::int_list::iterator uniqit = std::unique(contigs.data.begin(), contigs.data.end());
 	contigs.data.resize(std::distance(contigs.data.begin(), uniqit));
 
 	++(counts[contigs]);
@@ -212,21 +198,26 @@ int main(int argc, char** argv) {
 
   } while(rec);
 
-  for(std::map<CmpIntVector, int>::const_iterator it = counts.begin(), itend = counts.end(); it != itend; ++it) {
+  {
+    StageTimer timer(tool_stage_write);
+    for(contig_counts::const_iterator it = counts.begin(), itend = counts.end(); it != itend; ++it) {
 
-    fprintf(fo, "%d", it->second);
-    for(std::vector<int>::const_iterator contigsit = it->first.data.begin(), contigsend = it->first.data.end();
-	contigsit != contigsend; ++contigsit) {
+      fprintf(fo, "%d", it->second);
+      for(CmpIntVector::int_list::const_iterator contigsit = it->first.data.begin(), contigsend = it->first.data.end();
+	  contigsit != contigsend; ++contigsit) {
 
-      fprintf(fo, ",%d", *contigsit);
+	fprintf(fo, ",%d", *contigsit);
 
-    }
+      }
 
-    fprintf(fo, "\n");
+      fprintf(fo, "\n");
 
+    }
   }
 
   hts_close(hfi);
   fclose(fo);
 
+  tool_stats_finish();
+
 }
@@ -7,137 +7,113 @@
 #include <ctype.h>
 #include <string.h>
 
-enum oper {
-
-  oper_eq,
-  oper_gt,
-  oper_ge,
-  oper_lt,
-  oper_le,
-  oper_ne
-
-};
-
-static void parse_const_or_attr(char* arg, int* constout, char** attrout) {
-  
-  if(isdigit(arg[0])) {
-    *constout = atoi(arg);
-    *attrout = 0;
-  }
-  else {
-    *constout = 0;
-    *attrout = arg;
-  }
-
-}
-
-static oper parse_operator(const char* arg) {
-
-  if(!strcmp(arg, "=="))
-    return oper_eq;
-  else if(!strcmp(arg, "<"))
-    return oper_lt;
-  else if(!strcmp(arg, ">"))
-    return oper_gt;
-  else if(!strcmp(arg, "<="))
-    return oper_le;
-  else if(!strcmp(arg, ">="))
-    return oper_ge;
-  else if(!strcmp(arg, "!="))
-    return oper_ne;
-  
-  fprintf(stderr, "Invalid operator %s\n", arg);
-  exit(1);
-
-}
-
-static int get_const_or_attr(int constin, const char* attrin, bam1_t* rec) {
+#include "record_transforms.h"
+#include "tool_stats.h"
+#include "big_hfile.h"
+#include "output_level.h"
+#include "bam_view.h"
+#include "output_index.h"
 
-  if(attrin) {
-    uint8_t* attr_rec = bam_aux_get(rec, attrin);
-    if(!attr_rec) {
-      fprintf(stderr, "Fatal: At least record %s doesn't have a %s tag as required.\n", bam_get_qname(rec), attrin);
-      exit(1);
-    }
-    return bam_aux2i(attr_rec);
-  }
-  
-  return constin;
-  
-}
+int main(int argc, char** argv) {
 
-static bool eval_test(int op1, oper op, int op2) {
-
-  switch(op) {
-  case oper_eq:
-    return op1 == op2;
-  case oper_lt:
-    return op1 < op2;
-  case oper_gt:
-    return op1 > op2;
-  case oper_le:
-    return op1 <= op2;
-  case oper_ge:
-    return op1 >= op2;
-  case oper_ne:
-    return op1 != op2;
+  // Not getopt, as a constant operand may be negative.
+  const char* out_name = "-";
+  if(argc >= 3 && !strcmp(argv[1], "-o")) {
+    out_name = argv[2];
+    argc -= 2;
+    argv += 2;
   }
 
-}
-
-int main(int argc, char** argv) {
-
   if(argc != 4) {
 
-    fprintf(stderr, "Usage: filter_attr attr_or_constant relation attr_or_constant\n");
+    fprintf(stderr, "Usage: filter_attr [-o out.bam] attr_or_constant relation attr_or_constant\n");
+    fprintf(stderr, "\t-o\tOutput file (default stdout); indexed as it's written if the input is coordinate-sorted\n");
     exit(1);
 
   }
 
-  int consta, constb;
-  char *attra, *attrb;
-  oper op;
-
-  parse_const_or_attr(argv[1], &consta, &attra);
-  parse_const_or_attr(argv[3], &constb, &attrb);
+  AttrFilterStage filter(argv[1], argv[2], argv[3]);
+  tool_stats_init("filter_attr");
 
-  op = parse_operator(argv[2]);
+  // Uncompressed BAM in a regular file is read in place and kept records forwarded as they are;
+  // anything else goes through sam_read1.
+  bam_hdr_t* header = 0;
+  BamView* view = BamView::open("-", &header);
+  htsFile* hfi = view ? 0 : hts_open_tuned("-", "r");
+  htsFile* hfo = hts_open_output(out_name, "wb");
 
-  htsFile* hfi = hts_open("-", "r");
-  htsFile* hfo = hts_open("-", "wb");
+  if((!view && !hfi) || (!hfo)) {
 
-  if((!hfi) || (!hfo)) {
-
-    fprintf(stderr, "Failed to open stdin/out\n");
+    fprintf(stderr, "Failed to open stdin / %s\n", out_name);
     exit(1);
 
   }
 
-  bam_hdr_t* header = sam_hdr_read(hfi);
+  if(!view)
+    header = sam_hdr_read(hfi);
   sam_hdr_write(hfo, header);
 
-  bam1_t* rec = bam_init1();
+  OutputIndexer indexer;
+  indexer.begin(hfo, out_name, header);
 
   int total = 0;
   int kept = 0;
 
-  while(sam_read1(hfi, header, rec) >= 0) {
+  if(view) {
+
+    BamRecordView v;
+    while(true) {
+
+      {
+	SampledStageTimer timer(tool_stage_read);
+	if(!view->next(v))
+	  break;
+      }
+      tool_stats_add_records(1);
+      ++total;
+
+      if(filter.apply(v.rec)) {
+	indexer.check(v.rec);
+	SampledStageTimer timer(tool_stage_write);
+	// The index needs sam_write1 to note where each record went.
+	if(indexer.indexing())
+	  output_sam_write1(hfo, header, v.rec);
+	else {
+	  OutputTimer otimer(hfo, v.raw_len);
+	  bam_view_write(hfo->fp.bgzf, v);
+	}
+	++kept;
+      }
+
+    }
+
+    delete view;
+
+  }
+  else {
 
-    int op1 = get_const_or_attr(consta, attra, rec);
-    int op2 = get_const_or_attr(constb, attrb, rec);
+    bam1_t* rec = bam_init1();
 
-    ++total;
+    while(tool_stats_read1(hfi, header, rec) >= 0) {
+
+      ++total;
+
+      if(filter.apply(rec)) {
+	indexer.check(rec);
+	output_write1(hfo, header, rec);
+	++kept;
+      }
 
-    if(eval_test(op1, op, op2)) {
-      sam_write1(hfo, header, rec);
-      ++kept;
     }
 
+    hts_close(hfi);
+
   }
 
-  hts_close(hfi);
-  hts_close(hfo);
+  indexer.save();
+  hts_close_output(hfo);
 
   fprintf(stderr, "%d / %d records retained\n", kept, total);
+  tool_stats_finish();
 
 }
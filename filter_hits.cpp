@@ -8,34 +8,14 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <ctype.h>
 #include <string.h>
 
-// Borrowed from Samtools source, since samtools sort -n uses this ordering:
-
-static int strnum_cmp(const char *_a, const char *_b)
-{
-    const unsigned char *a = (const unsigned char*)_a, *b = (const unsigned char*)_b;
-    const unsigned char *pa = a, *pb = b;
-    while (*pa && *pb) {
-        if (isdigit(*pa) && isdigit(*pb)) {
-            while (*pa == '0') ++pa;
-            while (*pb == '0') ++pb;
-            while (isdigit(*pa) && isdigit(*pb) && *pa == *pb) ++pa, ++pb;
-            if (isdigit(*pa) && isdigit(*pb)) {
-                int i = 0;
-                while (isdigit(pa[i]) && isdigit(pb[i])) ++i;
-                return isdigit(pa[i])? 1 : isdigit(pb[i])? -1 : (int)*pa - (int)*pb;
-            } else if (isdigit(*pa)) return 1;
-            else if (isdigit(*pb)) return -1;
-            else if (pa - a != pb - b) return pa - a < pb - b? 1 : -1;
-        } else {
-            if (*pa != *pb) return (int)*pa - (int)*pb;
-            ++pa; ++pb;
-        }
-    }
-    return *pa? 1 : *pb? -1 : 0;
-}
+#include "tool_stats.h"
+#include "big_hfile.h"
+#include "output_level.h"
+#include "output_index.h"
+#include "mem_stats.h"
+#include "qname_cmp.h"
 
 static int get_as(const bam1_t* rec) {
 
@@ -72,7 +52,8 @@ static bool mate_lt(const bam1_t* a, const bam1_t* b) {
 
 struct BamRecVector {
 
-  std::vector<bam1_t*> recs;
+  typedef std::vector<bam1_t*, CountingAllocator<bam1_t*, mem_groups> > rec_list;
+  rec_list recs;
 
   BamRecVector() {}
   ~BamRecVector() {
@@ -80,12 +61,12 @@ struct BamRecVector {
   }
 
   void copy_add(bam1_t* src) {
-    recs.push_back(bam_dup1(src));
+    recs.push_back(mem_stats_bam_dup1(src));
   }
 
   void clear() {
-    for(std::vector<bam1_t*>::iterator it = recs.begin(), itend = recs.end(); it != itend; ++it)
-      bam_destroy1(*it);
+    for(rec_list::iterator it = recs.begin(), itend = recs.end(); it != itend; ++it)
+      mem_stats_bam_destroy1(*it);
     recs.clear();
   }
 
@@ -104,13 +85,16 @@ int main(int argc, char** argv) {
 
   }
 
-  htsFile* hfi = hts_open(argv[1], "r");
+  tool_stats_init("filter_hits");
+  mem_stats_init("filter_hits");
+
+  htsFile* hfi = hts_open_tuned(argv[1], "r");
   if(!hfi) {
     fprintf(stderr, "Failed to open %s\n", argv[1]);
     exit(1);
   }
 
-  htsFile* hfo = hts_open(argv[2], "wb");
+  htsFile* hfo = hts_open_output(argv[2], "wb");
   if(!hfo) {
     fprintf(stderr, "Failed to open %s\n", argv[2]);
     exit(1);
@@ -133,18 +117,22 @@ int main(int argc, char** argv) {
   }
 
   bam_hdr_t* header = sam_hdr_read(hfi);
+  mem_stats_header(header);
   sam_hdr_write(hfo, header);
 
+  OutputIndexer indexer;
+  indexer.begin(hfo, argv[2], header);
+
   bam1_t* prevrec = bam_init1();
   bam1_t* rec = bam_init1();
 
-  std::vector<int64_t> counts;
+  std::vector<int64_t, CountingAllocator<int64_t, mem_tables> > counts;
 
   BamRecVector matchingRecs;
 
   do {
 
-    if(sam_read1(hfi, header, rec) < 0) {
+    if(tool_stats_read1(hfi, header, rec) < 0) {
       bam_destroy1(rec);
       rec = 0; // Exit after this iteration.
     }
@@ -213,8 +201,10 @@ int main(int argc, char** argv) {
 
 	if(blockSize <= maxhits) {
 
-	  for(int i = startRec; i != limRec; ++i)
-	    sam_write1(hfo, header, matchingRecs.recs[i]);
+	  for(int i = startRec; i != limRec; ++i) {
+	    indexer.check(matchingRecs.recs[i]);
+	    output_write1(hfo, header, matchingRecs.recs[i]);
+	  }
 
 	}
 
@@ -237,6 +227,9 @@ int main(int argc, char** argv) {
     fprintf(stderr, "%d: %ld\n", i, counts[i]);
 
   hts_close(hfi);
-  hts_close(hfo);
+  indexer.save();
+  hts_close_output(hfo);
+
+  tool_stats_finish();
 
 }
@@ -1,81 +1,118 @@
 
 #include <htslib/hts.h>
 #include <htslib/sam.h>
+#include <htslib/thread_pool.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include "record_transforms.h"
+#include "parallel_records.h"
+#include "tool_stats.h"
+#include "big_hfile.h"
+#include "output_level.h"
+#include "output_index.h"
+
+static void usage() {
+
+  fprintf(stderr, "Usage: filter_match_ratio [-@ threads] [-o out.bam] match_proportion (e.g. 0.5)\n");
+  fprintf(stderr, "\t-@\tWorker threads for the filter, and for BGZF decoding / encoding\n");
+  fprintf(stderr, "\t-o\tOutput file (default stdout); indexed as it's written if the input is coordinate-sorted\n");
+  exit(1);
+
+}
 
 int main(int argc, char** argv) {
 
-  if(argc < 2) {
-    fprintf(stderr, "Usage: filter_match_ratio match_proportion (e.g. 0.5)\n");
-    exit(1);
+  int nthreads = 1;
+  const char* out_name = "-";
+
+  int c;
+  while((c = getopt(argc, argv, "@:o:")) >= 0) {
+    switch(c) {
+    case '@':
+      nthreads = atoi(optarg);
+      break;
+    case 'o':
+      out_name = optarg;
+      break;
+    default:
+      usage();
+    }
   }
 
-  double required_prop = atof(argv[1]);
+  if(optind + 1 != argc)
+    usage();
+
+  tool_stats_init("filter_match_ratio");
+
+  double required_prop = atof(argv[optind]);
   if(required_prop <= 0 || required_prop > 1) {
     fprintf(stderr, "Match proportion must be a real number > 0 and <= 1\n");
     exit(1);
   }
 
-  char filter_message_buf[1024];
-
-  htsFile* hf = hts_open("-", "r");
+  htsFile* hf = hts_open_tuned("-", "r");
   if(!hf) {
     fprintf(stderr, "Failed to open stdin\n");
     exit(1);
   }
 
-  bam_hdr_t* header = sam_hdr_read(hf);
-
-  htsFile* hfo = hts_open("-", "wb");
+  htsFile* hfo = hts_open_output(out_name, "wb");
   if(!hfo) {
-    fprintf(stderr, "Failed to open stdout\n");
+    fprintf(stderr, "Failed to open %s\n", out_name);
     exit(1);
   }
 
-  sam_hdr_write(hfo, header);
-
-  bam1_t *rec = bam_init1();
-
-  while(sam_read1(hf, header, rec) >= 0) {
-
-    int32_t total_bases = rec->core.l_qseq;
-    int32_t matched_bases = 0;
-    
-    uint32_t* cigar_ops = bam_get_cigar(rec);
-    
-    for(uint32_t i = 0; i != rec->core.n_cigar; ++i) {
-
-      uint32_t cigar_op = bam_cigar_op(cigar_ops[i]);
-      uint32_t cigar_len = bam_cigar_oplen(cigar_ops[i]);
-
-      if(cigar_op == BAM_CMATCH || cigar_op == BAM_CEQUAL)
-	matched_bases += cigar_len;
-      else if(cigar_op == BAM_CHARD_CLIP)
-	total_bases += cigar_len;
-
+  htsThreadPool pool = { 0, 0 };
+  if(nthreads > 1) {
+    pool.pool = hts_tpool_init(nthreads);
+    if(!pool.pool) {
+      fprintf(stderr, "Failed to start thread pool\n");
+      exit(1);
     }
+    hts_set_thread_pool(hf, &pool);
+    hts_set_thread_pool(hfo, &pool);
+  }
+
+  bam_hdr_t* header = sam_hdr_read(hf);
+  if(!header) {
+    fprintf(stderr, "Failed to read header\n");
+    exit(1);
+  }
 
-    double match_prop = ((double)matched_bases) / total_bases;
-    if(match_prop < required_prop) {
+  sam_hdr_write(hfo, header);
 
-      // Force unmapped:
-      rec->core.flag |= BAM_FUNMAP;
-      // Note how it got that way:
-      sprintf(filter_message_buf, "Filtered by filter_match_ratio (threshold match %g; actual %g)", required_prop, match_prop);
-      bam_aux_append(rec, "rf", 'Z', strlen(filter_message_buf) + 1, (uint8_t*)filter_message_buf);
+  OutputIndexer indexer;
+  indexer.begin(hfo, out_name, header);
 
-    }
+  MatchRatioStage match_ratio(required_prop);
 
-    sam_write1(hfo, header, rec);
+  process_record_batches(hf, header, nthreads,
+			 [&](BatchRecord& br, int worker) {
+			   match_ratio.apply(br.rec);
+			 },
+			 [&](BatchRecord& br) {
+			   indexer.check(br.rec);
+			   if(output_sam_write1(hfo, header, br.rec) < 0) {
+			     fprintf(stderr, "Failed to write BAM record\n");
+			     exit(1);
+			   }
+			 });
 
+  hts_close(hf);
+  indexer.save();
+  if(hts_close_output(hfo)) {
+    fprintf(stderr, "Failed to close %s\n", out_name);
+    exit(1);
   }
 
-  hts_close(hf);
-  hts_close(hfo);
+  if(pool.pool)
+    hts_tpool_destroy(pool.pool);
 
+  tool_stats_finish();
   return 0;
 
 }
@@ -0,0 +1,332 @@
+
+#include <htslib/hts.h>
+#include <htslib/kstring.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tool_stats.h"
+#include "big_hfile.h"
+
+// Print the lines of the second pileup whose (contig, position) also appears in the first.
+// Replaces filterpileup.py, which kept a Python set of tuples and ran out of memory on whole genomes.
+// With -g, both inputs are taken to be position-sorted in that reference's contig order and are
+// merge-joined in constant memory. Otherwise the first file is loaded into one bitset per contig
+// (one bit per reference base, however many positions are kept), and the second is streamed past it.
+// Either input may be plain, gzipped or bgzipped; bgzipped input is decompressed on -@ threads.
+
+static void usage() {
+
+  fprintf(stderr, "Usage: filter_pileup [-@ nthreads] [-g ref.fa.fai] positions.pileup filter.pileup > out.pileup\n");
+  fprintf(stderr, "\tWrites the lines of filter.pileup whose contig and position occur in positions.pileup\n");
+  fprintf(stderr, "\t-g\tBoth inputs are sorted in the contig order of this .fai (or any file whose first column lists contigs): merge-join them\n");
+  fprintf(stderr, "\t-@\tDecompression threads for each bgzipped input\n");
+  exit(1);
+
+}
+
+struct PileupReader {
+
+  htsFile* hf;
+  const char* fname;
+  kstring_t line;
+  const char* contig;
+  size_t contig_len;
+  uint64_t pos;
+  int64_t lineno;
+
+  PileupReader(const char* _fname, int nthreads) : fname(_fname), contig(0), contig_len(0), pos(0), lineno(0) {
+
+    hf = hts_open_tuned(fname, "r");
+    if(!hf) {
+      fprintf(stderr, "Failed to open %s\n", fname);
+      exit(1);
+    }
+
+    if(nthreads > 1 && hf->format.compression == bgzf)
+      hts_set_threads(hf, nthreads);
+
+    memset(&line, 0, sizeof(line));
+
+  }
+
+  ~PileupReader() {
+    free(line.s);
+    hts_close(hf);
+  }
+
+  // Returns false at EOF. Blank lines are skipped.
+  bool next() {
+
+    SampledStageTimer timer(tool_stage_read);
+    int ret;
+    while((ret = hts_getline(hf, KS_SEP_LINE, &line)) >= 0) {
+
+      ++lineno;
+      char* p = line.s;
+      while(*p == ' ' || *p == '\t')
+	++p;
+      if(!*p || *p == '\r')
+	continue;
+
+      contig = line.s;
+      char* tab = line.s + strcspn(line.s, " \t");
+      contig_len = tab - line.s;
+      char* posend;
+      pos = strtoull(tab, &posend, 10);
+      if(contig_len == 0 || posend == tab) {
+	fprintf(stderr, "Malformed line %ld in %s: %s\n", (long)lineno, fname, line.s);
+	exit(1);
+      }
+
+      tool_stats_add_records(1);
+      return true;
+
+    }
+
+    if(ret < -1) {
+      fprintf(stderr, "Failed to read %s\n", fname);
+      exit(1);
+    }
+
+    return false;
+
+  }
+
+};
+
+// Maps contig names to small integer IDs, remembering the last lookup since pileups come in long
+// runs on the same contig.
+
+class ContigIds {
+
+  std::unordered_map<std::string, int> ids;
+  std::string last_name;
+  int last_id;
+  bool frozen;
+
+public:
+
+  ContigIds() : last_id(-1), frozen(false) {}
+
+  // Stop adding new contigs; unknown ones get -1.
+  void freeze() {
+    frozen = true;
+  }
+
+  int size() const {
+    return ids.size();
+  }
+
+  int get(const char* name, size_t len) {
+
+    if(last_id != -1 && last_name.size() == len && !memcmp(last_name.data(), name, len))
+      return last_id;
+
+    std::string sname(name, len);
+    std::unordered_map<std::string, int>::iterator it = ids.find(sname);
+    int id;
+    if(it != ids.end())
+      id = it->second;
+    else if(frozen)
+      return -1;
+    else {
+      id = ids.size();
+      ids[sname] = id;
+    }
+
+    last_name.swap(sname);
+    last_id = id;
+    return id;
+
+  }
+
+};
+
+static void write_line(const kstring_t& line) {
+
+  SampledStageTimer timer(tool_stage_write);
+  if(fwrite(line.s, 1, line.l, stdout) != line.l || putchar('\n') == EOF) {
+    perror("Failed to write stdout");
+    exit(1);
+  }
+
+}
+
+static void check_order(PileupReader& r, int prev_id, uint64_t prev_pos, int id) {
+
+  if(id == -1) {
+    fprintf(stderr, "%s line %ld: contig %.*s is not listed in the -g contig order\n", r.fname, (long)r.lineno, (int)r.contig_len, r.contig);
+    exit(1);
+  }
+
+  if(id < prev_id || (id == prev_id && r.pos < prev_pos)) {
+    fprintf(stderr, "%s line %ld: input is not sorted in the -g contig order; drop -g to filter unsorted pileups\n", r.fname, (long)r.lineno);
+    exit(1);
+  }
+
+}
+
+static unsigned long merge_join(PileupReader& keep, PileupReader& filter, ContigIds& order) {
+
+  unsigned long kept = 0;
+  int keep_id = -1, filter_id = -1;
+  uint64_t filter_pos = 0;
+  bool keep_more = keep.next();
+  uint64_t keep_pos = 0;
+
+  if(keep_more) {
+    int id = order.get(keep.contig, keep.contig_len);
+    check_order(keep, keep_id, keep_pos, id);
+    keep_id = id;
+    keep_pos = keep.pos;
+  }
+
+  while(keep_more && filter.next()) {
+
+    int id = order.get(filter.contig, filter.contig_len);
+    check_order(filter, filter_id, filter_pos, id);
+    filter_id = id;
+    filter_pos = filter.pos;
+
+    while(keep_id < filter_id || (keep_id == filter_id && keep_pos < filter_pos)) {
+
+      if(!(keep_more = keep.next()))
+	break;
+
+      int id = order.get(keep.contig, keep.contig_len);
+      check_order(keep, keep_id, keep_pos, id);
+      keep_id = id;
+      keep_pos = keep.pos;
+
+    }
+
+    if(keep_more && keep_id == filter_id && keep_pos == filter_pos) {
+      write_line(filter.line);
+      ++kept;
+    }
+
+  }
+
+  return kept;
+
+}
+
+static unsigned long bitset_filter(PileupReader& keep, PileupReader& filter, ContigIds& ids) {
+
+  std::vector<std::vector<uint64_t> > positions;
+  unsigned long nkeep = 0;
+
+  while(keep.next()) {
+
+    int id = ids.get(keep.contig, keep.contig_len);
+    if(id >= (int)positions.size())
+      positions.resize(id + 1);
+
+    std::vector<uint64_t>& bits = positions[id];
+    uint64_t word = keep.pos >> 6;
+    if(word >= bits.size())
+      bits.resize(std::max(word + 1, (uint64_t)bits.size() * 2));
+    bits[word] |= ((uint64_t)1) << (keep.pos & 63);
+    ++nkeep;
+
+  }
+
+  fprintf(stderr, "Loaded %lu positions on %d contigs\n", nkeep, ids.size());
+  ids.freeze();
+
+  unsigned long kept = 0;
+
+  while(filter.next()) {
+
+    int id = ids.get(filter.contig, filter.contig_len);
+    if(id == -1)
+      continue;
+
+    const std::vector<uint64_t>& bits = positions[id];
+    uint64_t word = filter.pos >> 6;
+    if(word < bits.size() && (bits[word] & (((uint64_t)1) << (filter.pos & 63)))) {
+      write_line(filter.line);
+      ++kept;
+    }
+
+  }
+
+  return kept;
+
+}
+
+int main(int argc, char** argv) {
+
+  int nthreads = 1;
+  const char* order_name = 0;
+
+  int c;
+  while((c = getopt(argc, argv, "@:g:")) >= 0) {
+    switch(c) {
+    case '@':
+      nthreads = atoi(optarg);
+      break;
+    case 'g':
+      order_name = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(optind + 2 != argc)
+    usage();
+
+  tool_stats_init("filter_pileup");
+
+  static char outbuf[4 * 1024 * 1024];
+  setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+  PileupReader keep(argv[optind], nthreads);
+  PileupReader filter(argv[optind + 1], nthreads);
+  ContigIds ids;
+  unsigned long kept;
+
+  if(order_name) {
+
+    std::ifstream orderfile(order_name);
+    if(!orderfile) {
+      fprintf(stderr, "Failed to open %s\n", order_name);
+      exit(1);
+    }
+
+    std::string l;
+    while(std::getline(orderfile, l)) {
+      size_t end = l.find_first_of(" \t\r");
+      if(end != 0 && !l.empty())
+	ids.get(l.c_str(), end == std::string::npos ? l.size() : end);
+    }
+
+    ids.freeze();
+    kept = merge_join(keep, filter, ids);
+
+  }
+  else {
+    kept = bitset_filter(keep, filter, ids);
+  }
+
+  if(fflush(stdout)) {
+    perror("Failed to write stdout");
+    exit(1);
+  }
+
+  fprintf(stderr, "Kept %lu lines\n", kept);
+  tool_stats_finish();
+  return 0;
+
+}
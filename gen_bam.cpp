@@ -0,0 +1,533 @@
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/kstring.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "stable_hash.h"
+#include "tool_stats.h"
+#include "big_hfile.h"
+
+// Deterministic synthetic BAMs for benchmarking: paired-end reads with a configurable share of
+// multi-mappers and unmapped pairs, a choice of AS / BS / NM / MD / NH tags, and chr1-style or
+// 1-style contig names listed in lexicographic order (so reorder_chroms has work to do). Output is
+// name-sorted (samtools and Picard orders agree, as qnames are zero-padded) or, with -C,
+// coordinate-sorted and indexed. Everything about read i is a function of the seeds and i alone,
+// so the same command always gives the same records, and -a gives the same reads aligned
+// differently, as a second aligner would (for bamcmp).
+
+static void usage() {
+
+  fprintf(stderr, "Usage: gen_bam [options] -o out.bam\n");
+  fprintf(stderr, "\t-n\tRead pairs (default 100000)\n");
+  fprintf(stderr, "\t-c\tContigs (default 25)\n");
+  fprintf(stderr, "\t-L\tContig length (default 200000)\n");
+  fprintf(stderr, "\t-r\tRead length, 40 to 250 (default 150)\n");
+  fprintf(stderr, "\t-m\tProportion of pairs with 2-5 alignments (default 0.1)\n");
+  fprintf(stderr, "\t-u\tProportion of unmapped pairs (default 0.02)\n");
+  fprintf(stderr, "\t-t\tComma-separated tags to write, from AS,BS,NM,MD,NH (default all)\n");
+  fprintf(stderr, "\t-s\tSeed for the reads themselves (default %lu)\n", (unsigned long)stable_hash_default_seed);
+  fprintf(stderr, "\t-a\tSeed for their alignments (default as -s)\n");
+  fprintf(stderr, "\t-b\tName contigs 1, 2, ... X, Y, MT rather than chr1, chr2, ... chrX, chrY, chrM\n");
+  fprintf(stderr, "\t-C\tCoordinate-sort the output, and index it unless writing to stdout (default name-sorted)\n");
+  fprintf(stderr, "\t-q\tAlso write a proportion (-f) of the qnames to this file, e.g. for subset\n");
+  fprintf(stderr, "\t-f\tProportion of qnames for -q (default 0.1)\n");
+  fprintf(stderr, "\t-O\tOutput mode as for hts_open (default wb)\n");
+  fprintf(stderr, "\t-@\tBGZF compression threads\n");
+  exit(1);
+
+}
+
+enum gen_tags {
+
+  gen_tag_as = 1,
+  gen_tag_bs = 2,
+  gen_tag_nm = 4,
+  gen_tag_md = 8,
+  gen_tag_nh = 16
+
+};
+
+struct GenOptions {
+
+  uint64_t n_pairs;
+  int n_contigs;
+  int64_t contig_len;
+  int read_len;
+  double multimap_rate;
+  double unmapped_rate;
+  int tags;
+  uint64_t read_seed, align_seed;
+  bool numeric_names;
+
+};
+
+// splitmix64: a small generator seeded from a hash of (seed, read, ...).
+
+struct Rng {
+
+  uint64_t state;
+
+  Rng(uint64_t seed, uint64_t a, uint64_t b = 0) {
+    uint64_t key[2] = { a, b };
+    state = stable_hash(key, sizeof(key), seed);
+  }
+
+  uint64_t next() {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  uint32_t below(uint32_t n) { return (uint32_t)((next() >> 32) % n); }
+  double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+};
+
+// One way the pair's mates align: both on one contig, facing each other.
+
+struct PairAlignment {
+
+  int32_t tid;
+  int64_t pos1, pos2;
+  int32_t insert;
+  bool rev1;
+  // Per mate: soft clip at the start, an insertion (> 0) or deletion (< 0) half way, mismatches.
+  int clip[2], indel[2], mismatches[2];
+  int score[2];
+
+};
+
+struct PairInfo {
+
+  bool unmapped;
+  std::vector<PairAlignment> alignments;
+
+};
+
+static PairInfo describe_pair(const GenOptions& opts, uint64_t i) {
+
+  Rng rng(opts.align_seed, i);
+  PairInfo pair;
+  pair.unmapped = rng.uniform() < opts.unmapped_rate;
+  if(pair.unmapped)
+    return pair;
+
+  int n = rng.uniform() < opts.multimap_rate ? 2 + rng.below(4) : 1;
+  for(int j = 0; j < n; ++j) {
+
+    PairAlignment al;
+    al.tid = rng.below(opts.n_contigs);
+    al.insert = 250 + rng.below(100);
+    al.pos1 = rng.below(std::max<int64_t>(opts.contig_len - al.insert, 1));
+    al.pos2 = al.pos1 + al.insert - opts.read_len;
+    al.rev1 = rng.below(2);
+    for(int m = 0; m < 2; ++m) {
+      uint32_t kind = rng.below(20);
+      al.clip[m] = kind < 2 ? 1 + rng.below(20) : 0;
+      al.indel[m] = kind == 2 ? 1 + rng.below(3) : kind == 3 ? -(int)(1 + rng.below(3)) : 0;
+      al.mismatches[m] = rng.below(4);
+      int aligned = opts.read_len - al.clip[m];
+      al.score[m] = aligned - 4 * al.mismatches[m] - 6 * abs(al.indel[m]) - (int)(j ? rng.below(10) : 0);
+    }
+    pair.alignments.push_back(al);
+
+  }
+
+  return pair;
+
+}
+
+static const char bases[] = "ACGT";
+
+// Append an M segment of length len with the given mismatches spread through it to the MD string.
+
+static void append_md_matches(kstring_t* md, int len, int mismatches, Rng& rng) {
+
+  int run = len / (mismatches + 1);
+  for(int k = 0; k < mismatches; ++k) {
+    kputw(run - 1, md);
+    kputc(bases[rng.below(4)], md);
+    len -= run;
+  }
+  kputw(len, md);
+
+}
+
+static void format_record(const GenOptions& opts, const std::vector<std::string>& names, uint64_t i, const PairInfo& pair,
+			  int j, int mate, kstring_t* line) {
+
+  line->l = 0;
+  ksprintf(line, "SIM:%010lu\t", (unsigned long)i);
+
+  int flag = BAM_FPAIRED | (mate == 0 ? BAM_FREAD1 : BAM_FREAD2);
+  const PairAlignment* al = pair.unmapped ? 0 : &pair.alignments[j];
+
+  if(!al) {
+    flag |= BAM_FUNMAP | BAM_FMUNMAP;
+    ksprintf(line, "%d\t*\t0\t0\t*\t*\t0\t0\t", flag);
+  }
+  else {
+
+    bool rev = (mate == 0) == al->rev1;
+    flag |= BAM_FPROPER_PAIR | (rev ? BAM_FREVERSE : 0) | (rev ? 0 : BAM_FMREVERSE) | (j ? BAM_FSECONDARY : 0);
+    int64_t pos = mate == 0 ? al->pos1 : al->pos2;
+    int64_t mpos = mate == 0 ? al->pos2 : al->pos1;
+    ksprintf(line, "%d\t%s\t%ld\t%d\t", flag, names[al->tid].c_str(), (long)(pos + 1), j ? 0 : 60);
+
+    int clip = al->clip[mate], indel = al->indel[mate];
+    int body = opts.read_len - clip - (indel > 0 ? indel : 0);
+    if(clip)
+      ksprintf(line, "%dS", clip);
+    if(indel)
+      ksprintf(line, "%dM%d%c%dM", body / 2, abs(indel), indel > 0 ? 'I' : 'D', body - body / 2);
+    else
+      ksprintf(line, "%dM", body);
+
+    ksprintf(line, "\t=\t%ld\t%d\t", (long)(mpos + 1), mate == 0 ? al->insert : -al->insert);
+
+  }
+
+  Rng seqrng(opts.read_seed, i, mate);
+  for(int k = 0; k < opts.read_len; ++k)
+    kputc(bases[seqrng.below(4)], line);
+  kputc('\t', line);
+  for(int k = 0; k < opts.read_len; ++k)
+    kputc(33 + 2 + seqrng.below(39), line);
+
+  if(!al)
+    return;
+
+  Rng tagrng(opts.align_seed, i, (j << 1) | mate);
+  int nm = al->mismatches[mate] + abs(al->indel[mate]);
+
+  if(opts.tags & gen_tag_as)
+    ksprintf(line, "\tAS:i:%d", al->score[mate]);
+  if(opts.tags & gen_tag_bs)
+    ksprintf(line, "\tBS:i:%d", al->score[mate] - (pair.alignments.size() > 1 ? (int)tagrng.below(10) : 20 + (int)tagrng.below(40)));
+  if(opts.tags & gen_tag_nm)
+    ksprintf(line, "\tNM:i:%d", nm);
+  if(opts.tags & gen_tag_md) {
+    kputs("\tMD:Z:", line);
+    int clip = al->clip[mate], indel = al->indel[mate];
+    int body = opts.read_len - clip - (indel > 0 ? indel : 0);
+    int mism = al->mismatches[mate];
+    if(indel < 0) {
+      append_md_matches(line, body / 2, mism / 2, tagrng);
+      kputc('^', line);
+      for(int k = 0; k < -indel; ++k)
+	kputc(bases[tagrng.below(4)], line);
+      append_md_matches(line, body - body / 2, mism - mism / 2, tagrng);
+    }
+    else {
+      append_md_matches(line, body, mism, tagrng);
+    }
+  }
+  if(opts.tags & gen_tag_nh)
+    ksprintf(line, "\tNH:i:%d", (int)pair.alignments.size());
+
+}
+
+static std::vector<std::string> contig_names(int n, bool numeric) {
+
+  std::vector<std::string> names;
+  char buf[32];
+  for(int i = 0; i < n; ++i) {
+    if(i < 22)
+      sprintf(buf, "%s%d", numeric ? "" : "chr", i + 1);
+    else if(i == 22)
+      sprintf(buf, "%sX", numeric ? "" : "chr");
+    else if(i == 23)
+      sprintf(buf, "%sY", numeric ? "" : "chr");
+    else if(i == 24)
+      sprintf(buf, "%s", numeric ? "MT" : "chrM");
+    else
+      sprintf(buf, "%sUn_%d", numeric ? "" : "chr", i - 24);
+    names.push_back(buf);
+  }
+
+  std::sort(names.begin(), names.end());
+  return names;
+
+}
+
+static int parse_tags(const char* arg) {
+
+  int tags = 0;
+  std::string spec = arg;
+  size_t start = 0;
+  while(start <= spec.size()) {
+    size_t end = spec.find(',', start);
+    if(end == std::string::npos)
+      end = spec.size();
+    std::string tag = spec.substr(start, end - start);
+    if(tag == "AS")
+      tags |= gen_tag_as;
+    else if(tag == "BS")
+      tags |= gen_tag_bs;
+    else if(tag == "NM")
+      tags |= gen_tag_nm;
+    else if(tag == "MD")
+      tags |= gen_tag_md;
+    else if(tag == "NH")
+      tags |= gen_tag_nh;
+    else if(!tag.empty()) {
+      fprintf(stderr, "Unknown tag %s\n", tag.c_str());
+      exit(1);
+    }
+    start = end + 1;
+  }
+  return tags;
+
+}
+
+// Where a record sorts in coordinate order, and how to regenerate it.
+
+struct CoordKey {
+
+  uint64_t key;
+  uint64_t read;
+  uint32_t alignment;
+  uint32_t mate;
+
+  bool operator<(const CoordKey& other) const {
+    if(key != other.key)
+      return key < other.key;
+    if(read != other.read)
+      return read < other.read;
+    if(mate != other.mate)
+      return mate < other.mate;
+    return alignment < other.alignment;
+  }
+
+};
+
+int main(int argc, char** argv) {
+
+  GenOptions opts;
+  opts.n_pairs = 100000;
+  opts.n_contigs = 25;
+  opts.contig_len = 200000;
+  opts.read_len = 150;
+  opts.multimap_rate = 0.1;
+  opts.unmapped_rate = 0.02;
+  opts.tags = gen_tag_as | gen_tag_bs | gen_tag_nm | gen_tag_md | gen_tag_nh;
+  opts.read_seed = stable_hash_default_seed;
+  opts.numeric_names = false;
+
+  bool align_seed_set = false, coordinate = false;
+  const char* out_name = 0;
+  const char* out_mode = "wb";
+  const char* qname_name = 0;
+  double qname_prop = 0.1;
+  int nthreads = 1;
+
+  int c;
+  while((c = getopt(argc, argv, "n:c:L:r:m:u:t:s:a:bCq:f:o:O:@:")) >= 0) {
+    switch(c) {
+    case 'n':
+      opts.n_pairs = strtoull(optarg, 0, 10);
+      break;
+    case 'c':
+      opts.n_contigs = atoi(optarg);
+      break;
+    case 'L':
+      opts.contig_len = strtoll(optarg, 0, 10);
+      break;
+    case 'r':
+      opts.read_len = atoi(optarg);
+      break;
+    case 'm':
+      opts.multimap_rate = atof(optarg);
+      break;
+    case 'u':
+      opts.unmapped_rate = atof(optarg);
+      break;
+    case 't':
+      opts.tags = parse_tags(optarg);
+      break;
+    case 's':
+      opts.read_seed = strtoull(optarg, 0, 0);
+      break;
+    case 'a':
+      opts.align_seed = strtoull(optarg, 0, 0);
+      align_seed_set = true;
+      break;
+    case 'b':
+      opts.numeric_names = true;
+      break;
+    case 'C':
+      coordinate = true;
+      break;
+    case 'q':
+      qname_name = optarg;
+      break;
+    case 'f':
+      qname_prop = atof(optarg);
+      break;
+    case 'o':
+      out_name = optarg;
+      break;
+    case 'O':
+      out_mode = optarg;
+      break;
+    case '@':
+      nthreads = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(!out_name || optind != argc || opts.n_contigs < 1 || opts.read_len < 40 || opts.read_len > 250 || opts.contig_len < 1000)
+    usage();
+
+  tool_stats_init("gen_bam");
+
+  if(!align_seed_set)
+    opts.align_seed = opts.read_seed;
+
+  std::vector<std::string> names = contig_names(opts.n_contigs, opts.numeric_names);
+
+  std::string htext = std::string("@HD\tVN:1.6\tSO:") + (coordinate ? "coordinate" : "queryname") + "\n";
+  for(int i = 0; i < opts.n_contigs; ++i) {
+    char buf[128];
+    snprintf(buf, 128, "@SQ\tSN:%s\tLN:%ld\n", names[i].c_str(), (long)opts.contig_len);
+    htext += buf;
+  }
+  htext += "@PG\tID:gen_bam\tPN:gen_bam\n";
+
+  bam_hdr_t* header = sam_hdr_parse(htext.size(), htext.c_str());
+  if(!header) {
+    fprintf(stderr, "Failed to build header\n");
+    exit(1);
+  }
+
+  htsFile* hfo = hts_open_tuned(out_name, out_mode);
+  if(!hfo) {
+    fprintf(stderr, "Failed to open %s\n", out_name);
+    exit(1);
+  }
+  if(nthreads > 1)
+    hts_set_threads(hfo, nthreads);
+
+  if(sam_hdr_write(hfo, header)) {
+    fprintf(stderr, "Failed to write header to %s\n", out_name);
+    exit(1);
+  }
+
+  bool index = coordinate && strcmp(out_name, "-") && hfo->format.format == bam;
+  if(index && sam_idx_init(hfo, header, 0, 0)) {
+    fprintf(stderr, "Failed to start index for %s\n", out_name);
+    exit(1);
+  }
+
+  FILE* qnames = 0;
+  if(qname_name) {
+    qnames = fopen(qname_name, "w");
+    if(!qnames) {
+      fprintf(stderr, "Failed to open %s\n", qname_name);
+      exit(1);
+    }
+  }
+
+  kstring_t line = { 0, 0, 0 };
+  bam1_t* rec = bam_init1();
+  uint64_t nrecs = 0;
+  uint64_t qname_threshold = stable_hash_threshold(qname_prop);
+
+  // Name order: each pair's READ1 records and then its READ2s. Coordinate order needs every
+  // record's key first; the records themselves are regenerated as they're written.
+  std::vector<CoordKey> keys;
+
+  for(uint64_t i = 0; i < opts.n_pairs; ++i) {
+
+    PairInfo pair = describe_pair(opts, i);
+    int n = pair.unmapped ? 1 : pair.alignments.size();
+
+    if(qnames && stable_hash(&i, sizeof(i), opts.read_seed) <= qname_threshold)
+      fprintf(qnames, "SIM:%010lu\n", (unsigned long)i);
+
+    for(int mate = 0; mate < 2; ++mate) {
+      for(int j = 0; j < n; ++j) {
+
+	if(coordinate) {
+	  CoordKey k;
+	  if(pair.unmapped)
+	    k.key = UINT64_MAX;
+	  else {
+	    const PairAlignment& al = pair.alignments[j];
+	    bool rev = (mate == 0) == al.rev1;
+	    k.key = ((uint64_t)al.tid << 32 | (uint64_t)((mate == 0 ? al.pos1 : al.pos2) + 1)) << 1 | rev;
+	  }
+	  k.read = i;
+	  k.alignment = j;
+	  k.mate = mate;
+	  keys.push_back(k);
+	  continue;
+	}
+
+	format_record(opts, names, i, pair, j, mate, &line);
+	if(sam_parse1(&line, header, rec) < 0 || tool_stats_write1(hfo, header, rec) < 0) {
+	  fprintf(stderr, "Failed to write record %s\n", line.s);
+	  exit(1);
+	}
+	++nrecs;
+	tool_stats_add_records(1);
+
+      }
+    }
+
+  }
+
+  if(coordinate) {
+
+    std::sort(keys.begin(), keys.end());
+    for(size_t k = 0, klim = keys.size(); k != klim; ++k) {
+
+      PairInfo pair = describe_pair(opts, keys[k].read);
+      format_record(opts, names, keys[k].read, pair, keys[k].alignment, keys[k].mate, &line);
+      if(sam_parse1(&line, header, rec) < 0 || tool_stats_write1(hfo, header, rec) < 0) {
+	fprintf(stderr, "Failed to write record %s\n", line.s);
+	exit(1);
+      }
+      ++nrecs;
+      tool_stats_add_records(1);
+
+    }
+
+  }
+
+  if(index && sam_idx_save(hfo)) {
+    fprintf(stderr, "Failed to write index for %s\n", out_name);
+    exit(1);
+  }
+
+  if(hts_close(hfo)) {
+    fprintf(stderr, "Failed to close %s\n", out_name);
+    exit(1);
+  }
+
+  if(qnames && fclose(qnames)) {
+    fprintf(stderr, "Failed to write %s\n", qname_name);
+    exit(1);
+  }
+
+  fprintf(stderr, "Wrote %lu records for %lu read pairs\n", (unsigned long)nrecs, (unsigned long)opts.n_pairs);
+
+  free(line.s);
+  bam_destroy1(rec);
+  bam_hdr_destroy(header);
+  tool_stats_finish();
+  return 0;
+
+}
@@ -0,0 +1,243 @@
+#ifndef SAMTOYS_MEM_STATS_H
+#define SAMTOYS_MEM_STATS_H
+
+// Allocation accounting by category for the tools that hold records in memory, off unless
+// SAMTOYS_MEMSTATS is set:
+//   SAMTOYS_MEMSTATS=1 or stderr   print a table at exit
+//   SAMTOYS_MEMSTATS=path          append it as a JSON line to path instead
+// The report gives, for each category, the number of allocations, bytes still live and the
+// high-water mark of live bytes, plus the process's peak RSS (VmHWM); the gap between the sum of
+// the high-water marks and peak RSS is htslib's buffers, the allocator's overhead and code.
+// Containers count their storage by using CountingAllocator; records are counted by duplicating,
+// growing and destroying them through the mem_stats_bam_* wrappers.
+
+#include <htslib/sam.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+
+enum mem_category {
+
+  mem_records,
+  mem_groups,
+  mem_tables,
+  mem_header,
+  mem_n_categories
+
+};
+
+static const char* const mem_category_names[mem_n_categories] = { "records", "groups", "tables", "header" };
+
+struct MemStats {
+
+  bool enabled;
+  FILE* out;
+  bool json;
+  const char* name;
+
+  std::atomic<uint64_t> allocs[mem_n_categories];
+  std::atomic<int64_t> live[mem_n_categories];
+  std::atomic<int64_t> peak[mem_n_categories];
+
+};
+
+// Zero-initialised, so disabled until mem_stats_init finds SAMTOYS_MEMSTATS.
+static MemStats mem_stats;
+
+static inline void mem_stats_alloc(mem_category cat, size_t bytes) {
+
+  if(!mem_stats.enabled)
+    return;
+
+  mem_stats.allocs[cat].fetch_add(1, std::memory_order_relaxed);
+  int64_t now = mem_stats.live[cat].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  int64_t peak = mem_stats.peak[cat].load(std::memory_order_relaxed);
+  while(now > peak && !mem_stats.peak[cat].compare_exchange_weak(peak, now, std::memory_order_relaxed))
+    ;
+
+}
+
+static inline void mem_stats_free(mem_category cat, size_t bytes) {
+
+  if(mem_stats.enabled)
+    mem_stats.live[cat].fetch_sub(bytes, std::memory_order_relaxed);
+
+}
+
+// For std containers: e.g. std::vector<bam1_t*, CountingAllocator<bam1_t*, mem_groups> >.
+
+template<class T, mem_category C>
+struct CountingAllocator {
+
+  typedef T value_type;
+
+  template<class U> struct rebind {
+    typedef CountingAllocator<U, C> other;
+  };
+
+  CountingAllocator() {}
+  template<class U> CountingAllocator(const CountingAllocator<U, C>&) {}
+
+  T* allocate(size_t n) {
+    T* p = static_cast<T*>(::operator new(n * sizeof(T)));
+    mem_stats_alloc(C, n * sizeof(T));
+    return p;
+  }
+
+  void deallocate(T* p, size_t n) {
+    mem_stats_free(C, n * sizeof(T));
+    ::operator delete(p);
+  }
+
+};
+
+template<class T, class U, mem_category C>
+bool operator==(const CountingAllocator<T, C>&, const CountingAllocator<U, C>&) {
+  return true;
+}
+
+template<class T, class U, mem_category C>
+bool operator!=(const CountingAllocator<T, C>&, const CountingAllocator<U, C>&) {
+  return false;
+}
+
+// A record's footprint is its bam1_t plus its data buffer as allocated (m_data, not l_data).
+
+static inline bam1_t* mem_stats_bam_dup1(const bam1_t* src, mem_category cat = mem_records) {
+
+  bam1_t* b = bam_dup1(src);
+  if(b)
+    mem_stats_alloc(cat, sizeof(bam1_t) + b->m_data);
+  return b;
+
+}
+
+static inline void mem_stats_bam_destroy1(bam1_t* b, mem_category cat = mem_records) {
+
+  if(b)
+    mem_stats_free(cat, sizeof(bam1_t) + b->m_data);
+  bam_destroy1(b);
+
+}
+
+// bam_aux_append on a counted record, which may grow its data buffer.
+
+static inline int mem_stats_bam_aux_append(bam1_t* b, const char tag[2], char type, int len, const uint8_t* data,
+					   mem_category cat = mem_records) {
+
+  uint32_t before = b->m_data;
+  int ret = bam_aux_append(b, tag, type, len, data);
+  if(b->m_data > before) {
+    mem_stats_free(cat, before);
+    mem_stats_alloc(cat, b->m_data);
+  }
+  return ret;
+
+}
+
+// Counts a header's text and target names and lengths; headers live until exit, so these are
+// never freed.
+
+static void mem_stats_header(const bam_hdr_t* header) {
+
+  if(!mem_stats.enabled || !header)
+    return;
+
+  size_t bytes = sizeof(bam_hdr_t) + header->l_text + 1;
+  bytes += header->n_targets * (sizeof(char*) + sizeof(uint32_t));
+  for(int32_t i = 0; i < header->n_targets; ++i)
+    bytes += strlen(header->target_name[i]) + 1;
+
+  mem_stats_alloc(mem_header, bytes);
+
+}
+
+// Peak resident set size in kB, from /proc/self/status.
+
+static long mem_stats_peak_rss_kb() {
+
+  FILE* f = fopen("/proc/self/status", "r");
+  if(!f)
+    return -1;
+
+  char line[128];
+  long kb = -1;
+  while(fgets(line, sizeof(line), f)) {
+    if(sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+      break;
+  }
+  fclose(f);
+  return kb;
+
+}
+
+static void mem_stats_report() {
+
+  if(!mem_stats.enabled)
+    return;
+
+  long rss_kb = mem_stats_peak_rss_kb();
+  FILE* out = mem_stats.out;
+
+  if(mem_stats.json) {
+
+    fprintf(out, "{\"tool\": \"%s\", \"pid\": %d, \"peak_rss_kb\": %ld", mem_stats.name, (int)getpid(), rss_kb);
+    for(int i = 0; i < mem_n_categories; ++i) {
+      fprintf(out, ", \"%s\": {\"allocs\": %llu, \"live_bytes\": %lld, \"peak_bytes\": %lld}", mem_category_names[i],
+	      (unsigned long long)mem_stats.allocs[i], (long long)mem_stats.live[i], (long long)mem_stats.peak[i]);
+    }
+    fprintf(out, "}\n");
+
+  }
+  else {
+
+    fprintf(out, "[%s] peak RSS %.1f MB\n", mem_stats.name, rss_kb / 1024.0);
+    fprintf(out, "[%s] %-8s %14s %14s %14s\n", mem_stats.name, "category", "allocs", "live bytes", "peak bytes");
+    for(int i = 0; i < mem_n_categories; ++i) {
+      fprintf(out, "[%s] %-8s %14llu %14lld %14lld\n", mem_stats.name, mem_category_names[i],
+	      (unsigned long long)mem_stats.allocs[i], (long long)mem_stats.live[i], (long long)mem_stats.peak[i]);
+    }
+
+  }
+
+  if(out != stderr)
+    fclose(out);
+  mem_stats.enabled = false;
+
+}
+
+// Reports at exit, including exit(1) on errors, so a run that dies of a bad input still says how
+// big it got.
+
+static void mem_stats_init(const char* name) {
+
+  const char* dest = getenv("SAMTOYS_MEMSTATS");
+  if(!dest || !*dest || !strcmp(dest, "0"))
+    return;
+
+  mem_stats.name = name;
+  if(!strcmp(dest, "1") || !strcmp(dest, "stderr")) {
+    mem_stats.out = stderr;
+    mem_stats.json = false;
+  }
+  else {
+    mem_stats.out = fopen(dest, "a");
+    if(!mem_stats.out) {
+      fprintf(stderr, "Failed to open SAMTOYS_MEMSTATS file %s\n", dest);
+      exit(1);
+    }
+    mem_stats.json = true;
+  }
+
+  mem_stats.enabled = true;
+  atexit(mem_stats_report);
+
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef SAMTOYS_OUTPUT_INDEX_H
+#define SAMTOYS_OUTPUT_INDEX_H
+
+// Index a BAM output while it's written, via sam_idx_init / sam_idx_save, so a coordinate-sorted
+// result doesn't need a separate samtools index pass. It's used when the output is a file and the
+// header says SO:coordinate; the index is out.bam.bai, or out.bam.csi if a contig is too long for
+// BAI. Filters keep the input's order, but the header can be wrong, so every record's position is
+// checked against the last before it's written: if the order goes backwards, indexing stops with a
+// warning rather than failing the write as hts_idx_push would.
+//
+// Usage: begin() after sam_hdr_write, check(rec) before writing each record, save() before closing.
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+class OutputIndexer {
+
+  htsFile* hf;
+  const bam_hdr_t* header;
+  std::string out_name, idx_name;
+  bool active;
+  // An index abandoned part way, waiting to go back to hf for hts_close to free.
+  hts_idx_t* dropped;
+  // Unmapped records without a position sort after everything else.
+  int64_t last_tid, last_pos;
+
+  static bool says_coordinate_sorted(const bam_hdr_t* header) {
+
+    if(!header->text || strncmp(header->text, "@HD", 3))
+      return false;
+    const char* eol = strchr(header->text, '\n');
+    std::string hd(header->text, eol ? eol - header->text : strlen(header->text));
+    return hd.find("\tSO:coordinate") != std::string::npos;
+
+  }
+
+public:
+
+  OutputIndexer() : hf(0), header(0), active(false), dropped(0), last_tid(-1), last_pos(-1) {}
+
+  // Start indexing hf, which has just had header written to it, if that's possible and useful.
+  void begin(htsFile* _hf, const char* _out_name, const bam_hdr_t* _header) {
+
+    hf = _hf;
+    header = _header;
+    out_name = _out_name;
+
+    if(!strcmp(_out_name, "-") || hf->format.format != bam || !says_coordinate_sorted(header))
+      return;
+
+    // BAI bins only cover 2^29 bases.
+    int min_shift = 0;
+    for(int32_t i = 0; i < header->n_targets; ++i) {
+      if(header->target_len[i] >= (1U << 29))
+	min_shift = 14;
+    }
+
+    idx_name = out_name + (min_shift ? ".csi" : ".bai");
+    if(sam_idx_init(hf, (bam_hdr_t*)header, min_shift, idx_name.c_str()) < 0) {
+      fprintf(stderr, "Failed to start indexing %s; not indexing\n", out_name.c_str());
+      return;
+    }
+
+    active = true;
+
+  }
+
+  bool indexing() const {
+    return active;
+  }
+
+  void check(const bam1_t* rec) {
+
+    if(!active)
+      return;
+
+    int64_t tid = rec->core.tid < 0 ? INT64_MAX : rec->core.tid;
+    int64_t pos = rec->core.tid < 0 ? 0 : rec->core.pos;
+    if(tid < last_tid || (tid == last_tid && pos < last_pos)) {
+
+      fprintf(stderr, "%s isn't coordinate-sorted (%s:%lld comes after %s:%lld); not indexing it\n", out_name.c_str(),
+	      rec->core.tid < 0 ? "*" : header->target_name[rec->core.tid], (long long)rec->core.pos + 1,
+	      last_tid == INT64_MAX ? "*" : header->target_name[last_tid], (long long)last_pos + 1);
+      // Records already written may still be queued for BGZF's threads to add to the index, so
+      // it can't be freed yet; hts_close does that. Detaching it stops any more being added.
+      dropped = hf->idx;
+      hf->idx = 0;
+      active = false;
+      return;
+
+    }
+
+    last_tid = tid;
+    last_pos = pos;
+
+  }
+
+  // Write the index, if there still is one, and hand back any abandoned one for hts_close to free.
+  void save() {
+
+    if(active) {
+      if(sam_idx_save(hf) < 0) {
+	fprintf(stderr, "Failed to write %s\n", idx_name.c_str());
+	exit(1);
+      }
+      fprintf(stderr, "Wrote index %s\n", idx_name.c_str());
+      active = false;
+    }
+    else if(dropped) {
+      hf->idx = dropped;
+      dropped = 0;
+    }
+
+  }
+
+};
+
+#endif
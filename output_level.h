@@ -0,0 +1,280 @@
+#ifndef SAMTOYS_OUTPUT_LEVEL_H
+#define SAMTOYS_OUTPUT_LEVEL_H
+
+// Deflate level for the tools' BAM outputs, set by SAMTOYS_COMPRESS:
+//   unset                       each tool's own choice (wb0 for subset, bamcmp and reorder_chroms,
+//                               which usually feed another tool; htslib's default for the rest)
+//   SAMTOYS_COMPRESS=0 ... 9    that level
+//   SAMTOYS_COMPRESS=adaptive[:max]   choose per block between 0 and max (default 6)
+// Adaptive outputs start uncompressed. Every megabyte of records, the level goes up one if the
+// output spent a fifth or more of the time blocked in write (the reader or the disk can't keep up,
+// so CPU spent compressing is free), and down one if writes hardly blocked while compressing
+// took a good share of the writing thread's time (we're the bottleneck). Blocked time comes from
+// big_hfile.h's backend, so with SAMTOYS_IO=off adaptive just uses max. On close each adaptive
+// output logs its compression ratio, throughput and how much went out at each level.
+//
+// Tools open outputs with hts_open_output, write with output_write1 (or output_sam_write1 where
+// writing is already timed, or an OutputTimer around other writes) and close with
+// hts_close_output. BGZF reads the level from its compress_level field as it compresses each
+// block, on its own threads if it has any, so changes apply from the next block on.
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "tool_stats.h"
+#include "big_hfile.h"
+
+struct OutputLevelOptions {
+
+  // -1 for the tool's own mode.
+  int level;
+  bool adaptive;
+
+};
+
+static const OutputLevelOptions& output_level_options() {
+
+  static OutputLevelOptions opts;
+  static bool parsed = false;
+  if(parsed)
+    return opts;
+
+  opts.level = -1;
+  opts.adaptive = false;
+
+  const char* env = getenv("SAMTOYS_COMPRESS");
+  if(env && *env) {
+
+    char* end;
+    if(!strncmp(env, "adaptive", 8)) {
+      opts.adaptive = true;
+      opts.level = 6;
+      if(env[8] == ':')
+	opts.level = strtol(env + 9, &end, 10);
+      else
+	end = (char*)env + 8;
+    }
+    else
+      opts.level = strtol(env, &end, 10);
+
+    if(*end || opts.level < 0 || opts.level > 9) {
+      fprintf(stderr, "Bad SAMTOYS_COMPRESS %s (expected a level 0-9, adaptive or adaptive:max_level)\n", env);
+      exit(1);
+    }
+
+  }
+
+  parsed = true;
+  return opts;
+
+}
+
+class AdaptiveLevel {
+
+  // How much uncompressed data between decisions: 16 BGZF blocks.
+  static const uint64_t window_bytes = 1 << 20;
+
+  std::string name;
+  BGZF* bgzf;
+  int max_level, level;
+  bool blocked_known;
+
+  uint64_t start_ns, window_start_ns, window_write_ns, window_blocked_ns;
+  uint64_t window_in, bytes_in;
+  uint64_t bytes_at_level[10];
+
+  uint64_t blocked_ns() {
+
+    uint64_t ns = 0;
+    big_hfile_write_ns(bgzf->fp, &ns);
+    return ns;
+
+  }
+
+  void set_level(int l) {
+
+    // With a thread pool, BGZF's workers read compress_level as they compress each block, and
+    // it's a bit-field sharing a word with BGZF's flags, so it can't be stored atomically. Instead
+    // let the queued blocks finish first: in threaded mode bgzf_flush waits for them. Levels
+    // change at most once a megabyte, so the stall is rare. A failed flush leaves BGZF's error
+    // set for the next write to report.
+    if(bgzf->mt && bgzf_flush(bgzf) < 0)
+      return;
+    level = l;
+    bgzf->compress_level = l;
+
+  }
+
+  void decide() {
+
+    uint64_t now = tool_stats_now();
+    uint64_t wall = now - window_start_ns;
+    uint64_t blocked = blocked_ns() - window_blocked_ns;
+    // Blocking happens inside our writes unless BGZF has a writer thread; either way what's left
+    // is compressing, or waiting for BGZF's threads to compress.
+    uint64_t compressing = window_write_ns > blocked ? window_write_ns - blocked : 0;
+
+    if(wall) {
+      double blocked_frac = (double)blocked / wall;
+      double compress_frac = (double)compressing / wall;
+      if(blocked_frac >= 0.2 && level < max_level)
+	set_level(level + 1);
+      else if(blocked_frac < 0.05 && compress_frac >= 0.3 && level > 0)
+	set_level(level - 1);
+    }
+
+    window_start_ns = now;
+    window_write_ns = 0;
+    window_blocked_ns += blocked;
+    window_in = 0;
+
+  }
+
+public:
+
+  AdaptiveLevel(const char* _name, htsFile* hf, int _max_level) :
+    name(_name), bgzf(hf->fp.bgzf), max_level(_max_level), window_write_ns(0), window_in(0), bytes_in(0) {
+
+    memset(bytes_at_level, 0, sizeof(bytes_at_level));
+    uint64_t ns;
+    blocked_known = big_hfile_write_ns(bgzf->fp, &ns);
+    if(!blocked_known)
+      fprintf(stderr, "%s: adaptive compression needs SAMTOYS_IO's backend to see blocking; using level %d\n", _name, max_level);
+    set_level(blocked_known ? 0 : max_level);
+
+    start_ns = window_start_ns = tool_stats_now();
+    window_blocked_ns = blocked_known ? ns : 0;
+
+  }
+
+  // A write of bytes (uncompressed) that took ns.
+  void add(uint64_t bytes, uint64_t ns) {
+
+    bytes_in += bytes;
+    bytes_at_level[level] += bytes;
+    if(!blocked_known)
+      return;
+
+    window_in += bytes;
+    window_write_ns += ns;
+    if(window_in >= window_bytes)
+      decide();
+
+  }
+
+  // Call once everything is written, before closing.
+  void report() {
+
+    if(bgzf_flush(bgzf) < 0)
+      return;
+
+    double secs = (tool_stats_now() - start_ns) / 1e9;
+    double in_mb = bytes_in / 1e6, out_mb = htell(bgzf->fp) / 1e6;
+    fprintf(stderr, "%s: %.1f MB in, %.1f MB out (ratio %.2f), %.1f MB/s in; by level:", name.c_str(),
+	    in_mb, out_mb, out_mb ? in_mb / out_mb : 0, secs ? in_mb / secs : 0);
+    for(int i = 0; i <= 9; ++i) {
+      if(bytes_at_level[i])
+	fprintf(stderr, " %d:%.0f%%", i, 100.0 * bytes_at_level[i] / bytes_in);
+    }
+    fprintf(stderr, "\n");
+
+  }
+
+};
+
+// Adaptive outputs by htsFile; a tool has a handful of outputs at most.
+static std::vector<std::pair<htsFile*, AdaptiveLevel*> > adaptive_outputs;
+
+static AdaptiveLevel* adaptive_level_find(htsFile* hf) {
+
+  for(size_t i = 0; i < adaptive_outputs.size(); ++i) {
+    if(adaptive_outputs[i].first == hf)
+      return adaptive_outputs[i].second;
+  }
+  return 0;
+
+}
+
+// hts_open_tuned, applying SAMTOYS_COMPRESS if mode is a BAM write mode.
+static htsFile* hts_open_output(const char* fname, const char* mode) {
+
+  const OutputLevelOptions& opts = output_level_options();
+  if(opts.level < 0 || mode[0] != 'w' || !strchr(mode, 'b'))
+    return hts_open_tuned(fname, mode);
+
+  char level_mode[8];
+  snprintf(level_mode, sizeof(level_mode), "wb%d", opts.adaptive ? 0 : opts.level);
+  htsFile* hf = hts_open_tuned(fname, level_mode);
+  if(hf && opts.adaptive)
+    adaptive_outputs.push_back(std::make_pair(hf, new AdaptiveLevel(fname, hf, opts.level)));
+  return hf;
+
+}
+
+static int hts_close_output(htsFile* hf) {
+
+  for(size_t i = 0; i < adaptive_outputs.size(); ++i) {
+    if(adaptive_outputs[i].first == hf) {
+      adaptive_outputs[i].second->report();
+      delete adaptive_outputs[i].second;
+      adaptive_outputs.erase(adaptive_outputs.begin() + i);
+      break;
+    }
+  }
+
+  return hts_close(hf);
+
+}
+
+// Times a write to an adaptive output of bytes of uncompressed BAM; does nothing for others.
+
+class OutputTimer {
+
+  AdaptiveLevel* adaptive;
+  uint64_t bytes, start;
+
+public:
+
+  OutputTimer(htsFile* hf, uint64_t _bytes) :
+    adaptive(adaptive_outputs.empty() ? 0 : adaptive_level_find(hf)), bytes(_bytes), start(adaptive ? tool_stats_now() : 0) {}
+
+  ~OutputTimer() {
+    if(adaptive)
+      adaptive->add(bytes, tool_stats_now() - start);
+  }
+
+};
+
+// The size of rec as BAM: its length field, fixed fields and data, less any qname padding.
+static inline uint64_t output_record_bytes(const bam1_t* rec) {
+
+  return 4 + 32 + rec->l_data - rec->core.l_extranul;
+
+}
+
+static inline int output_sam_write1(htsFile* hf, const bam_hdr_t* header, const bam1_t* rec) {
+
+  OutputTimer timer(hf, output_record_bytes(rec));
+  return sam_write1(hf, header, rec);
+
+}
+
+// tool_stats_write1 for outputs opened with hts_open_output.
+static inline int output_write1(htsFile* hf, const bam_hdr_t* header, const bam1_t* rec) {
+
+  SampledStageTimer timer(tool_stage_write);
+  return output_sam_write1(hf, header, rec);
+
+}
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef SAMTOYS_PARALLEL_RECORDS_H
+#define SAMTOYS_PARALLEL_RECORDS_H
+
+// Batch-parallel record processing with ordered output. Records are read in batches; each batch
+// is split between a pool of worker threads while the calling thread emits the previous batch and
+// reads the next one, so reading, per-record work and writing all overlap, and emit() still sees
+// records in input order. Reading, work and emitting are timed as tool_stats' read, compute and
+// write stages.
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/kstring.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "tool_stats.h"
+
+struct BatchRecord {
+
+  bam1_t* rec;
+  // Cleared by work() to drop the record; emit() decides what that means.
+  bool keep;
+  // Scratch space for work() to leave output in, e.g. formatted text.
+  kstring_t text;
+
+};
+
+struct RecordBatch {
+
+  std::vector<BatchRecord> recs;
+  size_t n;
+
+  RecordBatch() : n(0) {}
+
+  ~RecordBatch() {
+    for(size_t i = 0, ilim = recs.size(); i != ilim; ++i) {
+      bam_destroy1(recs[i].rec);
+      free(recs[i].text.s);
+    }
+  }
+
+  // Fill with up to batch_size records; returns false on read error.
+  bool read(htsFile* hf, bam_hdr_t* header, size_t batch_size) {
+
+    while(recs.size() < batch_size) {
+      BatchRecord br;
+      br.rec = bam_init1();
+      br.keep = true;
+      br.text.l = br.text.m = 0;
+      br.text.s = 0;
+      recs.push_back(br);
+    }
+
+    StageTimer timer(tool_stage_read);
+    int ret = 0;
+    for(n = 0; n < batch_size && (ret = sam_read1(hf, header, recs[n].rec)) >= 0; ++n) {
+      recs[n].keep = true;
+      recs[n].text.l = 0;
+    }
+
+    tool_stats_add_records(n);
+    return ret >= -1;
+
+  }
+
+};
+
+// A fixed pool of threads that each take a share of one batch at a time.
+
+template<class Work>
+class BatchWorkers {
+
+  Work& work;
+  int nthreads;
+  std::vector<std::thread> threads;
+
+  std::mutex lock;
+  std::condition_variable start_cond, done_cond;
+  RecordBatch* batch;
+  unsigned long generation;
+  int remaining;
+  bool stopping;
+
+  void run(int worker) {
+
+    unsigned long seen = 0;
+
+    while(true) {
+
+      RecordBatch* mybatch;
+      {
+	std::unique_lock<std::mutex> guard(lock);
+	while(generation == seen && !stopping)
+	  start_cond.wait(guard);
+	if(stopping)
+	  return;
+	seen = generation;
+	mybatch = batch;
+      }
+
+      size_t begin = (mybatch->n * worker) / nthreads;
+      size_t end = (mybatch->n * (worker + 1)) / nthreads;
+      {
+	StageTimer timer(tool_stage_compute);
+	for(size_t i = begin; i != end; ++i)
+	  work(mybatch->recs[i], worker);
+      }
+
+      {
+	std::lock_guard<std::mutex> guard(lock);
+	if(--remaining == 0)
+	  done_cond.notify_one();
+      }
+
+    }
+
+  }
+
+public:
+
+  BatchWorkers(Work& _work, int _nthreads) : work(_work), nthreads(_nthreads), batch(0), generation(0), remaining(0), stopping(false) {
+    for(int i = 0; i < nthreads; ++i)
+      threads.push_back(std::thread(&BatchWorkers::run, this, i));
+  }
+
+  ~BatchWorkers() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    start_cond.notify_all();
+    for(int i = 0; i < nthreads; ++i)
+      threads[i].join();
+  }
+
+  void start(RecordBatch* b) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      batch = b;
+      remaining = nthreads;
+      ++generation;
+    }
+    start_cond.notify_all();
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> guard(lock);
+    while(remaining)
+      done_cond.wait(guard);
+  }
+
+};
+
+// Calls work(BatchRecord&, int worker) for every record of hf on nthreads worker threads
+// (worker is 0 .. nthreads - 1, for per-thread accumulators), then emit(BatchRecord&) for each
+// record in input order on the calling thread. With nthreads <= 1 everything happens in order on
+// the calling thread.
+
+template<class Work, class Emit>
+void process_record_batches(htsFile* hf, bam_hdr_t* header, int nthreads, Work work, Emit emit, size_t batch_size = 16384) {
+
+  RecordBatch batches[3];
+
+  if(nthreads <= 1) {
+
+    while(true) {
+      if(!batches[0].read(hf, header, batch_size)) {
+	fprintf(stderr, "Failed to read input record\n");
+	exit(1);
+      }
+      if(!batches[0].n)
+	return;
+      {
+	StageTimer timer(tool_stage_compute);
+	for(size_t i = 0; i != batches[0].n; ++i)
+	  work(batches[0].recs[i], 0);
+      }
+      StageTimer timer(tool_stage_write);
+      for(size_t i = 0; i != batches[0].n; ++i)
+	emit(batches[0].recs[i]);
+    }
+
+  }
+
+  BatchWorkers<Work> workers(work, nthreads);
+
+  // At each step: workers process batch cur, while this thread emits batch prev and reads batch next.
+  int prev = -1, cur = 0;
+  bool read_ok = batches[cur].read(hf, header, batch_size);
+
+  while(read_ok && batches[cur].n) {
+
+    workers.start(&batches[cur]);
+
+    if(prev != -1) {
+      StageTimer timer(tool_stage_write);
+      for(size_t i = 0; i != batches[prev].n; ++i)
+	emit(batches[prev].recs[i]);
+    }
+
+    int next = (cur + 1) % 3;
+    read_ok = batches[next].read(hf, header, batch_size);
+
+    workers.wait();
+    prev = cur;
+    cur = next;
+
+  }
+
+  if(prev != -1) {
+    StageTimer timer(tool_stage_write);
+    for(size_t i = 0; i != batches[prev].n; ++i)
+      emit(batches[prev].recs[i]);
+  }
+
+  if(!read_ok) {
+    fprintf(stderr, "Failed to read input record\n");
+    exit(1);
+  }
+
+}
+
+#endif
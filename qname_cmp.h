@@ -0,0 +1,104 @@
+#ifndef SAMTOYS_QNAME_CMP_H
+#define SAMTOYS_QNAME_CMP_H
+
+#include <htslib/sam.h>
+
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+
+// The two name orderings we meet: samtools sort -n (mixed string / integer) and
+// Picard / htsjdk (plain strcmp), as selected by bamcmp's -n and -N.
+
+enum qname_order {
+
+  qname_order_samtools = 0,
+  qname_order_picard = 1
+
+};
+
+// Borrowed from Samtools source, since samtools sort -n uses this ordering:
+
+static int strnum_cmp(const char *_a, const char *_b)
+{
+    const unsigned char *a = (const unsigned char*)_a, *b = (const unsigned char*)_b;
+    const unsigned char *pa = a, *pb = b;
+    while (*pa && *pb) {
+        if (isdigit(*pa) && isdigit(*pb)) {
+            while (*pa == '0') ++pa;
+            while (*pb == '0') ++pb;
+            while (isdigit(*pa) && isdigit(*pb) && *pa == *pb) ++pa, ++pb;
+            if (isdigit(*pa) && isdigit(*pb)) {
+                int i = 0;
+                while (isdigit(pa[i]) && isdigit(pb[i])) ++i;
+                return isdigit(pa[i])? 1 : isdigit(pb[i])? -1 : (int)*pa - (int)*pb;
+            } else if (isdigit(*pa)) return 1;
+            else if (isdigit(*pb)) return -1;
+            else if (pa - a != pb - b) return pa - a < pb - b? 1 : -1;
+        } else {
+            if (*pa != *pb) return (int)*pa - (int)*pb;
+            ++pa; ++pb;
+        }
+    }
+    return *pa? 1 : *pb? -1 : 0;
+}
+
+static inline int qname_cmp_order(qname_order order, const char* qa, const char* qb) {
+
+  if(order == qname_order_samtools)
+    return strnum_cmp(qa, qb);
+  else
+    return strcmp(qa, qb);
+
+}
+
+// Binary sort keys that memcmp in the same order as qname_cmp_order, followed by READ1 / READ2
+// as samtools sort -n and merge break ties, so a sort can bucket keys byte by byte. A picard key
+// is the qname and its NUL. A samtools key replaces each run of digits with '0' (which compares
+// with other characters as any digit would), the number of significant digits, the digits, and
+// 255 less the number of leading zeros, so longer numbers sort later and, among equal numbers,
+// more zero-padded ones sort first, as strnum_cmp does. key must have room for
+// qname_sort_key_bound(strlen(qname)) bytes; returns the key's length.
+
+static inline size_t qname_sort_key_bound(size_t qname_len) {
+
+  return 4 * qname_len + 2;
+
+}
+
+static size_t qname_sort_key(qname_order order, const char* _qname, uint16_t flag, uint8_t* key) {
+
+  const unsigned char* p = (const unsigned char*)_qname;
+  uint8_t* k = key;
+
+  if(order == qname_order_picard) {
+    while(*p)
+      *k++ = *p++;
+  }
+  else {
+    while(*p) {
+      if(!isdigit(*p)) {
+	*k++ = *p++;
+	continue;
+      }
+      const unsigned char* start = p;
+      while(*p == '0')
+	++p;
+      const unsigned char* digits = p;
+      while(isdigit(*p))
+	++p;
+      *k++ = '0';
+      *k++ = (uint8_t)(p - digits);
+      memcpy(k, digits, p - digits);
+      k += p - digits;
+      *k++ = (uint8_t)(255 - (digits - start));
+    }
+  }
+
+  *k++ = 0;
+  *k++ = (flag & (BAM_FREAD1 | BAM_FREAD2)) >> 6;
+  return k - key;
+
+}
+
+#endif
@@ -0,0 +1,249 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+
+#include "qname_set.h"
+
+// Hold named qname sets in memory and answer batched membership queries from subset -s (or any
+// client speaking qname_set.h's protocol) over a Unix domain socket, so repeated subset runs
+// against the same big lists don't each rebuild a hash set, and share one copy of it. Sets are
+// loaded once at startup, in parallel, and are read-only after that, so each client connection
+// gets its own thread without any locking.
+
+static void usage() {
+
+  fprintf(stderr, "Usage: qname_server [-s socket] name=qnames.txt [name=qnames.txt ...]\n");
+  fprintf(stderr, "\tLoads each file (one qname per line, as subset reads them) as the set called name\n");
+  fprintf(stderr, "\t-s\tSocket to listen on (default /tmp/samtoys_qnames.sock)\n");
+  exit(1);
+
+}
+
+struct NamedSet {
+
+  std::string name;
+  const char* fname;
+  QnameSet set;
+
+};
+
+static std::vector<NamedSet*> sets;
+static const char* socket_path = "/tmp/samtoys_qnames.sock";
+
+static void remove_socket(int) {
+
+  unlink(socket_path);
+  _exit(0);
+
+}
+
+static void refuse(int fd, const std::string& msg) {
+
+  std::vector<uint8_t> reply(1, 0);
+  qs_put_u32(reply, msg.size());
+  reply.insert(reply.end(), msg.begin(), msg.end());
+  qs_write_full(fd, &reply[0], reply.size());
+
+}
+
+static void serve_client(int fd) {
+
+  uint8_t hdr[8];
+  if(!qs_read_full(fd, hdr, 8) || memcmp(hdr, qname_set_magic, 4) || qs_get_u32(hdr + 4) > 4096) {
+    close(fd);
+    return;
+  }
+
+  std::string name(qs_get_u32(hdr + 4), 0);
+  if(!name.empty() && !qs_read_full(fd, &name[0], name.size())) {
+    close(fd);
+    return;
+  }
+
+  const QnameSet* set = 0;
+  std::string have;
+  for(size_t i = 0; i < sets.size(); ++i) {
+    if(sets[i]->name == name)
+      set = &sets[i]->set;
+    have += (i ? ", " : "") + sets[i]->name;
+  }
+
+  if(!set) {
+    refuse(fd, "no set named " + name + " (have " + have + ")");
+    close(fd);
+    return;
+  }
+
+  std::vector<uint8_t> reply(1, 1);
+  qs_put_u64(reply, set->size());
+  if(!qs_write_full(fd, &reply[0], reply.size())) {
+    close(fd);
+    return;
+  }
+
+  std::vector<char> request;
+  std::vector<uint8_t> response;
+  uint64_t queried = 0, found = 0;
+
+  while(qs_read_full(fd, hdr, 8)) {
+
+    uint32_t n = qs_get_u32(hdr);
+    uint32_t n_bytes = qs_get_u32(hdr + 4);
+    if(n_bytes > qname_set_max_request) {
+      fprintf(stderr, "Dropping client of %s: %u-byte request is too large\n", name.c_str(), n_bytes);
+      break;
+    }
+
+    request.resize(n_bytes);
+    if(n_bytes && !qs_read_full(fd, &request[0], n_bytes))
+      break;
+
+    response.assign((n + 7) / 8, 0);
+    const char* p = request.empty() ? 0 : &request[0];
+    const char* end = p + n_bytes;
+    uint32_t i = 0;
+    for(; i < n; ++i) {
+      const char* nul = p < end ? (const char*)memchr(p, 0, end - p) : 0;
+      if(!nul)
+	break;
+      if(set->contains(p, nul - p)) {
+	response[i / 8] |= 1 << (i % 8);
+	++found;
+      }
+      p = nul + 1;
+    }
+
+    if(i != n) {
+      fprintf(stderr, "Dropping client of %s: malformed request\n", name.c_str());
+      break;
+    }
+
+    queried += n;
+    if(!response.empty() && !qs_write_full(fd, &response[0], response.size()))
+      break;
+
+  }
+
+  close(fd);
+  fprintf(stderr, "Client of %s done: %llu qnames queried, %llu found\n", name.c_str(), (unsigned long long)queried, (unsigned long long)found);
+
+}
+
+int main(int argc, char** argv) {
+
+  int c;
+  while((c = getopt(argc, argv, "s:")) >= 0) {
+    switch(c) {
+    case 's':
+      socket_path = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(optind == argc)
+    usage();
+
+  for(int i = optind; i < argc; ++i) {
+
+    const char* eq = strchr(argv[i], '=');
+    if(!eq || eq == argv[i] || !eq[1]) {
+      fprintf(stderr, "Bad set %s (expected name=qnames.txt)\n", argv[i]);
+      exit(1);
+    }
+
+    NamedSet* ns = new NamedSet();
+    ns->name = std::string(argv[i], eq - argv[i]);
+    ns->fname = eq + 1;
+    for(size_t j = 0; j < sets.size(); ++j) {
+      if(sets[j]->name == ns->name) {
+	fprintf(stderr, "Set %s given twice\n", ns->name.c_str());
+	exit(1);
+      }
+    }
+    sets.push_back(ns);
+
+  }
+
+  struct sockaddr_un addr;
+  if(!qs_unix_address(socket_path, addr)) {
+    fprintf(stderr, "Socket path %s is too long\n", socket_path);
+    exit(1);
+  }
+
+  // A socket file nobody answers on is left over from a server that died; one that answers isn't.
+  int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(probe >= 0 && !connect(probe, (struct sockaddr*)&addr, sizeof(addr))) {
+    fprintf(stderr, "A qname_server is already listening on %s\n", socket_path);
+    exit(1);
+  }
+  if(probe >= 0)
+    close(probe);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> loaders;
+  std::atomic<bool> load_failed(false);
+  for(size_t i = 0; i < sets.size(); ++i) {
+    loaders.push_back(std::thread([&, i]() {
+	  if(!sets[i]->set.load(sets[i]->fname)) {
+	    fprintf(stderr, "Failed to read %s\n", sets[i]->fname);
+	    load_failed = true;
+	  }
+	}));
+  }
+  for(size_t i = 0; i < loaders.size(); ++i)
+    loaders[i].join();
+  if(load_failed)
+    exit(1);
+
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  for(size_t i = 0; i < sets.size(); ++i) {
+    fprintf(stderr, "Set %s: %llu qnames from %s (%.1f MB)\n", sets[i]->name.c_str(), (unsigned long long)sets[i]->set.size(),
+	    sets[i]->fname, sets[i]->set.bytes() / 1048576.0);
+  }
+  fprintf(stderr, "Loaded %lu sets in %.1fs\n", (unsigned long)sets.size(), secs);
+
+  int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socket_path);
+  if(lfd < 0 || bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) || listen(lfd, 64)) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", socket_path, strerror(errno));
+    exit(1);
+  }
+
+  // Clients that go away mid-response shouldn't take the server with them.
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, remove_socket);
+  signal(SIGTERM, remove_socket);
+
+  fprintf(stderr, "Serving on %s\n", socket_path);
+
+  while(true) {
+
+    int fd = accept(lfd, 0, 0);
+    if(fd < 0) {
+      if(errno == EINTR || errno == ECONNABORTED)
+	continue;
+      fprintf(stderr, "Failed to accept a connection: %s\n", strerror(errno));
+      exit(1);
+    }
+
+    std::thread(serve_client, fd).detach();
+
+  }
+
+}
@@ -0,0 +1,332 @@
+#ifndef SAMTOYS_QNAME_SET_H
+#define SAMTOYS_QNAME_SET_H
+
+// Qname sets for qname_server and its clients (subset -s). QnameSet holds a set compactly, as its
+// qnames packed into one arena plus an open-addressed table of arena offsets tagged with hash bits,
+// 12 to 23 bytes a name beyond the names themselves (the table is 35-70% full), where a
+// std::unordered_set<std::string> takes several times that.
+//
+// Protocol, over a Unix stream socket, all integers little-endian:
+//
+//   client hello     "QSET", uint32 name length, set name
+//   server hello     uint8 1 and uint64 set size, or uint8 0, uint32 length and an error message
+//   request          uint32 n_qnames, uint32 n_bytes, then n_bytes of NUL-terminated qnames
+//   response         (n_qnames + 7) / 8 bytes, bit i (LSB first) set if qname i is in the set
+//
+// Responses come in request order, so a client may send its next request before reading the
+// previous response; subset keeps one batch in flight that way while it reads the next.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <string>
+#include <vector>
+
+#include "stable_hash.h"
+
+static const char qname_set_magic[4] = { 'Q', 'S', 'E', 'T' };
+
+// Requests bigger than this are refused, so a bad client can't make the server allocate wildly.
+static const uint32_t qname_set_max_request = 64 * 1024 * 1024;
+
+static inline void qs_put_u32(std::vector<uint8_t>& out, uint32_t v) {
+  for(int i = 0; i < 4; ++i)
+    out.push_back((uint8_t)(v >> (8 * i)));
+}
+
+static inline void qs_put_u64(std::vector<uint8_t>& out, uint64_t v) {
+  for(int i = 0; i < 8; ++i)
+    out.push_back((uint8_t)(v >> (8 * i)));
+}
+
+static inline uint32_t qs_get_u32(const uint8_t* p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t qs_get_u64(const uint8_t* p) {
+  return (uint64_t)qs_get_u32(p) | (uint64_t)qs_get_u32(p + 4) << 32;
+}
+
+// Read or write exactly len bytes. read_full returns false on EOF or error.
+
+static bool qs_read_full(int fd, void* buf, size_t len) {
+
+  uint8_t* p = (uint8_t*)buf;
+  while(len) {
+    ssize_t n = read(fd, p, len);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+
+}
+
+static bool qs_write_full(int fd, const void* buf, size_t len) {
+
+  const uint8_t* p = (const uint8_t*)buf;
+  while(len) {
+    ssize_t n = write(fd, p, len);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+
+}
+
+static bool qs_unix_address(const char* path, struct sockaddr_un& addr) {
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr.sun_path))
+    return false;
+  strcpy(addr.sun_path, path);
+  return true;
+
+}
+
+class QnameSet {
+
+  std::vector<char> names;
+  // 0 for empty, else the top 24 bits of the name's hash over its offset in names plus one.
+  std::vector<uint64_t> table;
+  uint64_t n;
+
+  static const int offset_bits = 40;
+
+  static uint64_t slot_offset(uint64_t slot) {
+    return (slot & (((uint64_t)1 << offset_bits) - 1)) - 1;
+  }
+
+  static uint64_t slot_tag(uint64_t hash) {
+    return hash >> offset_bits << offset_bits;
+  }
+
+  // The slot holding name, or the empty slot where it would go.
+  size_t find(const char* name, size_t len, uint64_t hash) const {
+
+    size_t mask = table.size() - 1;
+    for(size_t i = hash & mask; ; i = (i + 1) & mask) {
+      uint64_t slot = table[i];
+      if(!slot)
+	return i;
+      if((slot ^ slot_tag(hash)) >> offset_bits)
+	continue;
+      // strncmp stops at a shorter stored name's NUL, so this can't read past the arena's end.
+      const char* other = &names[slot_offset(slot)];
+      if(!strncmp(other, name, len) && !other[len])
+	return i;
+    }
+
+  }
+
+  void grow() {
+
+    std::vector<uint64_t> old;
+    old.swap(table);
+    table.assign(old.empty() ? 1024 : old.size() * 2, 0);
+
+    for(size_t i = 0; i < old.size(); ++i) {
+      if(!old[i])
+	continue;
+      const char* name = &names[slot_offset(old[i])];
+      size_t len = strlen(name);
+      table[find(name, len, stable_hash(name, len))] = old[i];
+    }
+
+  }
+
+public:
+
+  QnameSet() : n(0) {}
+
+  uint64_t size() const {
+    return n;
+  }
+
+  uint64_t bytes() const {
+    return names.capacity() + table.capacity() * sizeof(uint64_t);
+  }
+
+  void insert(const char* name, size_t len) {
+
+    if((n + 1) * 10 > table.size() * 7)
+      grow();
+
+    uint64_t hash = stable_hash(name, len);
+    size_t i = find(name, len, hash);
+    if(table[i])
+      return;
+
+    uint64_t off = names.size();
+    if(off + len + 1 >= ((uint64_t)1 << offset_bits)) {
+      fprintf(stderr, "Qname set too large\n");
+      exit(1);
+    }
+    names.insert(names.end(), name, name + len);
+    names.push_back(0);
+    table[i] = slot_tag(hash) | (off + 1);
+    ++n;
+
+  }
+
+  bool contains(const char* name, size_t len) const {
+
+    if(table.empty())
+      return false;
+    return table[find(name, len, stable_hash(name, len))] != 0;
+
+  }
+
+  // One qname per line, ignoring surrounding whitespace and blank lines, as subset reads them.
+  // Returns false if the file can't be read.
+  bool load(const char* fname) {
+
+    FILE* f = fopen(fname, "r");
+    if(!f)
+      return false;
+
+    char* line = 0;
+    size_t cap = 0;
+    ssize_t len;
+    while((len = getline(&line, &cap, f)) >= 0) {
+      const char* start = line;
+      const char* end = line + len;
+      while(start < end && strchr(" \n\r\t", *start))
+	++start;
+      while(end > start && strchr(" \n\r\t", end[-1]))
+	--end;
+      if(end > start)
+	insert(start, end - start);
+    }
+
+    free(line);
+    names.shrink_to_fit();
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+
+  }
+
+};
+
+// A connection to qname_server for one set. Errors exit, as the tools' I/O errors do.
+
+class QnameSetClient {
+
+  int fd;
+  std::string socket_path;
+  std::vector<uint8_t> request;
+  std::vector<uint32_t> in_flight;
+
+  void lost() {
+    fprintf(stderr, "Lost connection to qname_server at %s\n", socket_path.c_str());
+    exit(1);
+  }
+
+public:
+
+  uint64_t set_size;
+
+  QnameSetClient() : fd(-1), set_size(0) {}
+
+  ~QnameSetClient() {
+    if(fd >= 0)
+      close(fd);
+  }
+
+  void connect(const char* path, const char* set_name) {
+
+    socket_path = path;
+    struct sockaddr_un addr;
+    if(!qs_unix_address(path, addr)) {
+      fprintf(stderr, "Socket path %s is too long\n", path);
+      exit(1);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || ::connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+      fprintf(stderr, "Failed to connect to qname_server at %s: %s\n", path, strerror(errno));
+      exit(1);
+    }
+
+    std::vector<uint8_t> hello(qname_set_magic, qname_set_magic + 4);
+    qs_put_u32(hello, strlen(set_name));
+    hello.insert(hello.end(), set_name, set_name + strlen(set_name));
+
+    uint8_t ok;
+    if(!qs_write_full(fd, &hello[0], hello.size()) || !qs_read_full(fd, &ok, 1))
+      lost();
+
+    uint8_t buf[8];
+    if(!ok) {
+      if(!qs_read_full(fd, buf, 4))
+	lost();
+      std::string msg(qs_get_u32(buf), 0);
+      if(!msg.empty() && !qs_read_full(fd, &msg[0], msg.size()))
+	lost();
+      fprintf(stderr, "qname_server at %s: %s\n", path, msg.c_str());
+      exit(1);
+    }
+
+    if(!qs_read_full(fd, buf, 8))
+      lost();
+    set_size = qs_get_u64(buf);
+
+  }
+
+  // Ask about qnames[0, n); answers come back from receive() in the same order.
+  void send(const char* const* qnames, uint32_t n) {
+
+    request.resize(8);
+    for(uint32_t i = 0; i < n; ++i)
+      request.insert(request.end(), qnames[i], qnames[i] + strlen(qnames[i]) + 1);
+
+    uint32_t n_bytes = request.size() - 8;
+    for(int i = 0; i < 4; ++i) {
+      request[i] = (uint8_t)(n >> (8 * i));
+      request[4 + i] = (uint8_t)(n_bytes >> (8 * i));
+    }
+
+    if(n_bytes > qname_set_max_request) {
+      fprintf(stderr, "Qname batch too large for qname_server\n");
+      exit(1);
+    }
+    if(!qs_write_full(fd, &request[0], request.size()))
+      lost();
+    in_flight.push_back(n);
+
+  }
+
+  // The answers to the oldest request not yet received, as one flag per qname.
+  void receive(std::vector<bool>& found) {
+
+    uint32_t n = in_flight.front();
+    in_flight.erase(in_flight.begin());
+
+    std::vector<uint8_t> bits((n + 7) / 8);
+    if(!bits.empty() && !qs_read_full(fd, &bits[0], bits.size()))
+      lost();
+
+    found.resize(n);
+    for(uint32_t i = 0; i < n; ++i)
+      found[i] = (bits[i / 8] >> (i % 8)) & 1;
+
+  }
+
+};
+
+#endif
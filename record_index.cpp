@@ -0,0 +1,273 @@
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/bgzf.h>
+#include <htslib/kstring.h>
+
+#include <string>
+#include <iostream>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "record_index.h"
+#include "tool_stats.h"
+#include "big_hfile.h"
+
+// Build and use record offset indexes (see record_index.h): fetch records by number, or by
+// qname when the BAM is name-sorted and the index has keys.
+
+static void usage() {
+
+  fprintf(stderr, "Usage: record_index build [-@ threads] [-k key_stride] [-g group_size] [-N] in.bam\n");
+  fprintf(stderr, "       record_index get in.bam first_record [count]\n");
+  fprintf(stderr, "       record_index find in.bam qname\n");
+  fprintf(stderr, "\tbuild writes in.bam.ri; get and find print SAM records to stdout\n");
+  fprintf(stderr, "\t-k\tAlso store every Nth qname (needs name-sorted input), enabling find\n");
+  fprintf(stderr, "\t-g\tRecords per absolute offset checkpoint (default 64)\n");
+  fprintf(stderr, "\t-N\tInput is sorted as per Picard / htsjdk (strcmp) rather than samtools sort -n\n");
+  exit(1);
+
+}
+
+// get and find read a record or two after a seek, for which big buffers and readahead are waste.
+
+static htsFile* open_bam_or_die(const char* fname, bam_hdr_t** header, bool sequential) {
+
+  htsFile* hf = sequential ? hts_open_tuned(fname, "r") : hts_open(fname, "r");
+  if(!hf) {
+    fprintf(stderr, "Failed to open %s\n", fname);
+    exit(1);
+  }
+
+  if(hf->format.format != bam) {
+    fprintf(stderr, "%s is not a BAM file\n", fname);
+    exit(1);
+  }
+
+  *header = sam_hdr_read(hf);
+  if(!*header) {
+    fprintf(stderr, "Failed to read header from %s\n", fname);
+    exit(1);
+  }
+
+  return hf;
+
+}
+
+static void load_index_or_die(const char* bam_name, RecordIndex& index) {
+
+  std::string ri_name = record_index_filename(bam_name);
+  const char* err = index.load(ri_name.c_str());
+  if(err) {
+    fprintf(stderr, "Failed to load %s: %s\n", ri_name.c_str(), err);
+    exit(1);
+  }
+
+}
+
+static void print_record(bam_hdr_t* header, bam1_t* rec, kstring_t* line) {
+
+  line->l = 0;
+  if(sam_format1(header, rec, line) < 0) {
+    fprintf(stderr, "Failed to format record %s\n", bam_get_qname(rec));
+    exit(1);
+  }
+  fwrite(line->s, 1, line->l, stdout);
+  putchar('\n');
+
+}
+
+static int build(int argc, char** argv) {
+
+  int nthreads = 1;
+  uint32_t key_stride = 0;
+  uint32_t group_size = 64;
+  qname_order order = qname_order_samtools;
+
+  int c;
+  while((c = getopt(argc, argv, "@:k:g:N")) >= 0) {
+    switch(c) {
+    case '@':
+      nthreads = atoi(optarg);
+      break;
+    case 'k':
+      key_stride = atoi(optarg);
+      break;
+    case 'g':
+      group_size = atoi(optarg);
+      break;
+    case 'N':
+      order = qname_order_picard;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(optind + 1 != argc || group_size == 0)
+    usage();
+
+  tool_stats_init("record_index build");
+
+  const char* fname = argv[optind];
+  bam_hdr_t* header;
+  htsFile* hf = open_bam_or_die(fname, &header, true);
+  if(nthreads > 1)
+    hts_set_threads(hf, nthreads);
+
+  RecordIndexWriter writer(group_size, key_stride, order);
+  bam1_t* rec = bam_init1();
+  bam1_t* prev = bam_init1();
+  uint64_t nrecs = 0;
+  int ret;
+
+  uint64_t voffset = bgzf_tell(hf->fp.bgzf);
+  while((ret = tool_stats_read1(hf, header, rec)) >= 0) {
+
+    if(key_stride && nrecs && qname_cmp_order(order, bam_get_qname(prev), bam_get_qname(rec)) > 0) {
+      fprintf(stderr, "Order went backwards from %s to %s; qname keys need name-sorted input (use -N for strcmp order, or drop -k)\n",
+	      bam_get_qname(prev), bam_get_qname(rec));
+      exit(1);
+    }
+
+    writer.add(voffset, bam_get_qname(rec));
+    voffset = bgzf_tell(hf->fp.bgzf);
+    ++nrecs;
+
+    if(key_stride) {
+      bam1_t* tmp = prev;
+      prev = rec;
+      rec = tmp;
+    }
+
+  }
+
+  if(ret < -1) {
+    fprintf(stderr, "Failed to read %s\n", fname);
+    exit(1);
+  }
+
+  std::string ri_name = record_index_filename(fname);
+  {
+    StageTimer timer(tool_stage_write);
+    if(!writer.save(ri_name.c_str())) {
+      fprintf(stderr, "Failed to write %s\n", ri_name.c_str());
+      exit(1);
+    }
+  }
+
+  fprintf(stderr, "Indexed %lu records\n", (unsigned long)nrecs);
+
+  bam_destroy1(rec);
+  bam_destroy1(prev);
+  bam_hdr_destroy(header);
+  hts_close(hf);
+  tool_stats_finish();
+  return 0;
+
+}
+
+static int get(int argc, char** argv) {
+
+  if(argc < 3 || argc > 4)
+    usage();
+
+  RecordIndex index;
+  load_index_or_die(argv[1], index);
+
+  uint64_t first = strtoull(argv[2], 0, 10);
+  uint64_t count = argc == 4 ? strtoull(argv[3], 0, 10) : 1;
+  if(first >= index.size()) {
+    fprintf(stderr, "Record %lu is out of range (the file has %lu records)\n", (unsigned long)first, (unsigned long)index.size());
+    exit(1);
+  }
+
+  bam_hdr_t* header;
+  htsFile* hf = open_bam_or_die(argv[1], &header, false);
+  bam1_t* rec = bam_init1();
+  kstring_t line = { 0, 0, 0 };
+
+  if(bgzf_seek(hf->fp.bgzf, index.offset(first), SEEK_SET) < 0) {
+    fprintf(stderr, "Failed to seek in %s\n", argv[1]);
+    exit(1);
+  }
+
+  for(uint64_t i = 0; i < count && sam_read1(hf, header, rec) >= 0; ++i)
+    print_record(header, rec, &line);
+
+  free(line.s);
+  bam_destroy1(rec);
+  bam_hdr_destroy(header);
+  hts_close(hf);
+  return 0;
+
+}
+
+static int find(int argc, char** argv) {
+
+  if(argc != 3)
+    usage();
+
+  RecordIndex index;
+  load_index_or_die(argv[1], index);
+  if(!index.has_keys()) {
+    fprintf(stderr, "%s.ri has no qname keys; rebuild it with -k\n", argv[1]);
+    exit(1);
+  }
+
+  const char* qname = argv[2];
+  bam_hdr_t* header;
+  htsFile* hf = open_bam_or_die(argv[1], &header, false);
+  bam1_t* rec = bam_init1();
+  kstring_t line = { 0, 0, 0 };
+  int found = 0;
+
+  if(index.size()) {
+
+    if(bgzf_seek(hf->fp.bgzf, index.offset(index.scan_start(qname)), SEEK_SET) < 0) {
+      fprintf(stderr, "Failed to seek in %s\n", argv[1]);
+      exit(1);
+    }
+
+    while(sam_read1(hf, header, rec) >= 0) {
+
+      int cmp = qname_cmp_order(index.key_order(), bam_get_qname(rec), qname);
+      if(cmp > 0)
+	break;
+      if(cmp == 0 && !strcmp(bam_get_qname(rec), qname)) {
+	print_record(header, rec, &line);
+	++found;
+      }
+
+    }
+
+  }
+
+  free(line.s);
+  bam_destroy1(rec);
+  bam_hdr_destroy(header);
+  hts_close(hf);
+  return found ? 0 : 1;
+
+}
+
+int main(int argc, char** argv) {
+
+  if(argc < 2)
+    usage();
+
+  std::string cmd = argv[1];
+  if(cmd == "build")
+    return build(argc - 1, argv + 1);
+  else if(cmd == "get")
+    return get(argc - 1, argv + 1);
+  else if(cmd == "find")
+    return find(argc - 1, argv + 1);
+
+  usage();
+  return 1;
+
+}
@@ -0,0 +1,312 @@
+#ifndef SAMTOYS_RECORD_INDEX_H
+#define SAMTOYS_RECORD_INDEX_H
+
+// Record offset index ("<bam>.ri"): the BGZF virtual offset of every record in a BAM, so that
+// record i can be found without scanning, plus optionally every Nth qname of a name-sorted BAM
+// so that a qname can be found by binary search.
+//
+// Layout (all integers little-endian):
+//
+//   char[4]   magic "SRI\1"
+//   uint8     qname order of the keys (qname_order; meaningless without keys)
+//   uint8[3]  reserved, zero
+//   uint32    group_size: records per checkpoint
+//   uint32    key_stride: records per qname key, or 0 for no keys
+//   uint64    n_records, n_groups, deltas_len, n_keys, keys_len
+//   n_groups  x { uint64 voffset of the group's first record, uint64 offset into deltas }
+//   deltas    for each group, LEB128 varints giving the increase in virtual offset from one
+//             record to the next for the group's remaining records
+//   n_keys    x uint64 offset into keys, for the qname of record k * key_stride
+//   keys      NUL-terminated qnames
+//
+// Virtual offsets only ever increase through a file, so the deltas are unsigned and usually
+// one or two bytes. Looking up record i decodes at most group_size - 1 of them.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "qname_cmp.h"
+
+static const char record_index_magic[4] = { 'S', 'R', 'I', 1 };
+
+static inline void ri_put_u32(std::vector<uint8_t>& out, uint32_t v) {
+  for(int i = 0; i < 4; ++i)
+    out.push_back((uint8_t)(v >> (8 * i)));
+}
+
+static inline void ri_put_u64(std::vector<uint8_t>& out, uint64_t v) {
+  for(int i = 0; i < 8; ++i)
+    out.push_back((uint8_t)(v >> (8 * i)));
+}
+
+static inline uint32_t ri_get_u32(const uint8_t* p) {
+  uint32_t v = 0;
+  for(int i = 3; i >= 0; --i)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static inline uint64_t ri_get_u64(const uint8_t* p) {
+  uint64_t v = 0;
+  for(int i = 7; i >= 0; --i)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static inline std::string record_index_filename(const char* bam_name) {
+  return std::string(bam_name) + ".ri";
+}
+
+class RecordIndexWriter {
+
+  uint32_t group_size;
+  uint32_t key_stride;
+  qname_order order;
+
+  uint64_t n_records;
+  uint64_t last_voffset;
+  std::vector<uint64_t> groups;
+  std::vector<uint8_t> deltas;
+  std::vector<uint64_t> key_offsets;
+  std::vector<char> keys;
+
+public:
+
+  RecordIndexWriter(uint32_t _group_size, uint32_t _key_stride, qname_order _order) :
+    group_size(_group_size), key_stride(_key_stride), order(_order), n_records(0), last_voffset(0) {}
+
+  // Add the next record, given its starting virtual offset.
+  void add(uint64_t voffset, const char* qname) {
+
+    if(n_records % group_size == 0) {
+      groups.push_back(voffset);
+      groups.push_back(deltas.size());
+    }
+    else {
+      uint64_t delta = voffset - last_voffset;
+      while(delta >= 0x80) {
+	deltas.push_back((uint8_t)(delta | 0x80));
+	delta >>= 7;
+      }
+      deltas.push_back((uint8_t)delta);
+    }
+
+    if(key_stride && n_records % key_stride == 0) {
+      key_offsets.push_back(keys.size());
+      keys.insert(keys.end(), qname, qname + strlen(qname) + 1);
+    }
+
+    last_voffset = voffset;
+    ++n_records;
+
+  }
+
+  bool save(const char* fname) {
+
+    std::vector<uint8_t> head;
+    head.insert(head.end(), record_index_magic, record_index_magic + 4);
+    head.push_back((uint8_t)order);
+    head.push_back(0);
+    head.push_back(0);
+    head.push_back(0);
+    ri_put_u32(head, group_size);
+    ri_put_u32(head, key_stride);
+    ri_put_u64(head, n_records);
+    ri_put_u64(head, groups.size() / 2);
+    ri_put_u64(head, deltas.size());
+    ri_put_u64(head, key_offsets.size());
+    ri_put_u64(head, keys.size());
+    for(size_t i = 0, ilim = groups.size(); i != ilim; ++i)
+      ri_put_u64(head, groups[i]);
+
+    std::vector<uint8_t> keyhead;
+    for(size_t i = 0, ilim = key_offsets.size(); i != ilim; ++i)
+      ri_put_u64(keyhead, key_offsets[i]);
+
+    FILE* f = fopen(fname, "wb");
+    if(!f)
+      return false;
+
+    bool ok = fwrite(&head[0], 1, head.size(), f) == head.size();
+    ok = ok && (deltas.empty() || fwrite(&deltas[0], 1, deltas.size(), f) == deltas.size());
+    ok = ok && (keyhead.empty() || fwrite(&keyhead[0], 1, keyhead.size(), f) == keyhead.size());
+    ok = ok && (keys.empty() || fwrite(&keys[0], 1, keys.size(), f) == keys.size());
+    return fclose(f) == 0 && ok;
+
+  }
+
+};
+
+class RecordIndex {
+
+  std::vector<uint8_t> data;
+  uint32_t group_size;
+  uint32_t key_stride;
+  qname_order order;
+  uint64_t n_records;
+  uint64_t n_groups;
+  uint64_t n_keys;
+  const uint8_t* groups;
+  const uint8_t* deltas;
+  uint64_t deltas_len;
+  const uint8_t* key_offsets;
+  const char* keys;
+  uint64_t keys_len;
+
+  // The pointers above point into data, so a copy would point into the original's.
+  RecordIndex(const RecordIndex&) = delete;
+  RecordIndex& operator=(const RecordIndex&) = delete;
+
+  // Check that every group's deltas and every key lie within their sections, so that offset()
+  // and scan_start() never read beyond data, however stale or damaged the file.
+  bool sections_valid() const {
+
+    for(uint64_t g = 0; g < n_groups; ++g) {
+
+      uint64_t start = ri_get_u64(groups + (g * 16) + 8);
+      uint64_t end = g + 1 < n_groups ? ri_get_u64(groups + ((g + 1) * 16) + 8) : deltas_len;
+      if(start > end || end > deltas_len)
+	return false;
+
+      // A group of n records needs exactly n - 1 complete varints.
+      uint64_t n = std::min((uint64_t)group_size, n_records - g * group_size);
+      uint64_t ends = 0;
+      for(uint64_t i = start; i < end; ++i)
+	ends += !(deltas[i] & 0x80);
+      if(ends != n - 1)
+	return false;
+
+    }
+
+    for(uint64_t k = 0; k < n_keys; ++k) {
+      if(ri_get_u64(key_offsets + (k * 8)) >= keys_len)
+	return false;
+    }
+
+    return true;
+
+  }
+
+public:
+
+  RecordIndex() : group_size(0), key_stride(0), order(qname_order_samtools), n_records(0), n_groups(0), n_keys(0) {}
+
+  // Returns an error message, or 0 on success.
+  const char* load(const char* fname) {
+
+    FILE* f = fopen(fname, "rb");
+    if(!f)
+      return "can't open index file";
+
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if(len < 56) {
+      fclose(f);
+      return "index file truncated";
+    }
+
+    data.resize(len);
+    bool ok = fread(&data[0], 1, len, f) == (size_t)len;
+    fclose(f);
+    if(!ok)
+      return "failed to read index file";
+
+    const uint8_t* p = &data[0];
+    if(memcmp(p, record_index_magic, 4))
+      return "not a record index";
+
+    if(p[4] > qname_order_picard)
+      return "index file is corrupt";
+    order = (qname_order)p[4];
+    group_size = ri_get_u32(p + 8);
+    key_stride = ri_get_u32(p + 12);
+    n_records = ri_get_u64(p + 16);
+    n_groups = ri_get_u64(p + 24);
+    deltas_len = ri_get_u64(p + 32);
+    n_keys = ri_get_u64(p + 40);
+    keys_len = ri_get_u64(p + 48);
+
+    // Bound each count by the file length first, so the sum below can't overflow.
+    uint64_t ulen = len;
+    if(n_groups > ulen / 16 || deltas_len > ulen || n_keys > ulen / 8 || keys_len > ulen || group_size == 0)
+      return "index file is corrupt";
+
+    uint64_t expected = 56 + (n_groups * 16) + deltas_len + (n_keys * 8) + keys_len;
+    if(expected != ulen || (keys_len && data[len - 1] != 0))
+      return "index file is corrupt";
+
+    if(n_groups != (n_records + group_size - 1) / group_size)
+      return "index file is corrupt";
+    if(key_stride ? n_keys != (n_records + key_stride - 1) / key_stride : n_keys != 0)
+      return "index file is corrupt";
+
+    groups = p + 56;
+    deltas = groups + (n_groups * 16);
+    key_offsets = deltas + deltas_len;
+    keys = (const char*)(key_offsets + (n_keys * 8));
+    if(!sections_valid())
+      return "index file is corrupt";
+    return 0;
+
+  }
+
+  uint64_t size() const {
+    return n_records;
+  }
+
+  bool has_keys() const {
+    return n_keys != 0;
+  }
+
+  qname_order key_order() const {
+    return order;
+  }
+
+  // Virtual offset of record i, which must be < size().
+  uint64_t offset(uint64_t i) const {
+
+    uint64_t group = i / group_size;
+    uint64_t voffset = ri_get_u64(groups + (group * 16));
+    const uint8_t* p = deltas + ri_get_u64(groups + (group * 16) + 8);
+
+    for(uint64_t skip = i % group_size; skip; --skip) {
+      uint64_t delta = 0;
+      int shift = 0;
+      do {
+	delta |= ((uint64_t)(*p & 0x7f)) << shift;
+	shift += 7;
+      } while(*(p++) & 0x80);
+      voffset += delta;
+    }
+
+    return voffset;
+
+  }
+
+  // Index of a record from which a forward scan is guaranteed to meet the first record named
+  // qname, if there is one: the last key strictly before qname. Requires has_keys().
+  uint64_t scan_start(const char* qname) const {
+
+    uint64_t lo = 0, hi = n_keys;
+    while(lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      const char* key = keys + ri_get_u64(key_offsets + (mid * 8));
+      if(qname_cmp_order(order, key, qname) < 0)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+    return lo == 0 ? 0 : (lo - 1) * key_stride;
+
+  }
+
+};
+
+#endif
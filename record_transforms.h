@@ -0,0 +1,346 @@
+#ifndef SAMTOYS_RECORD_TRANSFORMS_H
+#define SAMTOYS_RECORD_TRANSFORMS_H
+
+// Per-record transforms shared by the single-purpose tools (remove_qname_suffix, reorder_chroms,
+// filter_match_ratio, filter_attr) and bam_pipeline, which chains them in one process.
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "cigar_stats.h"
+
+class RecordStage {
+
+public:
+
+  virtual ~RecordStage() {}
+
+  // Called once before any records, with the header records arrive with. Returns the header they
+  // leave with: either the same one or a new one owned by the stage.
+  virtual bam_hdr_t* init(bam_hdr_t* header) {
+    return header;
+  }
+
+  // Transform rec in place; returns false if it should be dropped. Stages keep no per-record
+  // state, so bam_pipeline calls this on several records at once, from its worker threads.
+  virtual bool apply(bam1_t* rec) = 0;
+
+};
+
+// remove_qname_suffix: drop a trailing /1, /2 etc from qnames.
+
+class StripQnameSuffixStage : public RecordStage {
+
+public:
+
+  bool apply(bam1_t* rec) {
+
+    // Note l_qname includes the trailing null
+    if(rec->core.l_qname > 3) {
+
+      char* qn = bam_get_qname(rec);
+      char* qnsuffix = qn + (rec->core.l_qname - 3);
+      if(qnsuffix[0] == '/' && isdigit(qnsuffix[1])) {
+
+	// Remove trailing chars.
+	// Move to (2-before-qname-terminator), from (qname-terminator), length (everything except the qname, plus its null terminator)
+	memmove(qn + (rec->core.l_qname - 3), qn + (rec->core.l_qname - 1), rec->l_data - (rec->core.l_qname - 1));
+	rec->core.l_qname -= 2;
+	rec->l_data -= 2;
+
+      }
+
+    }
+
+    return true;
+
+  }
+
+};
+
+// reorder_chroms: renumber contigs into a given order, leaving any contigs not mentioned in
+// their existing places after it.
+
+static std::vector<std::string> default_contig_order() {
+
+  std::vector<std::string> newOrder;
+  for(int i = 1; i < 23; ++i) {
+
+    char chrbuf[32];
+    sprintf(chrbuf, "%d", i);
+    newOrder.push_back(std::string(chrbuf));
+
+  }
+
+  newOrder.push_back("X");
+  newOrder.push_back("Y");
+  newOrder.push_back("MT");
+  return newOrder;
+
+}
+
+// Fills oldToNew (indexed by old tid + 1, so that -1 maps to -1) and returns the reordered header.
+
+static bam_hdr_t* reorder_header(const bam_hdr_t* header, const std::vector<std::string>& newOrder, std::vector<int32_t>& oldToNew) {
+
+  oldToNew.assign(header->n_targets + 1, -1);
+
+  for(int32_t i = 0; i < header->n_targets; ++i) {
+
+    std::vector<std::string>::const_iterator findit = std::find(newOrder.begin(), newOrder.end(), header->target_name[i]);
+    if(findit == newOrder.end()) {
+      if(i < (int32_t)newOrder.size()) {
+	fprintf(stderr, "%s clashes with new order\n", header->target_name[i]);
+	exit(1);
+      }
+      oldToNew[i + 1] = i;
+    }
+    else {
+      oldToNew[i + 1] = std::distance(newOrder.begin(), findit);
+    }
+
+  }
+
+  // Rearrange the header:
+  bam_hdr_t* newheader = bam_hdr_dup(header);
+
+  for(int32_t i = 0; i < header->n_targets; ++i) {
+
+    int32_t newIdx = oldToNew[i + 1];
+    free(newheader->target_name[newIdx]);
+    newheader->target_name[newIdx] = strdup(header->target_name[i]);
+    newheader->target_len[newIdx] = header->target_len[i];
+
+  }
+
+  // Void cache if any (leaks a khash table; never mind)
+  if(newheader->sdict)
+    newheader->sdict = 0;
+
+  // Remove any @SQ lines from the header text so that our rewrite will take effect:
+  std::string htext = newheader->text;
+  size_t sqstart;
+  while((sqstart = htext.find("@SQ")) != std::string::npos) {
+    size_t nextnl = htext.find("\n", sqstart);
+    if(nextnl == std::string::npos) {
+      fprintf(stderr, "Malformed header SQ line\n");
+      exit(1);
+    }
+    htext.erase(sqstart, (nextnl - sqstart) + 1);
+  }
+
+  // Replace @SQ lines, for legacy readers:
+  if(htext.size() > 0 && htext[htext.size()-1] != '\n')
+    htext += "\n";
+
+  for(int32_t i = 0; i < newheader->n_targets; ++i) {
+    char buf[128];
+    if(snprintf(buf, 128, "@SQ\tSN:%s\tLN:%u\n", newheader->target_name[i], newheader->target_len[i]) > 128) {
+      fprintf(stderr, "Sequence name too long!\n");
+      exit(1);
+    }
+    htext += std::string(buf);
+  }
+
+  free(newheader->text);
+  newheader->text = strdup(htext.c_str());
+  newheader->l_text = htext.length();
+
+  return newheader;
+
+}
+
+class ReorderContigsStage : public RecordStage {
+
+  std::vector<std::string> newOrder;
+  std::vector<int32_t> oldToNew;
+  int32_t n_targets;
+
+public:
+
+  ReorderContigsStage(const std::vector<std::string>& _newOrder) : newOrder(_newOrder), n_targets(0) {}
+
+  bam_hdr_t* init(bam_hdr_t* header) {
+    n_targets = header->n_targets;
+    return reorder_header(header, newOrder, oldToNew);
+  }
+
+  bool apply(bam1_t* rec) {
+
+    if(rec->core.tid < -1 || rec->core.tid >= n_targets) {
+      fprintf(stderr, "Unknown contig ID %d!\n", rec->core.tid);
+      exit(1);
+    }
+    if(rec->core.mtid < -1 || rec->core.mtid >= n_targets) {
+      fprintf(stderr, "Unknown contig ID %d!\n", rec->core.mtid);
+      exit(1);
+    }
+
+    rec->core.tid = oldToNew[rec->core.tid + 1];
+    rec->core.mtid = oldToNew[rec->core.mtid + 1];
+    return true;
+
+  }
+
+};
+
+// filter_match_ratio: mark records unmapped (noting why in an rf tag) if too little of the read
+// is matched according to the CIGAR string.
+
+class MatchRatioStage : public RecordStage {
+
+  double required_prop;
+
+public:
+
+  MatchRatioStage(double _required_prop) : required_prop(_required_prop) {}
+
+  bool apply(bam1_t* rec) {
+
+    CigarStats cigar;
+    cigar_stats(rec, &cigar);
+
+    int64_t total_bases = rec->core.l_qseq + cigar.hard_clipped();
+    int64_t matched_bases = cigar.matched();
+
+    double match_prop = ((double)matched_bases) / total_bases;
+    if(match_prop < required_prop) {
+
+      char filter_message_buf[1024];
+
+      // Force unmapped:
+      rec->core.flag |= BAM_FUNMAP;
+      // Note how it got that way:
+      sprintf(filter_message_buf, "Filtered by filter_match_ratio (threshold match %g; actual %g)", required_prop, match_prop);
+      bam_aux_append(rec, "rf", 'Z', strlen(filter_message_buf) + 1, (uint8_t*)filter_message_buf);
+
+    }
+
+    return true;
+
+  }
+
+};
+
+// filter_attr: keep records satisfying a simple relation between integer tags and / or constants.
+
+enum oper {
+
+  oper_eq,
+  oper_gt,
+  oper_ge,
+  oper_lt,
+  oper_le,
+  oper_ne
+
+};
+
+static void parse_const_or_attr(char* arg, int* constout, char** attrout) {
+
+  if(isdigit(arg[0])) {
+    *constout = atoi(arg);
+    *attrout = 0;
+  }
+  else {
+    *constout = 0;
+    *attrout = arg;
+  }
+
+}
+
+static oper parse_operator(const char* arg) {
+
+  if(!strcmp(arg, "=="))
+    return oper_eq;
+  else if(!strcmp(arg, "<"))
+    return oper_lt;
+  else if(!strcmp(arg, ">"))
+    return oper_gt;
+  else if(!strcmp(arg, "<="))
+    return oper_le;
+  else if(!strcmp(arg, ">="))
+    return oper_ge;
+  else if(!strcmp(arg, "!="))
+    return oper_ne;
+
+  fprintf(stderr, "Invalid operator %s\n", arg);
+  exit(1);
+
+}
+
+static int get_const_or_attr(int constin, const char* attrin, bam1_t* rec) {
+
+  if(attrin) {
+    uint8_t* attr_rec = bam_aux_get(rec, attrin);
+    if(!attr_rec) {
+      fprintf(stderr, "Fatal: At least record %s doesn't have a %s tag as required.\n", bam_get_qname(rec), attrin);
+      exit(1);
+    }
+    return bam_aux2i(attr_rec);
+  }
+
+  return constin;
+
+}
+
+static bool eval_test(int op1, oper op, int op2) {
+
+  switch(op) {
+  case oper_eq:
+    return op1 == op2;
+  case oper_lt:
+    return op1 < op2;
+  case oper_gt:
+    return op1 > op2;
+  case oper_le:
+    return op1 <= op2;
+  case oper_ge:
+    return op1 >= op2;
+  case oper_ne:
+    return op1 != op2;
+  }
+
+  return false;
+
+}
+
+class AttrFilterStage : public RecordStage {
+
+  std::string a, b;
+  int consta, constb;
+  char *attra, *attrb;
+  oper op;
+
+public:
+
+  AttrFilterStage(const AttrFilterStage&) = delete;
+
+  // As filter_attr's three arguments, e.g. "AS" ">" "BS".
+  AttrFilterStage(const char* _a, const char* _op, const char* _b) : a(_a), b(_b) {
+
+    parse_const_or_attr(&a[0], &consta, &attra);
+    parse_const_or_attr(&b[0], &constb, &attrb);
+    op = parse_operator(_op);
+
+  }
+
+  bool apply(bam1_t* rec) {
+
+    int op1 = get_const_or_attr(consta, attra, rec);
+    int op2 = get_const_or_attr(constb, attrb, rec);
+    return eval_test(op1, op, op2);
+
+  }
+
+};
+
+#endif
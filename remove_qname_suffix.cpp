@@ -1,58 +1,103 @@
 
 #include <htslib/hts.h>
 #include <htslib/sam.h>
+#include <htslib/thread_pool.h>
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-#include <map>
-#include <string>
-#include <iostream>
-#include <algorithm>
+#include "record_transforms.h"
+#include "parallel_records.h"
+#include "tool_stats.h"
+#include "big_hfile.h"
+#include "output_level.h"
+
+static void usage() {
+
+  fprintf(stderr, "Usage: remove_qname_suffix [-@ threads] in.bam\n");
+  fprintf(stderr, "\t-@\tWorker threads for the rewrite, and for BGZF decoding / encoding\n");
+  exit(1);
+
+}
 
 int main(int argc, char** argv) {
 
-  htsFile* hf = hts_open(argv[1], "r");
+  int nthreads = 1;
+
+  int c;
+  while((c = getopt(argc, argv, "@:")) >= 0) {
+    switch(c) {
+    case '@':
+      nthreads = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(optind + 1 != argc)
+    usage();
+
+  tool_stats_init("remove_qname_suffix");
+
+  const char* in_name = argv[optind];
+
+  htsFile* hf = hts_open_tuned(in_name, "r");
   if(!hf) {
-    fprintf(stderr, "Failed to open %s\n", argv[1]);
+    fprintf(stderr, "Failed to open %s\n", in_name);
     exit(1);
   }
 
-  bam_hdr_t* header = sam_hdr_read(hf);
-
-  htsFile* hfo = hts_open("-", "wb");
+  htsFile* hfo = hts_open_output("-", "wb");
   if(!hfo) {
     fprintf(stderr, "Failed to open stdout\n");
     exit(1);
   }
-  
-  sam_hdr_write(hfo, header);
 
-  bam1_t *rec = bam_init1();
-
-  while(sam_read1(hf, header, rec) >= 0) {
-
-    // Note l_qname includes the trailing null
-    if(rec->core.l_qname > 3) {
+  htsThreadPool pool = { 0, 0 };
+  if(nthreads > 1) {
+    pool.pool = hts_tpool_init(nthreads);
+    if(!pool.pool) {
+      fprintf(stderr, "Failed to start thread pool\n");
+      exit(1);
+    }
+    hts_set_thread_pool(hf, &pool);
+    hts_set_thread_pool(hfo, &pool);
+  }
 
-      char* qn = bam_get_qname(rec);
-      char* qnsuffix = qn + (rec->core.l_qname - 3);
-      if(qnsuffix[0] == '/' && isdigit(qnsuffix[1])) {
-	
-	// Remove trailing chars.
-	// Move to (2-before-qname-terminator), from (qname-terminator), length (everything except the qname, plus its null terminator)
-	memmove(qn + (rec->core.l_qname - 3), qn + (rec->core.l_qname - 1), rec->l_data - (rec->core.l_qname - 1));
-	rec->core.l_qname -= 2;
-	rec->l_data -= 2;
+  bam_hdr_t* header = sam_hdr_read(hf);
+  if(!header) {
+    fprintf(stderr, "Failed to read header from %s\n", in_name);
+    exit(1);
+  }
 
-      }
+  sam_hdr_write(hfo, header);
 
-    }
+  StripQnameSuffixStage strip;
 
-    sam_write1(hfo, header, rec);
+  process_record_batches(hf, header, nthreads,
+			 [&](BatchRecord& br, int worker) {
+			   strip.apply(br.rec);
+			 },
+			 [&](BatchRecord& br) {
+			   if(output_sam_write1(hfo, header, br.rec) < 0) {
+			     fprintf(stderr, "Failed to write BAM record\n");
+			     exit(1);
+			   }
+			 });
 
+  hts_close(hf);
+  if(hts_close_output(hfo)) {
+    fprintf(stderr, "Failed to close stdout\n");
+    exit(1);
   }
 
-  hts_close(hf);
-  hts_close(hfo);
+  if(pool.pool)
+    hts_tpool_destroy(pool.pool);
+
+  tool_stats_finish();
+  return 0;
 
 }
@@ -1,16 +1,43 @@
 
 #include <htslib/hts.h>
 #include <htslib/sam.h>
+#include <htslib/bgzf.h>
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <map>
 #include <string>
+#include <fstream>
+#include <sstream>
 #include <iostream>
 
-int main(int argc, char** argv) {
+#include "bgzf_splice.h"
+#include "tool_stats.h"
+#include "big_hfile.h"
+
+// Rename contigs, by default from chr1 .. chr22, chrX, chrY, chrM style to 1 .. 22, X, Y, MT.
+// Without -s only the renamed header is written (for use with reorder_chroms or samtools reheader);
+// with -s the input's body is copied after it block-for-block, without decompressing, so renaming
+// a large BAM costs little more than copying it.
+
+typedef std::map<std::string, std::string> chrom_map;
+
+static void usage() {
+
+  fprintf(stderr, "Usage: rename_chroms [-m map.tsv] [-s] [-o out] in.bam\n");
+  fprintf(stderr, "\t-m\tTab- or space-separated old and new names, one pair per line; # starts a comment\n");
+  fprintf(stderr, "\t-s\tWrite the whole BAM, splicing the input's compressed records after the new header\n");
+  fprintf(stderr, "\t-o\tOutput file (default stdout)\n");
+  exit(1);
 
-  std::map<std::string, std::string> new_chroms;
+}
+
+static chrom_map default_chrom_map() {
+
+  chrom_map new_chroms;
   for(int i = 1; i < 23; ++i) {
 
     char chrbuf[32];
@@ -18,61 +45,188 @@ int main(int argc, char** argv) {
     new_chroms[std::string(chrbuf)] = std::string(chrbuf+3);
 
   }
-    
+
   new_chroms["chrX"] = "X";
   new_chroms["chrY"] = "Y";
   new_chroms["chrM_rCRS"] = "MT";
   new_chroms["chrM"] = "MT";
+  return new_chroms;
 
-  htsFile* hf = hts_open(argv[1], "r");
+}
+
+static chrom_map load_chrom_map(const char* fname) {
+
+  std::ifstream in(fname);
+  if(!in) {
+    fprintf(stderr, "Failed to open %s\n", fname);
+    exit(1);
+  }
+
+  chrom_map new_chroms;
+  std::string line;
+  int lineno = 0;
+  while(std::getline(in, line)) {
+
+    ++lineno;
+    size_t comment = line.find('#');
+    if(comment != std::string::npos)
+      line.erase(comment);
+
+    std::istringstream fields(line);
+    std::string oldname, newname, extra;
+    if(!(fields >> oldname))
+      continue;
+    if(!(fields >> newname) || (fields >> extra)) {
+      fprintf(stderr, "%s:%d: expected two columns, old and new name\n", fname, lineno);
+      exit(1);
+    }
+
+    new_chroms[oldname] = newname;
+
+  }
+
+  return new_chroms;
+
+}
+
+// Replace SN: values on @SQ lines in place, keeping their other fields and the lines' order.
+
+static std::string rename_sq_lines(const std::string& htext, const chrom_map& new_chroms) {
+
+  std::string out;
+  size_t linestart = 0;
+  while(linestart < htext.size()) {
+
+    size_t lineend = htext.find('\n', linestart);
+    if(lineend == std::string::npos)
+      lineend = htext.size();
+    std::string line = htext.substr(linestart, lineend - linestart);
+
+    if(!line.compare(0, 4, "@SQ\t")) {
+
+      size_t sn = line.find("\tSN:");
+      if(sn == std::string::npos) {
+	std::cerr << "Malformed header SQ line\n";
+	exit(1);
+      }
+      sn += 4;
+      size_t snend = line.find('\t', sn);
+      if(snend == std::string::npos)
+	snend = line.size();
+
+      chrom_map::const_iterator it = new_chroms.find(line.substr(sn, snend - sn));
+      if(it != new_chroms.end())
+	line.replace(sn, snend - sn, it->second);
+
+    }
+
+    out += line;
+    if(lineend < htext.size())
+      out += '\n';
+    linestart = lineend + 1;
+
+  }
+
+  return out;
+
+}
+
+int main(int argc, char** argv) {
+
+  const char* map_name = 0;
+  const char* out_name = "-";
+  bool splice = false;
+
+  int c;
+  while((c = getopt(argc, argv, "m:so:")) >= 0) {
+    switch(c) {
+    case 'm':
+      map_name = optarg;
+      break;
+    case 's':
+      splice = true;
+      break;
+    case 'o':
+      out_name = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(optind + 1 != argc)
+    usage();
+
+  tool_stats_init("rename_chroms");
+
+  const char* in_name = argv[optind];
+  chrom_map new_chroms = map_name ? load_chrom_map(map_name) : default_chrom_map();
+
+  htsFile* hf = hts_open_tuned(in_name, "r");
   if(!hf) {
-    fprintf(stderr, "Failed to open %s\n", argv[1]);
+    fprintf(stderr, "Failed to open %s\n", in_name);
+    exit(1);
+  }
+
+  if(splice && (hf->format.format != bam || hf->format.compression != bgzf)) {
+    fprintf(stderr, "-s needs BGZF-compressed BAM input\n");
     exit(1);
   }
 
   bam_hdr_t* header = sam_hdr_read(hf);
+  if(!header) {
+    fprintf(stderr, "Failed to read header from %s\n", in_name);
+    exit(1);
+  }
 
-  htsFile* hfo = hts_open("-", "w");
+  htsFile* hfo = hts_open_tuned(out_name, splice ? "wb" : "w");
   if(!hfo) {
-    fprintf(stderr, "Failed to open stdout\n");
+    fprintf(stderr, "Failed to open %s\n", out_name);
     exit(1);
   }
 
   for(int32_t i = 0; i < header->n_targets; ++i) {
 
-    std::map<std::string, std::string>::iterator it = new_chroms.find(header->target_name[i]);
+    chrom_map::iterator it = new_chroms.find(header->target_name[i]);
 
     if(it == new_chroms.end())
       continue;
 
     free(header->target_name[i]);
     header->target_name[i] = strdup(it->second.c_str());
-	 
+
   }
 
   // Void cache if any (leaks a khash table; never mind)
   if(header->sdict)
     header->sdict = 0;
 
-  // Remove any @SQ lines from the header text so that our rewrite will take effect:
-  std::string htext = header->text;
-  size_t sqstart;
-  while((sqstart = htext.find("@SQ")) != std::string::npos) {
-    size_t nextnl = htext.find("\n", sqstart);
-    if(nextnl == std::string::npos) {
-      std::cerr << "Malformed header SQ line\n";
-      exit(1);
-    }
-    htext.erase(sqstart, (nextnl - sqstart) + 1);
-  }
+  std::string htext = rename_sq_lines(header->text ? header->text : "", new_chroms);
 
   free(header->text);
   header->text = strdup(htext.c_str());
   header->l_text = htext.length();
-    
-  sam_hdr_write(hfo, header);
+
+  if(sam_hdr_write(hfo, header)) {
+    fprintf(stderr, "Failed to write header to %s\n", out_name);
+    exit(1);
+  }
+
+  if(splice) {
+    StageTimer timer(tool_stage_write);
+    if(!bgzf_splice_body(hf->fp.bgzf, hfo->fp.bgzf)) {
+      fprintf(stderr, "Failed to copy records from %s to %s\n", in_name, out_name);
+      exit(1);
+    }
+  }
 
   hts_close(hf);
-  hts_close(hfo);
+  if(hts_close(hfo)) {
+    fprintf(stderr, "Failed to close %s\n", out_name);
+    exit(1);
+  }
+
+  tool_stats_finish();
+  return 0;
 
 }
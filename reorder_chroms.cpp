@@ -1,137 +1,475 @@
 
 #include <htslib/hts.h>
 #include <htslib/sam.h>
+#include <htslib/bgzf.h>
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-#include <map>
 #include <string>
-#include <iostream>
-#include <algorithm>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "record_transforms.h"
+#include "bgzf_splice.h"
+#include "tool_stats.h"
+#include "big_hfile.h"
+#include "output_level.h"
+#include "output_index.h"
+
+// Renumber contigs into 1 .. 22, X, Y, MT order. By default records are streamed through in
+// their existing order, so coordinate-sorted input comes out unsorted. With -i the input's index
+// is used to read each contig's records in the new order instead: contigs are remapped in
+// parallel into temporary BGZF files, which are then spliced together block-for-block and indexed
+// from offsets noted as they were written, so the output is sorted and indexed without a re-sort.
+// Streamed output is indexed too in the cases where it stays sorted, when the input's contigs
+// were already in the new order.
+
+static void usage() {
+
+  fprintf(stderr, "Usage: reorder_chroms [-o out.bam] in.bam\n");
+  fprintf(stderr, "       reorder_chroms -i [-c] [-@ threads] -o out.bam in.bam\n");
+  fprintf(stderr, "\t-o\tOutput file (default stdout, uncompressed BAM)\n");
+  fprintf(stderr, "\t-i\tRead contigs in the new order using in.bam's index; writes a sorted out.bam and out.bam.bai\n");
+  fprintf(stderr, "\t-c\tWith -i, write a CSI rather than a BAI index (needed for contigs over 512Mbp)\n");
+  fprintf(stderr, "\t-@\tWith -i, number of contigs to remap at once\n");
+  exit(1);
 
-int main(int argc, char** argv) {
+}
+
+static void reorder_stream(const char* in_name, const char* out_name) {
+
+  htsFile* hf = hts_open_tuned(in_name, "r");
+  if(!hf) {
+    fprintf(stderr, "Failed to open %s\n", in_name);
+    exit(1);
+  }
+
+  bam_hdr_t* header = sam_hdr_read(hf);
+  if(!header) {
+    fprintf(stderr, "Failed to read header from %s\n", in_name);
+    exit(1);
+  }
+
+  htsFile* hfo = hts_open_output(out_name, "wb0");
+  if(!hfo) {
+    fprintf(stderr, "Failed to open %s\n", out_name);
+    exit(1);
+  }
+
+  ReorderContigsStage stage(default_contig_order());
+  bam_hdr_t* newheader = stage.init(header);
+
+  if(sam_hdr_write(hfo, newheader)) {
+    fprintf(stderr, "Failed to write header to %s\n", out_name);
+    exit(1);
+  }
+
+  OutputIndexer indexer;
+  indexer.begin(hfo, out_name, newheader);
+
+  bam1_t *rec = bam_init1();
+
+  while(tool_stats_read1(hf, header, rec) >= 0) {
+
+    stage.apply(rec);
+    indexer.check(rec);
+    if(output_write1(hfo, newheader, rec) < 0) {
+      fprintf(stderr, "Failed to write BAM record\n");
+      exit(1);
+    }
+
+  }
+
+  bam_destroy1(rec);
+  hts_close(hf);
+  indexer.save();
+  if(hts_close_output(hfo)) {
+    fprintf(stderr, "Failed to close %s\n", out_name);
+    exit(1);
+  }
+
+  bam_hdr_destroy(newheader);
+  bam_hdr_destroy(header);
+
+}
+
+// What the index needs to know about each record written to a chunk; voffset is the chunk-relative
+// virtual offset just after the record, as hts_idx_push expects.
 
-  std::vector<std::string> newOrder;
-  for(int i = 1; i < 23; ++i) {
+struct ChunkIndexEntry {
 
-    char chrbuf[32];
-    sprintf(chrbuf, "%d", i);
-    newOrder.push_back(std::string(chrbuf));
+  int64_t beg, end;
+  uint64_t voffset;
+  int32_t mapped;
 
+};
+
+// One chunk per contig in the new order, then one for the records with no coordinate.
+
+struct ContigChunks {
+
+  const char* in_name;
+  std::string tmp_prefix;
+  std::vector<int> newToOld;
+
+  std::vector<bool> done;
+  // Compressed length of each chunk, excluding its EOF marker; 0 if it had no records.
+  std::vector<uint64_t> lengths;
+  std::mutex lock;
+  std::condition_variable cond;
+  int next_chunk;
+
+};
+
+static std::string chunk_filename(const ContigChunks* chunks, int chunk, const char* suffix) {
+
+  char buf[32];
+  sprintf(buf, ".%d.%s", chunk, suffix);
+  return chunks->tmp_prefix + buf;
+
+}
+
+static void write_entry_or_die(const ChunkIndexEntry& entry, FILE* f) {
+
+  if(fwrite(&entry, sizeof(entry), 1, f) != 1) {
+    fprintf(stderr, "Failed to write temporary index data\n");
+    exit(1);
   }
-    
-  newOrder.push_back("X");
-  newOrder.push_back("Y");
-  newOrder.push_back("MT");
 
-  htsFile* hf = hts_open(argv[1], "r");
+}
+
+static void reorder_contigs(ContigChunks* chunks) {
+
+  htsFile* hf = hts_open_tuned(chunks->in_name, "r");
   if(!hf) {
-    fprintf(stderr, "Failed to open %s\n", argv[1]);
+    fprintf(stderr, "Failed to open %s\n", chunks->in_name);
     exit(1);
   }
 
   bam_hdr_t* header = sam_hdr_read(hf);
+  if(!header) {
+    fprintf(stderr, "Failed to read header from %s\n", chunks->in_name);
+    exit(1);
+  }
+
+  hts_idx_t* idx = sam_index_load(hf, chunks->in_name);
+  if(!idx) {
+    fprintf(stderr, "Failed to load index for %s; -i needs an indexed BAM\n", chunks->in_name);
+    exit(1);
+  }
+
+  ReorderContigsStage stage(default_contig_order());
+  bam_hdr_t* newheader = stage.init(header);
+  bam1_t* rec = bam_init1();
+  int n_targets = header->n_targets;
+
+  while(true) {
+
+    int chunk;
+    {
+      std::lock_guard<std::mutex> guard(chunks->lock);
+      chunk = chunks->next_chunk++;
+    }
+    if(chunk > n_targets)
+      break;
+
+    int oldtid = chunk < n_targets ? chunks->newToOld[chunk] : HTS_IDX_NOCOOR;
+
+    // Skip contigs the index says are empty, sparing a pair of temporary files each.
+    bool empty;
+    if(chunk < n_targets) {
+      uint64_t mapped, unmapped;
+      empty = hts_idx_get_stat(idx, oldtid, &mapped, &unmapped) == 0 && mapped + unmapped == 0;
+    }
+    else {
+      empty = hts_idx_get_n_no_coor(idx) == 0;
+    }
+
+    uint64_t length = 0;
+
+    if(!empty) {
+
+      hts_itr_t* itr = sam_itr_queryi(idx, oldtid, 0, HTS_POS_MAX);
+      if(!itr) {
+	fprintf(stderr, "Failed to query %s\n", chunks->in_name);
+	exit(1);
+      }
+
+      std::string bam_name = chunk_filename(chunks, chunk, "bam");
+      std::string idx_name = chunk_filename(chunks, chunk, "idx");
+      BGZF* out = bgzf_open(bam_name.c_str(), "w");
+      FILE* idxout = fopen(idx_name.c_str(), "wb");
+      if(!out || !idxout) {
+	fprintf(stderr, "Failed to create temporary files %s\n", bam_name.c_str());
+	exit(1);
+      }
 
-  std::vector<std::string> oldOrder;
+      // Each entry is written once the next record is, since the last one's offset is only
+      // known for sure once the chunk has been flushed.
+      ChunkIndexEntry pending;
+      bool have_pending = false;
+      int ret;
+
+      while((ret = sam_itr_next(hf, itr, rec)) >= 0) {
+
+	tool_stats_add_records(1);
+	stage.apply(rec);
+	if(bam_write1(out, rec) < 0) {
+	  fprintf(stderr, "Failed to write %s\n", bam_name.c_str());
+	  exit(1);
+	}
+
+	if(have_pending)
+	  write_entry_or_die(pending, idxout);
+	pending.beg = rec->core.pos;
+	pending.end = bam_endpos(rec);
+	pending.voffset = bgzf_tell(out);
+	pending.mapped = !(rec->core.flag & BAM_FUNMAP);
+	have_pending = true;
 
-  for(int i = 0; i < header->n_targets; ++i)
-    oldOrder.push_back(header->target_name[i]);
+      }
 
-  std::map<int32_t, int32_t> oldToNew;
+      if(ret < -1) {
+	fprintf(stderr, "Failed to read %s\n", chunks->in_name);
+	exit(1);
+      }
 
-  for(int32_t i = 0; i < oldOrder.size(); ++i) {
+      if(bgzf_flush(out)) {
+	fprintf(stderr, "Failed to write %s\n", bam_name.c_str());
+	exit(1);
+      }
+      length = out->block_address;
+
+      // Point the last record's end at the start of the next chunk rather than the end of this
+      // one's final block: the same place, but the canonical form an indexer would record.
+      if(have_pending) {
+	pending.voffset = length << 16;
+	write_entry_or_die(pending, idxout);
+      }
 
-    std::vector<std::string>::iterator findit = std::find(newOrder.begin(), newOrder.end(), oldOrder[i]);
-    if(findit == newOrder.end()) {
-      if(i < newOrder.size()) {
-	std::cerr << oldOrder[i] << " clashes with new order\n";
+      if(bgzf_close(out) || fclose(idxout)) {
+	fprintf(stderr, "Failed to write %s\n", bam_name.c_str());
 	exit(1);
       }
-      oldToNew[i] = i;
+
+      if(!length) {
+	unlink(bam_name.c_str());
+	unlink(idx_name.c_str());
+      }
+
+      hts_itr_destroy(itr);
+
     }
-    else {
-      int32_t newIdx = std::distance(newOrder.begin(), findit);
-      oldToNew[i] = std::distance(newOrder.begin(), findit);
+
+    {
+      std::lock_guard<std::mutex> guard(chunks->lock);
+      chunks->lengths[chunk] = length;
+      chunks->done[chunk] = true;
     }
+    chunks->cond.notify_all();
+
+  }
+
+  bam_destroy1(rec);
+  bam_hdr_destroy(newheader);
+  bam_hdr_destroy(header);
+  hts_idx_destroy(idx);
+  hts_close(hf);
 
+}
+
+static void reorder_indexed(const char* in_name, const char* out_name, int nthreads, bool csi) {
+
+  htsFile* hf = hts_open_tuned(in_name, "r");
+  if(!hf) {
+    fprintf(stderr, "Failed to open %s\n", in_name);
+    exit(1);
+  }
+
+  if(hf->format.format != bam) {
+    fprintf(stderr, "-i needs BAM input\n");
+    exit(1);
+  }
+
+  bam_hdr_t* header = sam_hdr_read(hf);
+  if(!header) {
+    fprintf(stderr, "Failed to read header from %s\n", in_name);
+    exit(1);
   }
 
-  htsFile* hfo = hts_open("-", "wb0");
+  int n_targets = header->n_targets;
+
+  ContigChunks chunks;
+  chunks.in_name = in_name;
+  chunks.tmp_prefix = std::string(out_name) + ".tmp";
+  chunks.done.resize(n_targets + 1, false);
+  chunks.lengths.resize(n_targets + 1, 0);
+  chunks.next_chunk = 0;
+
+  std::vector<int32_t> oldToNew;
+  bam_hdr_t* newheader = reorder_header(header, default_contig_order(), oldToNew);
+  chunks.newToOld.resize(n_targets);
+  for(int32_t i = 0; i < n_targets; ++i)
+    chunks.newToOld[oldToNew[i + 1]] = i;
+
+  htsFile* hfo = hts_open_tuned(out_name, "wb");
   if(!hfo) {
-    fprintf(stderr, "Failed to open stdout\n");
+    fprintf(stderr, "Failed to open %s\n", out_name);
     exit(1);
   }
-  
-  // Rearrange the header:
-  bam_hdr_t* newheader = bam_hdr_dup(header);
 
-  for(int32_t i = 0; i < header->n_targets; ++i) {
+  if(sam_hdr_write(hfo, newheader) || bgzf_flush(hfo->fp.bgzf)) {
+    fprintf(stderr, "Failed to write header to %s\n", out_name);
+    exit(1);
+  }
 
-    int32_t newIdx = oldToNew[i];
-    free(newheader->target_name[newIdx]);
-    newheader->target_name[newIdx] = strdup(header->target_name[i]);
-    newheader->target_len[newIdx] = header->target_len[i];
+  // As sam_idx_init would set up for on-the-fly indexing.
+  int min_shift = 14, n_lvls = 5, fmt = HTS_FMT_BAI;
+  if(csi) {
+    int64_t max_len = 0, s;
+    for(int32_t i = 0; i < n_targets; ++i)
+      max_len = std::max(max_len, (int64_t)newheader->target_len[i]);
+    max_len += 256;
+    for(n_lvls = 0, s = 1 << min_shift; max_len > s; ++n_lvls, s <<= 3);
+    fmt = HTS_FMT_CSI;
+  }
 
+  // Compressed offset in the output at which the next chunk will start.
+  uint64_t base = hfo->fp.bgzf->block_address;
+  hts_idx_t* idx = hts_idx_init(n_targets, fmt, base << 16, min_shift, n_lvls);
+  if(!idx) {
+    fprintf(stderr, "Failed to create index\n");
+    exit(1);
   }
 
-  // Void cache if any (leaks a khash table; never mind)
-  if(newheader->sdict)
-    newheader->sdict = 0;
+  std::vector<std::thread> workers;
+  for(int i = 0; i < nthreads; ++i)
+    workers.push_back(std::thread(reorder_contigs, &chunks));
+
+  for(int chunk = 0; chunk <= n_targets; ++chunk) {
+
+    uint64_t length;
+    {
+      std::unique_lock<std::mutex> guard(chunks.lock);
+      while(!chunks.done[chunk])
+	chunks.cond.wait(guard);
+      length = chunks.lengths[chunk];
+    }
+
+    if(!length)
+      continue;
 
-  // Remove any @SQ lines from the header text so that our rewrite will take effect:
-  std::string htext = newheader->text;
-  size_t sqstart;
-  while((sqstart = htext.find("@SQ")) != std::string::npos) {
-    size_t nextnl = htext.find("\n", sqstart);
-    if(nextnl == std::string::npos) {
-      std::cerr << "Malformed header SQ line\n";
+    std::string bam_name = chunk_filename(&chunks, chunk, "bam");
+    std::string idx_name = chunk_filename(&chunks, chunk, "idx");
+
+    StageTimer timer(tool_stage_write);
+    BGZF* in = bgzf_open(bam_name.c_str(), "r");
+    if(!in || !bgzf_splice_body(in, hfo->fp.bgzf) || bgzf_close(in)) {
+      fprintf(stderr, "Failed to copy %s to %s\n", bam_name.c_str(), out_name);
+      exit(1);
+    }
+
+    FILE* idxin = fopen(idx_name.c_str(), "rb");
+    if(!idxin) {
+      fprintf(stderr, "Failed to open %s\n", idx_name.c_str());
       exit(1);
     }
-    htext.erase(sqstart, (nextnl - sqstart) + 1);
-  }
 
-  // Replace @SQ lines, for legacy readers:
-  if(htext.size() > 0 && htext[htext.size()-1] != '\n')
-    htext += "\n";
+    int tid = chunk < n_targets ? chunk : -1;
+    ChunkIndexEntry entry;
+    while(fread(&entry, sizeof(entry), 1, idxin) == 1) {
+      uint64_t voffset = ((base + (entry.voffset >> 16)) << 16) | (entry.voffset & 0xffff);
+      if(hts_idx_push(idx, tid, entry.beg, entry.end, voffset, entry.mapped) < 0) {
+	fprintf(stderr, "Failed to index %s; is %s sorted?\n", out_name, in_name);
+	exit(1);
+      }
+    }
 
-  for(int32_t i = 0; i < newheader->n_targets; ++i) {
-    char buf[128];
-    if(snprintf(buf, 128, "@SQ\tSN:%s\tLN:%u\n", newheader->target_name[i], newheader->target_len[i]) > 128) {
-      fprintf(stderr, "Sequence name too long!\n");
+    if(ferror(idxin)) {
+      fprintf(stderr, "Failed to read %s\n", idx_name.c_str());
       exit(1);
     }
-    htext += std::string(buf);
+
+    fclose(idxin);
+    unlink(bam_name.c_str());
+    unlink(idx_name.c_str());
+    base += length;
+
   }
 
-  free(newheader->text);
-  newheader->text = strdup(htext.c_str());
-  newheader->l_text = htext.length();
+  for(int i = 0; i < nthreads; ++i)
+    workers[i].join();
 
-  sam_hdr_write(hfo, newheader);
+  if(hts_idx_finish(idx, base << 16)) {
+    fprintf(stderr, "Failed to finish index\n");
+    exit(1);
+  }
 
-  bam1_t *rec = bam_init1();
+  if(hts_close(hfo)) {
+    fprintf(stderr, "Failed to close %s\n", out_name);
+    exit(1);
+  }
 
-  // Leave unmapped reads alone
-  oldToNew[-1] = -1;
+  if(hts_idx_save_as(idx, out_name, 0, fmt)) {
+    fprintf(stderr, "Failed to write index for %s\n", out_name);
+    exit(1);
+  }
 
-  while(sam_read1(hf, header, rec) >= 0) {
+  hts_idx_destroy(idx);
+  bam_hdr_destroy(newheader);
+  bam_hdr_destroy(header);
+  hts_close(hf);
 
-    if(!oldToNew.count(rec->core.tid)) {
-      std::cerr << "Unknown contig ID " << rec->core.tid << "!\n";
-      exit(1);
-    }
-    if(!oldToNew.count(rec->core.mtid)) {
-      std::cerr << "Unknown contig ID " << rec->core.mtid << "!\n";
-      exit(1);
+}
+
+int main(int argc, char** argv) {
+
+  const char* out_name = 0;
+  bool indexed = false, csi = false;
+  int nthreads = 1;
+
+  int c;
+  while((c = getopt(argc, argv, "o:ic@:")) >= 0) {
+    switch(c) {
+    case 'o':
+      out_name = optarg;
+      break;
+    case 'i':
+      indexed = true;
+      break;
+    case 'c':
+      csi = true;
+      break;
+    case '@':
+      nthreads = atoi(optarg);
+      break;
+    default:
+      usage();
     }
+  }
+
+  if(optind + 1 != argc || nthreads < 1)
+    usage();
 
-    rec->core.tid = oldToNew[rec->core.tid];
-    rec->core.mtid = oldToNew[rec->core.mtid];
-    sam_write1(hfo, newheader, rec);
+  tool_stats_init("reorder_chroms");
 
+  if(indexed) {
+    if(!out_name || !strcmp(out_name, "-")) {
+      fprintf(stderr, "-i needs an output file (-o) to index\n");
+      exit(1);
+    }
+    reorder_indexed(argv[optind], out_name, nthreads, csi);
+  }
+  else {
+    reorder_stream(argv[optind], out_name ? out_name : "-");
   }
 
-  hts_close(hf);
-  hts_close(hfo);
+  tool_stats_finish();
+  return 0;
 
 }
@@ -0,0 +1,178 @@
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/kstring.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "parallel_records.h"
+#include "tool_stats.h"
+#include "big_hfile.h"
+
+// Print SAM text with the flags field replaced by a list of letters, one per flag set, as
+// samflags.py did for samtools view's output. Reads SAM, BAM or CRAM itself, looks flag strings
+// up in a table built once rather than decoding each record's bits, and formats records on
+// worker threads.
+
+// Letters for flag bits 0x1 .. 0x800 in turn, as samflags.py's flag_code.
+static const char flag_code[] = "MPUuRr12nQDN";
+
+struct FlagTable {
+
+  char strs[4096][sizeof(flag_code)];
+  unsigned char lens[4096];
+
+  FlagTable() {
+    for(int flags = 0; flags < 4096; ++flags) {
+      int len = 0;
+      for(int bit = 0; bit < 12; ++bit) {
+	if(flags & (1 << bit))
+	  strs[flags][len++] = flag_code[bit];
+      }
+      strs[flags][len] = '\0';
+      lens[flags] = len;
+    }
+  }
+
+};
+
+static void usage() {
+
+  fprintf(stderr, "Usage: samflags [-@ threads] [-H] [-T ref.fa] [in.xam]\n");
+  fprintf(stderr, "\tReads stdin by default. Flags are written as letters, one per flag set, from %s for 0x1 .. 0x800\n", flag_code);
+  fprintf(stderr, "\t-H\tAlso print the header\n");
+  fprintf(stderr, "\t-T\tReference, for CRAM input\n");
+  fprintf(stderr, "\t-@\tThreads for formatting records and for BGZF decoding\n");
+  exit(1);
+
+}
+
+// Replace the second (flags) field of the formatted record in text.
+
+static void replace_flags(kstring_t* text, const FlagTable& table, uint16_t flags) {
+
+  char* tab1 = (char*)memchr(text->s, '\t', text->l);
+  if(!tab1)
+    return;
+  char* field = tab1 + 1;
+  char* tab2 = (char*)memchr(field, '\t', text->l - (field - text->s));
+  if(!tab2)
+    return;
+
+  char letters[sizeof(flag_code) + 8];
+  size_t newlen = table.lens[flags & 0xfff];
+  memcpy(letters, table.strs[flags & 0xfff], newlen);
+  // Bits beyond the SAM spec's, which samflags.py would have choked on, are kept as a number.
+  if(flags & ~0xfff)
+    newlen += sprintf(letters + newlen, "+%u", flags & ~0xfff);
+
+  size_t oldlen = tab2 - field;
+  size_t fieldoff = field - text->s;
+  size_t taillen = text->l - (fieldoff + oldlen);
+
+  if(newlen > oldlen && ks_resize(text, text->l + (newlen - oldlen) + 1)) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+
+  memmove(text->s + fieldoff + newlen, text->s + fieldoff + oldlen, taillen);
+  memcpy(text->s + fieldoff, letters, newlen);
+  text->l = text->l - oldlen + newlen;
+  text->s[text->l] = '\0';
+
+}
+
+static void write_or_die(const char* data, size_t len) {
+
+  if(fwrite(data, 1, len, stdout) != len) {
+    fprintf(stderr, "Failed to write output\n");
+    exit(1);
+  }
+
+}
+
+int main(int argc, char** argv) {
+
+  int nthreads = 1;
+  bool print_header = false;
+  const char* ref_name = 0;
+
+  int c;
+  while((c = getopt(argc, argv, "@:HT:")) >= 0) {
+    switch(c) {
+    case '@':
+      nthreads = atoi(optarg);
+      break;
+    case 'H':
+      print_header = true;
+      break;
+    case 'T':
+      ref_name = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(argc - optind > 1)
+    usage();
+
+  tool_stats_init("samflags");
+
+  const char* in_name = optind < argc ? argv[optind] : "-";
+
+  htsFile* hf = hts_open_tuned(in_name, "r");
+  if(!hf) {
+    fprintf(stderr, "Failed to open %s\n", in_name);
+    exit(1);
+  }
+
+  if(ref_name && hts_set_fai_filename(hf, ref_name)) {
+    fprintf(stderr, "Failed to use reference %s\n", ref_name);
+    exit(1);
+  }
+
+  if(nthreads > 1)
+    hts_set_threads(hf, nthreads);
+
+  bam_hdr_t* header = sam_hdr_read(hf);
+  if(!header) {
+    fprintf(stderr, "Failed to read header from %s\n", in_name);
+    exit(1);
+  }
+
+  static char outbuf[1 << 20];
+  setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+  if(print_header && header->l_text)
+    write_or_die(header->text, header->l_text);
+
+  FlagTable table;
+
+  process_record_batches(hf, header, nthreads,
+			 [&](BatchRecord& br, int worker) {
+			   if(sam_format1(header, br.rec, &br.text) < 0) {
+			     fprintf(stderr, "Failed to format record %s\n", bam_get_qname(br.rec));
+			     exit(1);
+			   }
+			   replace_flags(&br.text, table, br.rec->core.flag);
+			   kputc('\n', &br.text);
+			 },
+			 [&](BatchRecord& br) {
+			   write_or_die(br.text.s, br.text.l);
+			 });
+
+  if(fflush(stdout)) {
+    fprintf(stderr, "Failed to write output\n");
+    exit(1);
+  }
+
+  bam_hdr_destroy(header);
+  hts_close(hf);
+  tool_stats_finish();
+  return 0;
+
+}
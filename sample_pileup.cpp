@@ -1,66 +1,773 @@
 
-#include <functional>
 #include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ctype.h>
 
-const char* ws = " \t\n";
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/faidx.h>
 
-bool first_2_fields(std::string& l) {
+#include "stable_hash.h"
+#include "tool_stats.h"
+#include "big_hfile.h"
 
-  size_t boundary = l.find_first_of(ws);
-  if(boundary == std::string::npos)
+// Sample pileup lines by a stable hash of their contig and position, so that running this over
+// several pileups of the same reference keeps the same positions, on any host.
+// Input is mmap'd when stdin is a regular file, or read in large blocks otherwise; each block is
+// split at line boundaries between worker threads and their output written back in input order.
+
+static const size_t chunk_size = 64 * 1024 * 1024;
+
+static inline bool is_ws(char c) {
+  return c == ' ' || c == '\t';
+}
+
+// Find the first two whitespace-separated fields of [l, lend). Like the old line-based version
+// we insist there's whitespace after the position, i.e. at least three fields.
+
+static bool first_2_fields(const char* l, const char* lend, const char** chromend, const char** posstart, const char** posend) {
+
+  const char* p = l;
+  while(p != lend && !is_ws(*p))
+    ++p;
+  if(p == lend || p == l)
     return false;
+  *chromend = p;
 
-  size_t field2start = l.find_first_not_of(ws, boundary);
-  if(field2start == std::string::npos)
+  while(p != lend && is_ws(*p))
+    ++p;
+  if(p == lend)
     return false;
+  *posstart = p;
 
-  size_t field2end = l.find_first_of(ws, field2start);
-  if(field2end == std::string::npos)
+  while(p != lend && !is_ws(*p))
+    ++p;
+  if(p == lend)
     return false;
+  *posend = p;
 
-  l.erase(field2end);
   return true;
 
 }
 
-int main(int argc, char** argv) {
+struct SampleJob {
+
+  const char* begin;
+  const char* end;
+  std::string out;
+  const char* malformed;
+  size_t malformed_len;
+
+};
+
+static void sample_lines(SampleJob* job, uint64_t hash_threshold, uint64_t seed) {
+
+  StageTimer timer(tool_stage_compute);
+  const char* l = job->begin;
+  job->out.clear();
+  job->malformed = 0;
+  uint64_t nlines = 0;
+
+  while(l < job->end) {
+
+    const char* nl = (const char*)memchr(l, '\n', job->end - l);
+    const char* lend = nl ? nl : job->end;
+    const char* next = nl ? nl + 1 : job->end;
+
+    const char* firstc = l;
+    while(firstc != lend && (is_ws(*firstc) || *firstc == '\r'))
+      ++firstc;
+
+    if(firstc != lend) {
+
+      ++nlines;
+      const char *chromend, *posstart, *posend;
+      if(!first_2_fields(l, lend, &chromend, &posstart, &posend)) {
+	job->malformed = l;
+	job->malformed_len = lend - l;
+	return;
+      }
+
+      if(pileup_position_hash(l, chromend - l, posstart, posend - posstart, seed) <= hash_threshold) {
+	job->out.append(l, lend - l);
+	job->out.push_back('\n');
+      }
+
+    }
+
+    l = next;
+
+  }
+
+  tool_stats_add_records(nlines);
+
+}
+
+// Yields successive chunks of stdin that end on a line boundary (or at EOF).
+
+class ChunkSource {
+
+  const char* map;
+  size_t map_len;
+  size_t map_off;
+
+  std::vector<char> bufs[2];
+  int nextbuf;
+  size_t carry_off, carry_len;
+  bool eof;
+
+public:
+
+  ChunkSource() : map(0), map_len(0), map_off(0), nextbuf(0), carry_off(0), carry_len(0), eof(false) {
+
+    struct stat st;
+    if(fstat(0, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void* p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, 0, 0);
+      if(p != MAP_FAILED) {
+	madvise(p, st.st_size, MADV_SEQUENTIAL);
+	map = (const char*)p;
+	map_len = st.st_size;
+	return;
+      }
+    }
+
+    bufs[0].resize(chunk_size);
+    bufs[1].resize(chunk_size);
+
+  }
+
+  ~ChunkSource() {
+    if(map)
+      munmap((void*)map, map_len);
+  }
+
+  // The chunk returned by the previous call stays valid until the one after this.
+  bool next(const char** begin, const char** end) {
+
+    if(map) {
+
+      if(map_off == map_len)
+	return false;
+
+      size_t lim = std::min(map_len, map_off + chunk_size);
+      if(lim != map_len) {
+	const char* nl = (const char*)memrchr(map + map_off, '\n', lim - map_off);
+	if(nl)
+	  lim = (nl - map) + 1;
+	else {
+	  nl = (const char*)memchr(map + lim, '\n', map_len - lim);
+	  lim = nl ? (nl - map) + 1 : map_len;
+	}
+      }
+
+      *begin = map + map_off;
+      *end = map + lim;
+      map_off = lim;
+      return true;
+
+    }
+
+    std::vector<char>& prev = bufs[nextbuf ^ 1];
+    std::vector<char>& buf = bufs[nextbuf];
+
+    // Carry over the incomplete last line of the previous chunk.
+    if(carry_len > buf.size() / 2)
+      buf.resize(carry_len * 2);
+    if(carry_len)
+      memcpy(&buf[0], &prev[carry_off], carry_len);
+
+    size_t filled = carry_len;
+    carry_len = 0;
+
+    size_t lim;
+    while(true) {
+
+      while((!eof) && filled < buf.size()) {
+	ssize_t n = read(0, &buf[filled], buf.size() - filled);
+	if(n < 0) {
+	  if(errno == EINTR)
+	    continue;
+	  perror("Failed to read stdin");
+	  exit(1);
+	}
+	if(n == 0)
+	  eof = true;
+	filled += n;
+      }
+
+      if(filled == 0)
+	return false;
+
+      if(eof) {
+	lim = filled;
+	break;
+      }
+
+      const char* nl = (const char*)memrchr(&buf[0], '\n', filled);
+      if(nl) {
+	lim = (nl - &buf[0]) + 1;
+	break;
+      }
+
+      // A single line longer than the buffer: grow it and keep reading.
+      buf.resize(buf.size() * 2);
+
+    }
+
+    carry_off = lim;
+    carry_len = filled - lim;
+
+    *begin = &buf[0];
+    *end = &buf[0] + lim;
+    nextbuf ^= 1;
+    return true;
 
-  if(argc != 2) {
-    std::cerr << "Usage: sample_pileup proportion_to_keep < in.pileup > out.pileup\n";
+  }
+
+};
+
+static void write_or_die(const std::string& s) {
+
+  StageTimer timer(tool_stage_write);
+  if(s.size() && fwrite(s.data(), 1, s.size(), stdout) != s.size()) {
+    perror("Failed to write stdout");
     exit(1);
   }
 
-  std::string propstr = argv[1];
-  double prop = std::stof(propstr);
-  size_t hash_threshold = (size_t)(((double)SIZE_MAX) * prop);
-  std::cerr << "Keeping records with hash <= " << hash_threshold << "\n";
+}
+
+// Native mode: pile up an indexed BAM ourselves and only format the columns the hash selects,
+// rather than having samtools mpileup format every column for us to throw 99% of them away.
+// Each worker thread has its own reader and takes whole contigs; output is written in contig order.
+// The column format follows samtools mpileup's defaults (without -B / BAQ).
+
+struct BamPileupOptions {
+
+  const char* bam_name;
+  const char* ref_name;
+  int min_baseq;
+  int min_mapq;
+  int max_depth;
+  bool count_orphans;
+  uint64_t hash_threshold;
+  uint64_t seed;
+
+};
+
+struct BamReadState {
+
+  htsFile* hf;
+  hts_itr_t* itr;
+  const BamPileupOptions* opts;
+
+};
+
+static int pileup_read_bam(void* data, bam1_t* b) {
+
+  BamReadState* state = (BamReadState*)data;
+  int ret;
+
+  while((ret = sam_itr_next(state->hf, state->itr, b)) >= 0) {
+
+    if(b->core.flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FQCFAIL | BAM_FDUP))
+      continue;
+    if(b->core.qual < state->opts->min_mapq)
+      continue;
+    if((!state->opts->count_orphans) && (b->core.flag & BAM_FPAIRED) && !(b->core.flag & BAM_FPROPER_PAIR))
+      continue;
+    break;
+
+  }
+
+  if(ret >= 0)
+    tool_stats_add_records(1);
+  return ret;
+
+}
+
+// Caches a window of reference sequence around the positions being emitted.
+
+class RefWindow {
+
+  faidx_t* fai;
+  std::string contig;
+  int beg, len;
+  char* seq;
+
+public:
+
+  RefWindow(faidx_t* _fai) : fai(_fai), beg(0), len(0), seq(0) {}
+  ~RefWindow() {
+    free(seq);
+  }
+
+  void set_contig(const char* name) {
+    contig = name;
+    len = 0;
+  }
+
+  char base(int pos) {
+
+    if(!fai)
+      return 'N';
+
+    if(pos < beg || pos >= beg + len) {
+      free(seq);
+      beg = pos;
+      seq = faidx_fetch_seq(fai, contig.c_str(), pos, pos + (1 << 20) - 1, &len);
+      if(!seq)
+	len = 0;
+    }
+
+    if(pos >= beg + len)
+      return 'N';
+    return toupper(seq[pos - beg]);
+
+  }
+
+};
+
+static void append_column(std::string& out, const char* key, size_t keylen, int pos, int n_plp, const bam_pileup1_t* plp,
+			  RefWindow& ref, const BamPileupOptions* opts, std::string& quals) {
+
+  char refbase = ref.base(pos);
+  size_t depthoff;
+  int depth = 0;
+  char numbuf[16];
+
+  out.append(key, keylen);
+  out.push_back('\t');
+  out.push_back(refbase);
+  out.push_back('\t');
+  depthoff = out.size();
+  out.push_back('\t');
+  quals.clear();
+
+  for(int i = 0; i < n_plp; ++i) {
+
+    const bam_pileup1_t* p = plp + i;
+    const bam1_t* b = p->b;
+    bool rev = bam_is_rev(b);
+    int q = p->qpos < b->core.l_qseq ? bam_get_qual(b)[p->qpos] : 0;
+
+    if(!(p->is_del || p->is_refskip) && q < opts->min_baseq)
+      continue;
+
+    ++depth;
+
+    if(p->is_head) {
+      out.push_back('^');
+      out.push_back((char)(std::min((int)b->core.qual, 93) + 33));
+    }
+
+    if(p->is_del)
+      out.push_back('*');
+    else if(p->is_refskip)
+      out.push_back(rev ? '<' : '>');
+    else {
+      char c = seq_nt16_str[bam_seqi(bam_get_seq(b), p->qpos)];
+      if(c == refbase && refbase != 'N')
+	c = rev ? ',' : '.';
+      else
+	c = rev ? tolower(c) : toupper(c);
+      out.push_back(c);
+    }
+
+    if(p->indel > 0) {
+      out.push_back('+');
+      snprintf(numbuf, sizeof(numbuf), "%d", p->indel);
+      out.append(numbuf);
+      for(int j = 1; j <= p->indel; ++j) {
+	char c = seq_nt16_str[bam_seqi(bam_get_seq(b), p->qpos + j)];
+	out.push_back(rev ? tolower(c) : toupper(c));
+      }
+    }
+    else if(p->indel < 0) {
+      out.push_back('-');
+      snprintf(numbuf, sizeof(numbuf), "%d", -p->indel);
+      out.append(numbuf);
+      for(int j = 1; j <= -p->indel; ++j) {
+	char c = ref.base(pos + j);
+	out.push_back(rev ? tolower(c) : c);
+      }
+    }
+
+    if(p->is_tail)
+      out.push_back('$');
+
+    quals.push_back((char)(q + 33 < 126 ? q + 33 : 126));
+
+  }
+
+  if(depth == 0) {
+    out.push_back('*');
+    quals = "*";
+  }
 
-  std::string thisline;
-  std::string thisline_chroffset;
-  std::hash<std::string> hashfn;
+  snprintf(numbuf, sizeof(numbuf), "%d", depth);
+  out.insert(depthoff, numbuf);
+  out.push_back('\t');
+  out.append(quals);
+  out.push_back('\n');
+
+}
+
+// Workers hand each contig's text over in blocks of about pileup_block_size, and wait while
+// pileup_max_blocks of a contig's are queued; nor do they start a contig more than one per worker
+// ahead of the one being written. So memory stays within a few MB a thread however big the
+// contigs, rather than a finished contig waiting in full behind a slow one.
+
+static const size_t pileup_block_size = 1024 * 1024;
+static const size_t pileup_max_blocks = 4;
+
+struct ContigOutputs {
+
+  std::vector<std::deque<std::string> > blocks;
+  std::vector<bool> done;
+  std::mutex lock;
+  std::condition_variable cond;
+  int n_targets, next_contig, writing, max_ahead;
+
+};
+
+// The next contig to pile up, or n_targets when there are none left.
+static int claim_contig(ContigOutputs* results) {
+
+  std::unique_lock<std::mutex> guard(results->lock);
+  while(results->next_contig < results->n_targets && results->next_contig >= results->writing + results->max_ahead)
+    results->cond.wait(guard);
+  return results->next_contig < results->n_targets ? results->next_contig++ : results->n_targets;
+
+}
+
+// Queue out (leaving it empty) as the next block of contig tid, and mark the contig finished if last.
+static void hand_over(ContigOutputs* results, int tid, std::string& out, bool last) {
+
+  std::unique_lock<std::mutex> guard(results->lock);
+  while(results->blocks[tid].size() >= pileup_max_blocks)
+    results->cond.wait(guard);
+  if(!out.empty()) {
+    results->blocks[tid].push_back(std::string());
+    results->blocks[tid].back().swap(out);
+  }
+  if(last)
+    results->done[tid] = true;
+  results->cond.notify_all();
+
+}
+
+static void pileup_contigs(const BamPileupOptions* opts, ContigOutputs* results) {
+
+  htsFile* hf = hts_open_tuned(opts->bam_name, "r");
+  if(!hf) {
+    fprintf(stderr, "Failed to open %s\n", opts->bam_name);
+    exit(1);
+  }
+
+  bam_hdr_t* header = sam_hdr_read(hf);
+  if(!header) {
+    fprintf(stderr, "Failed to read header from %s\n", opts->bam_name);
+    exit(1);
+  }
+
+  hts_idx_t* idx = sam_index_load(hf, opts->bam_name);
+  if(!idx) {
+    fprintf(stderr, "Failed to load index for %s; native pileup mode needs an indexed BAM\n", opts->bam_name);
+    exit(1);
+  }
+
+  faidx_t* fai = 0;
+  if(opts->ref_name) {
+    fai = fai_load(opts->ref_name);
+    if(!fai) {
+      fprintf(stderr, "Failed to load reference index for %s\n", opts->ref_name);
+      exit(1);
+    }
+  }
+
+  RefWindow ref(fai);
+  std::string quals;
+  std::vector<char> key;
 
   while(true) {
 
-    std::getline(std::cin, thisline);
-    size_t firstc = thisline.find_first_not_of(ws);
-    if(firstc == std::string::npos)
+    int tid = claim_contig(results);
+    if(tid >= header->n_targets)
       break;
 
-    thisline_chroffset = thisline;
+    StageTimer timer(tool_stage_compute);
+    std::string out;
+    BamReadState state;
+    state.hf = hf;
+    state.opts = opts;
+    state.itr = sam_itr_queryi(idx, tid, 0, INT32_MAX);
+    if(!state.itr) {
+      fprintf(stderr, "Failed to query contig %s\n", header->target_name[tid]);
+      exit(1);
+    }
+
+    ref.set_contig(header->target_name[tid]);
+
+    // The sampling key is "contig<TAB>position", as it would read in mpileup text.
+    size_t namelen = strlen(header->target_name[tid]);
+    key.resize(namelen + 16);
+    memcpy(&key[0], header->target_name[tid], namelen);
+    key[namelen] = '\t';
+
+    bam_plp_t plp = bam_plp_init(pileup_read_bam, &state);
+    bam_plp_set_maxcnt(plp, opts->max_depth);
+
+    const bam_pileup1_t* col;
+    int ptid, pos, n_plp;
+    while((col = bam_plp_auto(plp, &ptid, &pos, &n_plp)) != 0) {
 
-    if(!first_2_fields(thisline_chroffset)) {
-      std::cerr << "Malformed line: " << thisline << "\n";
+      int poslen = snprintf(&key[namelen + 1], 15, "%d", pos + 1);
+      if(pileup_position_hash(&key[0], namelen, &key[namelen + 1], poslen, opts->seed) > opts->hash_threshold)
+	continue;
+
+      append_column(out, &key[0], namelen + 1 + poslen, pos, n_plp, col, ref, opts, quals);
+      if(out.size() >= pileup_block_size)
+	hand_over(results, tid, out, false);
+
+    }
+
+    if(n_plp < 0) {
+      fprintf(stderr, "Pileup failed on contig %s\n", header->target_name[tid]);
       exit(1);
     }
 
-    size_t hashval = hashfn(thisline_chroffset);
-    if(hashval <= hash_threshold)
-      std::cout << thisline << "\n";
+    bam_plp_destroy(plp);
+    hts_itr_destroy(state.itr);
+
+    hand_over(results, tid, out, true);
+
+  }
+
+  if(fai)
+    fai_destroy(fai);
+  hts_idx_destroy(idx);
+  bam_hdr_destroy(header);
+  hts_close(hf);
+
+}
+
+static void sample_bam(const BamPileupOptions* opts, int nthreads) {
+
+  htsFile* hf = hts_open_tuned(opts->bam_name, "r");
+  if(!hf) {
+    fprintf(stderr, "Failed to open %s\n", opts->bam_name);
+    exit(1);
+  }
+  bam_hdr_t* header = sam_hdr_read(hf);
+  if(!header) {
+    fprintf(stderr, "Failed to read header from %s\n", opts->bam_name);
+    exit(1);
+  }
+  int n_targets = header->n_targets;
+  bam_hdr_destroy(header);
+  hts_close(hf);
+
+  ContigOutputs results;
+  results.blocks.resize(n_targets);
+  results.done.resize(n_targets, false);
+  results.n_targets = n_targets;
+  results.next_contig = 0;
+  results.writing = 0;
+  results.max_ahead = nthreads;
+
+  std::vector<std::thread> workers;
+  for(int i = 0; i < nthreads; ++i)
+    workers.push_back(std::thread(pileup_contigs, opts, &results));
+
+  for(int tid = 0; tid < n_targets; ++tid) {
+
+    while(true) {
+
+      std::string block;
+      {
+	std::unique_lock<std::mutex> guard(results.lock);
+	while(results.blocks[tid].empty() && !results.done[tid])
+	  results.cond.wait(guard);
+	if(results.blocks[tid].empty()) {
+	  results.writing = tid + 1;
+	  results.cond.notify_all();
+	  break;
+	}
+	results.blocks[tid].front().swap(block);
+	results.blocks[tid].pop_front();
+	results.cond.notify_all();
+      }
 
+      write_or_die(block);
+
+    }
+
+  }
+
+  for(int i = 0; i < nthreads; ++i)
+    workers[i].join();
+
+}
+
+static void sample_text(int nthreads, uint64_t hash_threshold, uint64_t seed) {
+
+  ChunkSource source;
+  std::vector<SampleJob> jobs(nthreads);
+  std::vector<std::thread> workers;
+
+  const char *begin, *end;
+  bool more = source.next(&begin, &end);
+
+  while(more) {
+
+    // Split this chunk between the workers at line boundaries.
+    const char* start = begin;
+    for(int i = 0; i < nthreads; ++i) {
+
+      const char* lim = end;
+      if(i != nthreads - 1) {
+	lim = start + (end - start) / (nthreads - i);
+	const char* nl = (const char*)memchr(lim, '\n', end - lim);
+	lim = nl ? nl + 1 : end;
+      }
+
+      jobs[i].begin = start;
+      jobs[i].end = lim;
+      start = lim;
+
+    }
+
+    workers.clear();
+    for(int i = 1; i < nthreads; ++i)
+      workers.push_back(std::thread(sample_lines, &jobs[i], hash_threshold, seed));
+
+    // Worker 0 runs here, once the next chunk is on its way in.
+    const char *nextbegin = 0, *nextend = 0;
+    bool nextmore;
+    {
+      StageTimer timer(tool_stage_read);
+      nextmore = source.next(&nextbegin, &nextend);
+    }
+    sample_lines(&jobs[0], hash_threshold, seed);
+
+    for(int i = 0, ilim = workers.size(); i != ilim; ++i)
+      workers[i].join();
+
+    for(int i = 0; i < nthreads; ++i) {
+
+      if(jobs[i].malformed) {
+	std::cerr << "Malformed line: " << std::string(jobs[i].malformed, jobs[i].malformed_len) << "\n";
+	exit(1);
+      }
+
+      write_or_die(jobs[i].out);
+
+    }
+
+    more = nextmore;
+    begin = nextbegin;
+    end = nextend;
+
+  }
+
+}
+
+static void usage() {
+
+  std::cerr << "Usage: sample_pileup [-@ nthreads] [-s seed] proportion_to_keep < in.pileup > out.pileup\n";
+  std::cerr << "       sample_pileup [-@ nthreads] [-s seed] -b in.bam [-f ref.fa] [-Q min_baseq] [-q min_mapq] [-d max_depth] [-A] proportion_to_keep > out.pileup\n";
+  std::cerr << "\tKeeps lines whose XXH64 hash of \"contig<TAB>position\" (seeded with -s, default " << stable_hash_default_seed << ")\n";
+  std::cerr << "\tfalls at or below proportion_to_keep * 2^64. The result is the same on any host and for any thread count.\n";
+  std::cerr << "\t-b\tPile up an indexed BAM directly, formatting only the selected columns (threads work on separate contigs)\n";
+  std::cerr << "\t-f\tfaidx-indexed reference, for the reference base column and ./, matches (otherwise N)\n";
+  std::cerr << "\t-Q, -q, -d, -A\tAs for samtools mpileup (defaults 13, 0, 8000, off)\n";
+  exit(1);
+
+}
+
+int main(int argc, char** argv) {
+
+  int nthreads = 1;
+  uint64_t seed = stable_hash_default_seed;
+
+  BamPileupOptions bamopts;
+  bamopts.bam_name = 0;
+  bamopts.ref_name = 0;
+  bamopts.min_baseq = 13;
+  bamopts.min_mapq = 0;
+  bamopts.max_depth = 8000;
+  bamopts.count_orphans = false;
+
+  int c;
+  while((c = getopt(argc, argv, "@:s:b:f:Q:q:d:A")) >= 0) {
+    switch(c) {
+    case '@':
+      nthreads = atoi(optarg);
+      break;
+    case 's':
+      seed = strtoull(optarg, 0, 0);
+      break;
+    case 'b':
+      bamopts.bam_name = optarg;
+      break;
+    case 'f':
+      bamopts.ref_name = optarg;
+      break;
+    case 'Q':
+      bamopts.min_baseq = atoi(optarg);
+      break;
+    case 'q':
+      bamopts.min_mapq = atoi(optarg);
+      break;
+    case 'd':
+      bamopts.max_depth = atoi(optarg);
+      break;
+    case 'A':
+      bamopts.count_orphans = true;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(optind + 1 != argc || nthreads < 1)
+    usage();
+
+  tool_stats_init("sample_pileup");
+
+  std::string propstr = argv[optind];
+  double prop = std::stod(propstr);
+  uint64_t hash_threshold = stable_hash_threshold(prop);
+  std::cerr << "Keeping records with hash <= " << hash_threshold << "\n";
+
+  if(bamopts.bam_name) {
+    bamopts.hash_threshold = hash_threshold;
+    bamopts.seed = seed;
+    sample_bam(&bamopts, nthreads);
+  }
+  else
+    sample_text(nthreads, hash_threshold, seed);
+
+  if(fflush(stdout)) {
+    perror("Failed to write stdout");
+    exit(1);
   }
 
+  tool_stats_finish();
   return 0;
 
 }
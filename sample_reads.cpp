@@ -0,0 +1,187 @@
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/thread_pool.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "stable_hash.h"
+#include "tool_stats.h"
+#include "big_hfile.h"
+#include "output_level.h"
+#include "output_index.h"
+
+// Sample reads by a seeded XXH64 hash of the qname, as sample_pileup samples positions, so both
+// mates and every secondary / supplementary hit of a read are kept or dropped together, and a
+// sample is the same on any host and for any thread count. Several proportions can be drawn in
+// one pass, each to its own output; smaller samples are subsets of larger ones with the same seed.
+
+struct SampleOutput {
+
+  std::string name;
+  double prop;
+  uint64_t threshold;
+  htsFile* hf;
+  OutputIndexer indexer;
+  uint64_t kept;
+
+};
+
+static void usage() {
+
+  fprintf(stderr, "Usage: sample_reads [-@ threads] [-s seed] in.xam proportion:out.bam [proportion:out.bam ...]\n");
+  fprintf(stderr, "\tKeeps records whose XXH64 hash of the qname (seeded with -s, default %llu)\n", (unsigned long long)stable_hash_default_seed);
+  fprintf(stderr, "\tfalls at or below proportion * 2^64, writing each proportion's sample to its own BAM (- for stdout).\n");
+  fprintf(stderr, "\tCoordinate-sorted samples written to files are indexed as they're written.\n");
+  fprintf(stderr, "\t-@\tThreads for BGZF decoding and encoding, shared by the input and every output\n");
+  exit(1);
+
+}
+
+int main(int argc, char** argv) {
+
+  int nthreads = 1;
+  uint64_t seed = stable_hash_default_seed;
+
+  int c;
+  while((c = getopt(argc, argv, "@:s:")) >= 0) {
+    switch(c) {
+    case '@':
+      nthreads = atoi(optarg);
+      break;
+    case 's':
+      seed = strtoull(optarg, 0, 0);
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(argc - optind < 2)
+    usage();
+
+  const char* in_name = argv[optind];
+
+  std::vector<SampleOutput> outputs(argc - optind - 1);
+  for(size_t i = 0; i < outputs.size(); ++i) {
+
+    const char* arg = argv[optind + 1 + i];
+    const char* colon = strchr(arg, ':');
+    char* end;
+    double prop = colon ? strtod(arg, &end) : -1;
+    if(!colon || end != colon || !colon[1] || prop < 0 || prop > 1) {
+      fprintf(stderr, "Bad output %s (expected proportion:out.bam, with proportion between 0 and 1)\n", arg);
+      exit(1);
+    }
+
+    outputs[i].name = colon + 1;
+    outputs[i].prop = prop;
+    outputs[i].threshold = stable_hash_threshold(prop);
+    outputs[i].kept = 0;
+
+  }
+
+  tool_stats_init("sample_reads");
+
+  htsFile* hf = hts_open_tuned(in_name, "r");
+  if(!hf) {
+    fprintf(stderr, "Failed to open %s\n", in_name);
+    exit(1);
+  }
+
+  htsThreadPool pool = { 0, 0 };
+  if(nthreads > 1) {
+    pool.pool = hts_tpool_init(nthreads);
+    if(!pool.pool) {
+      fprintf(stderr, "Failed to start thread pool\n");
+      exit(1);
+    }
+    hts_set_thread_pool(hf, &pool);
+  }
+
+  bam_hdr_t* header = sam_hdr_read(hf);
+  if(!header) {
+    fprintf(stderr, "Failed to read header from %s\n", in_name);
+    exit(1);
+  }
+
+  for(size_t i = 0; i < outputs.size(); ++i) {
+
+    SampleOutput& out = outputs[i];
+    out.hf = hts_open_output(out.name.c_str(), "wb");
+    if(!out.hf) {
+      fprintf(stderr, "Failed to open %s\n", out.name.c_str());
+      exit(1);
+    }
+    if(pool.pool)
+      hts_set_thread_pool(out.hf, &pool);
+    if(sam_hdr_write(out.hf, header)) {
+      fprintf(stderr, "Failed to write header to %s\n", out.name.c_str());
+      exit(1);
+    }
+    out.indexer.begin(out.hf, out.name.c_str(), header);
+
+  }
+
+  bam1_t* rec = bam_init1();
+  uint64_t total = 0;
+  int ret;
+
+  while((ret = tool_stats_read1(hf, header, rec)) >= 0) {
+
+    ++total;
+
+    // The qname in place: l_qname counts its NUL and any padding after it.
+    uint64_t hash = stable_hash(bam_get_qname(rec), rec->core.l_qname - rec->core.l_extranul - 1, seed);
+
+    for(size_t i = 0; i < outputs.size(); ++i) {
+
+      SampleOutput& out = outputs[i];
+      if(hash > out.threshold)
+	continue;
+
+      out.indexer.check(rec);
+      if(output_write1(out.hf, header, rec) < 0) {
+	fprintf(stderr, "Failed to write to %s\n", out.name.c_str());
+	exit(1);
+      }
+      ++out.kept;
+
+    }
+
+  }
+
+  if(ret < -1) {
+    fprintf(stderr, "Failed to read %s\n", in_name);
+    exit(1);
+  }
+
+  for(size_t i = 0; i < outputs.size(); ++i) {
+
+    SampleOutput& out = outputs[i];
+    out.indexer.save();
+    if(hts_close_output(out.hf)) {
+      fprintf(stderr, "Failed to close %s\n", out.name.c_str());
+      exit(1);
+    }
+    fprintf(stderr, "%s: kept %llu of %llu records (%.2f%%, asked for %g%% of reads)\n", out.name.c_str(),
+	    (unsigned long long)out.kept, (unsigned long long)total, total ? 100.0 * out.kept / total : 0.0, 100 * out.prop);
+
+  }
+
+  bam_destroy1(rec);
+  bam_hdr_destroy(header);
+  hts_close(hf);
+  if(pool.pool)
+    hts_tpool_destroy(pool.pool);
+
+  tool_stats_finish();
+  return 0;
+
+}
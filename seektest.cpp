@@ -9,34 +9,272 @@
 #include <cstdint>
 #include <random>
 #include <functional>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 
-int main(int argc, char** argv) {
+// Besides checking that seeking works, -b runs a random-access benchmark: seek latency
+// percentiles for several access patterns, with and without readahead threads and across BGZF
+// cache sizes, then aggregate throughput with several concurrent reader handles.
+
+typedef std::chrono::steady_clock bench_clock;
+
+static void usage() {
+
+  std::cerr << "Usage: seektest samorbamfile [readahead]\n";
+  std::cerr << "       seektest -b [-n seeks] [-c cache_bytes,...] [-t readahead_threads] [-j handles,...] bamfile\n";
+  std::cerr << "\t-b\tBenchmark random, strided and clustered seeks, reporting latency percentiles\n";
+  std::cerr << "\t-n\tSeeks per configuration (default 10000)\n";
+  std::cerr << "\t-c\tComma-separated bgzf_set_cache_size values to try (default 0,1048576,16777216,268435456)\n";
+  std::cerr << "\t-t\tThreads to use for the readahead configurations (default 2)\n";
+  std::cerr << "\t-j\tComma-separated concurrent handle counts for the throughput test (default 1,2,4,8)\n";
+  exit(1);
+
+}
+
+static std::vector<long> parse_list(const char* arg) {
 
-  if(argc < 2) {
-    std::cerr << "Usage: seektest samorbamfile [readahead]\n";
+  std::vector<long> ret;
+  const char* p = arg;
+  while(*p) {
+    char* end;
+    ret.push_back(strtol(p, &end, 0));
+    if(end == p)
+      usage();
+    p = *end == ',' ? end + 1 : end;
+  }
+  return ret;
+
+}
+
+static htsFile* open_or_die(const char* fname, int nthreads, long cache_size) {
+
+  htsFile* hfi = hts_open(fname, "r");
+  if(!hfi) {
+    std::cerr << "Failed to open " << fname << "\n";
     exit(1);
   }
 
-  htsFile* hfi = hts_open(argv[1], "r");
-  if(argc >= 3 && std::string(argv[2]) == "readahead") {
+  if(nthreads || cache_size) {
 
     if(!hfi->is_bin) {
-      std::cerr << "Readahead currently only usable on BAM files\n";
+      std::cerr << "Readahead and caching currently only usable on BAM files\n";
       exit(1);
     }
 
-    hts_set_threads(hfi, 2);
-    bgzf_set_cache_size(hfi->fp.bgzf, BGZF_MAX_BLOCK_SIZE * 2 * 256);
+    if(nthreads)
+      hts_set_threads(hfi, nthreads);
+    if(cache_size)
+      bgzf_set_cache_size(hfi->fp.bgzf, cache_size);
+
+  }
+
+  return hfi;
+
+}
+
+// Read a record at a known offset and check it's the one we expected.
+
+static void seek_and_check(htsFile* hfi, bam_hdr_t* header, bam1_t* rec, int64_t offset, const std::string& expected, int attempt) {
+
+  if(bgzf_seek(hfi->fp.bgzf, offset, SEEK_SET) < 0 || sam_read1(hfi, header, rec) < 0) {
+    std::cerr << "Seek or read failed at try " << attempt << "\n";
+    exit(1);
+  }
+
+  if(expected != bam_get_qname(rec)) {
+    std::cerr << "Test failed at try " << attempt << ": expected " << expected << " but got " << bam_get_qname(rec) << "\n";
+    exit(1);
+  }
+
+}
+
+enum seek_pattern {
+
+  pattern_random,
+  pattern_strided,
+  pattern_clustered
+
+};
+
+static const char* pattern_names[] = { "random", "strided", "clustered" };
+
+static std::vector<int> make_pattern(seek_pattern pattern, int nrecs, int nseeks, unsigned seed) {
+
+  std::default_random_engine generator(seed);
+  std::uniform_int_distribution<int> distribution(0, nrecs - 1);
+  std::vector<int> ret;
+  ret.reserve(nseeks);
+
+  switch(pattern) {
+
+  case pattern_random:
+    for(int i = 0; i < nseeks; ++i)
+      ret.push_back(distribution(generator));
+    break;
+
+  case pattern_strided:
+    {
+      int stride = std::max(1, nrecs / nseeks);
+      for(int i = 0; i < nseeks; ++i)
+	ret.push_back((int)(((int64_t)i * stride) % nrecs));
+    }
+    break;
+
+  case pattern_clustered:
+    {
+      // Bursts of 16 seeks within 1000 records of a random centre, as index-driven
+      // tools do when visiting a region.
+      std::uniform_int_distribution<int> jitter(-1000, 1000);
+      int centre = 0;
+      for(int i = 0; i < nseeks; ++i) {
+	if(i % 16 == 0)
+	  centre = distribution(generator);
+	ret.push_back(std::min(nrecs - 1, std::max(0, centre + jitter(generator))));
+      }
+    }
+    break;
 
   }
 
+  return ret;
+
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+
+  size_t idx = (size_t)(p * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(idx, sorted.size() - 1)];
+
+}
+
+static void bench_latency(const char* fname, seek_pattern pattern, int nthreads, long cache_size, int nseeks,
+			  const std::vector<int64_t>& offsets, const std::vector<std::string>& qnames) {
+
+  htsFile* hfi = open_or_die(fname, nthreads, cache_size);
+  bam_hdr_t* header = sam_hdr_read(hfi);
+  bam1_t* rec = bam_init1();
+
+  std::vector<int> recs = make_pattern(pattern, qnames.size(), nseeks, 1);
+  std::vector<double> latencies;
+  latencies.reserve(recs.size());
+
+  for(int i = 0, ilim = recs.size(); i != ilim; ++i) {
+
+    bench_clock::time_point start = bench_clock::now();
+    seek_and_check(hfi, header, rec, offsets[recs[i]], qnames[recs[i]], i);
+    latencies.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - start).count());
+
+  }
+
+  double total = 0;
+  for(int i = 0, ilim = latencies.size(); i != ilim; ++i)
+    total += latencies[i];
+  std::sort(latencies.begin(), latencies.end());
+
+  printf("%-10s %9d %12ld %10.1f %10.1f %10.1f %10.1f\n", pattern_names[pattern], nthreads, cache_size,
+	 percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999), total / latencies.size());
+  fflush(stdout);
+
+  bam_destroy1(rec);
+  bam_hdr_destroy(header);
+  hts_close(hfi);
+
+}
+
+static void concurrent_reader(const char* fname, int nseeks, unsigned seed, const std::vector<int64_t>* offsets, const std::vector<std::string>* qnames) {
+
+  htsFile* hfi = open_or_die(fname, 0, 0);
+  bam_hdr_t* header = sam_hdr_read(hfi);
+  bam1_t* rec = bam_init1();
+
+  std::vector<int> recs = make_pattern(pattern_random, qnames->size(), nseeks, seed);
+  for(int i = 0, ilim = recs.size(); i != ilim; ++i)
+    seek_and_check(hfi, header, rec, (*offsets)[recs[i]], (*qnames)[recs[i]], i);
+
+  bam_destroy1(rec);
+  bam_hdr_destroy(header);
+  hts_close(hfi);
+
+}
+
+static void bench_concurrent(const char* fname, int nhandles, int nseeks, const std::vector<int64_t>& offsets, const std::vector<std::string>& qnames) {
+
+  bench_clock::time_point start = bench_clock::now();
+
+  std::vector<std::thread> readers;
+  for(int i = 0; i < nhandles; ++i)
+    readers.push_back(std::thread(concurrent_reader, fname, nseeks, i + 1, &offsets, &qnames));
+  for(int i = 0; i < nhandles; ++i)
+    readers[i].join();
+
+  double secs = std::chrono::duration<double>(bench_clock::now() - start).count();
+  printf("%7d %12d %12.3f %14.0f\n", nhandles, nseeks * nhandles, secs, (nseeks * nhandles) / secs);
+  fflush(stdout);
+
+}
+
+int main(int argc, char** argv) {
+
+  bool bench = false;
+  int nseeks = 10000;
+  int readahead_threads = 2;
+  std::vector<long> cache_sizes;
+  std::vector<long> handle_counts;
+
+  int c;
+  while((c = getopt(argc, argv, "bn:c:t:j:")) >= 0) {
+    switch(c) {
+    case 'b':
+      bench = true;
+      break;
+    case 'n':
+      nseeks = atoi(optarg);
+      break;
+    case 'c':
+      cache_sizes = parse_list(optarg);
+      break;
+    case 't':
+      readahead_threads = atoi(optarg);
+      break;
+    case 'j':
+      handle_counts = parse_list(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(optind >= argc || nseeks < 1)
+    usage();
+
+  const char* fname = argv[optind];
+  bool readahead = optind + 1 < argc && std::string(argv[optind + 1]) == "readahead";
+
+  if(cache_sizes.empty()) {
+    cache_sizes.push_back(0);
+    cache_sizes.push_back(1 << 20);
+    cache_sizes.push_back(16 << 20);
+    cache_sizes.push_back(256 << 20);
+  }
+
+  if(handle_counts.empty()) {
+    handle_counts.push_back(1);
+    handle_counts.push_back(2);
+    handle_counts.push_back(4);
+    handle_counts.push_back(8);
+  }
+
+  htsFile* hfi = open_or_die(fname, readahead ? 2 : 0, readahead ? BGZF_MAX_BLOCK_SIZE * 2 * 256 : 0);
+
   bam_hdr_t* header = sam_hdr_read(hfi);
   if(!header) {
-    std::cerr << "Failed to read input header\nn";
+    std::cerr << "Failed to read input header\n";
     exit(1);
   }
 
@@ -49,35 +287,55 @@ int main(int argc, char** argv) {
   offsets.push_back(bgzf_tell(hfi->fp.bgzf));
 
   while(sam_read1(hfi, header, &rec) >= 0) {
-   
+
     qnames.push_back(bam_get_qname(&rec));
-    offsets.push_back(bgzf_tell(hfi->fp.bgzf));    
-    
+    offsets.push_back(bgzf_tell(hfi->fp.bgzf));
+
   }
 
   std::cerr << "Read " << qnames.size() << " records\n";
 
-  std::default_random_engine generator;
-  std::uniform_int_distribution<int> distribution(0, qnames.size() - 1);
-  auto pickrec = std::bind(distribution, generator);
+  if(qnames.empty()) {
+    std::cerr << "Nothing to seek to\n";
+    exit(1);
+  }
 
-  for(int i = 0; i < 10000; ++i) {
+  if(!bench) {
 
-    int getrec = pickrec();
-    bgzf_seek(hfi->fp.bgzf, offsets[getrec], SEEK_SET);
-    sam_read1(hfi, header, &rec);
-    std::string qname(bam_get_qname(&rec));
-    if(qname != qnames[getrec]) {
+    std::default_random_engine generator;
+    std::uniform_int_distribution<int> distribution(0, qnames.size() - 1);
+    auto pickrec = std::bind(distribution, generator);
 
-      std::cerr << "Test failed at try " << i << ": expected " << qnames[getrec] << " but got " << qname << "\n";
-      exit(1);
+    for(int i = 0; i < 10000; ++i) {
+
+      int getrec = pickrec();
+      seek_and_check(hfi, header, &rec, offsets[getrec], qnames[getrec], i);
 
     }
 
-  }
+    std::cerr << "All tests passed\n";
 
-  std::cerr << "All tests passed\n";
+    hts_close(hfi);
+    return 0;
+
+  }
 
   hts_close(hfi);
 
+  printf("%-10s %9s %12s %10s %10s %10s %10s\n", "pattern", "readahead", "cache_bytes", "p50_us", "p99_us", "p999_us", "mean_us");
+
+  for(int pattern = pattern_random; pattern <= pattern_clustered; ++pattern) {
+    for(int ra = 0; ra < 2; ++ra) {
+      for(int i = 0, ilim = cache_sizes.size(); i != ilim; ++i)
+	bench_latency(fname, (seek_pattern)pattern, ra ? readahead_threads : 0, cache_sizes[i], nseeks, offsets, qnames);
+    }
+  }
+
+  printf("\n%7s %12s %12s %14s\n", "handles", "seeks", "seconds", "seeks_per_sec");
+
+  for(int i = 0, ilim = handle_counts.size(); i != ilim; ++i)
+    bench_concurrent(fname, handle_counts[i], nseeks, offsets, qnames);
+
+  return 0;
+
 }
@@ -0,0 +1,1007 @@
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/thread_pool.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "qname_cmp.h"
+#include "tool_stats.h"
+#include "big_hfile.h"
+#include "output_level.h"
+
+// Sort a ?AM by qname, in samtools sort -n or Picard order, for bamcmp, filter_hits and
+// contig_pileup. Each record's qname is turned into a binary key (qname_sort_key) as it's read,
+// so sorting is an MSD radix sort over key bytes rather than strnum_cmp calls. Records and keys
+// are packed into a batch until it reaches half the memory limit; full batches are sorted and
+// spilled as BGZF runs on a background thread while the next one fills, and the runs are then
+// k-way merged, on several threads, straight into the output (after merging groups of them into
+// longer runs first, if there are too many to read at once within the memory limit). Writing uncompressed BAM to stdout
+// (-u) lets the consumer start on the merge's output without a sorted file ever being written.
+// Equal keys keep their input order.
+
+static void usage() {
+
+  fprintf(stderr, "Usage: sort_qname [-n | -N] [-@ threads] [-m mem] [-T tmpprefix] [-l level | -u] [-o out.bam] in.xam\n");
+  fprintf(stderr, "\t-n\tSort as per samtools sort -n (mixed string / integer; the default)\n");
+  fprintf(stderr, "\t-N\tSort as per Picard / htsjdk (strcmp)\n");
+  fprintf(stderr, "\t-@\tThreads for sorting, merging and BGZF decoding / encoding\n");
+  fprintf(stderr, "\t-m\tMemory for records in flight and runs being merged, e.g. 2G (default 1G); beyond it, sorted runs spill to disk\n");
+  fprintf(stderr, "\t-T\tPrefix for spilled runs (default out.bam.tmp, or /tmp/sort_qname.PID when writing to stdout)\n");
+  fprintf(stderr, "\t-l\tOutput compression level (default as for hts_open)\n");
+  fprintf(stderr, "\t-u\tUncompressed output, for piping into another tool\n");
+  fprintf(stderr, "\t-o\tOutput file (default stdout)\n");
+  exit(1);
+
+}
+
+// A batch of records packed one after another, each as its fixed fields, data and sort key, with
+// an entry per record pointing at its key for the radix sort. Entries keep the offset of their
+// record, which also orders records by input order.
+
+struct PackedHeader {
+
+  bam1_core_t core;
+  uint32_t l_data;
+  uint32_t key_len;
+
+};
+
+struct SortEntry {
+
+  const uint8_t* key;
+  uint64_t off;
+  uint32_t key_len;
+
+};
+
+class SortBatch {
+
+  uint8_t* arena;
+  size_t arena_len, arena_cap;
+
+public:
+
+  std::vector<SortEntry> entries;
+
+  SortBatch() : arena(0), arena_len(0), arena_cap(0) {}
+
+  ~SortBatch() {
+    free(arena);
+  }
+
+  // Bytes held, counting the radix sort's scratch copy of the entries.
+  size_t bytes() const {
+    return arena_len + 2 * entries.size() * sizeof(SortEntry);
+  }
+
+  static size_t packed_size(const bam1_t* rec, size_t key_len) {
+    return (sizeof(PackedHeader) + rec->l_data + key_len + 7) & ~(size_t)7;
+  }
+
+  void add(const bam1_t* rec, const uint8_t* key, size_t key_len) {
+
+    size_t need = packed_size(rec, key_len);
+    if(arena_len + need > arena_cap) {
+      arena_cap = std::max(arena_cap * 2, arena_len + need);
+      arena = (uint8_t*)realloc(arena, arena_cap);
+      if(!arena) {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+      }
+    }
+
+    PackedHeader h;
+    h.core = rec->core;
+    h.l_data = rec->l_data;
+    h.key_len = key_len;
+    uint8_t* p = arena + arena_len;
+    memcpy(p, &h, sizeof(h));
+    memcpy(p + sizeof(h), rec->data, rec->l_data);
+    memcpy(p + sizeof(h) + rec->l_data, key, key_len);
+
+    SortEntry e;
+    e.key = 0;
+    e.off = arena_len;
+    e.key_len = key_len;
+    entries.push_back(e);
+
+    arena_len += need;
+
+  }
+
+  void clear() {
+    arena_len = 0;
+    entries.clear();
+  }
+
+  // Clear, and give the memory back too, for a batch that won't be filled again.
+  void release() {
+    clear();
+    free(arena);
+    arena = 0;
+    arena_cap = 0;
+    std::vector<SortEntry>().swap(entries);
+  }
+
+  // Point the entries at their keys, now that the arena has stopped moving.
+  void fix_keys() {
+
+    for(size_t i = 0, ilim = entries.size(); i != ilim; ++i) {
+      const PackedHeader* h = (const PackedHeader*)(arena + entries[i].off);
+      entries[i].key = arena + entries[i].off + sizeof(PackedHeader) + h->l_data;
+    }
+
+  }
+
+  // Make rec a view of entry i's record, without copying it. rec must not be bam_destroy1'd.
+  void view(size_t i, bam1_t* rec) const {
+
+    const uint8_t* p = arena + entries[i].off;
+    const PackedHeader* h = (const PackedHeader*)p;
+    memset(rec, 0, sizeof(*rec));
+    rec->core = h->core;
+    rec->l_data = rec->m_data = h->l_data;
+    rec->data = (uint8_t*)p + sizeof(PackedHeader);
+
+  }
+
+};
+
+// MSD radix sort of entries by key from byte depth on, with shorter keys first and ties in input
+// order. Buckets are sorted by insertion below this size.
+static const size_t radix_min_bucket = 32;
+
+static inline bool entry_less(const SortEntry& a, const SortEntry& b, size_t depth) {
+
+  size_t la = a.key_len - depth, lb = b.key_len - depth;
+  int t = memcmp(a.key + depth, b.key + depth, std::min(la, lb));
+  if(t)
+    return t < 0;
+  if(la != lb)
+    return la < lb;
+  return a.off < b.off;
+
+}
+
+static void insertion_sort(SortEntry* a, size_t n, size_t depth) {
+
+  for(size_t i = 1; i < n; ++i) {
+    SortEntry e = a[i];
+    size_t j = i;
+    for(; j && entry_less(e, a[j - 1], depth); --j)
+      a[j] = a[j - 1];
+    a[j] = e;
+  }
+
+}
+
+// One distribution pass over a[0, n) at the first depth where keys differ, leaving bucket b (0 for
+// keys that have ended, else 1 + the key byte) at a[starts[b], starts[b + 1]). Returns false if
+// every key is identical, so there's nothing left to sort.
+static bool radix_pass(SortEntry* a, SortEntry* tmp, size_t n, size_t& depth, size_t starts[258]) {
+
+  size_t counts[257];
+  for(;; ++depth) {
+
+    memset(counts, 0, sizeof(counts));
+    for(size_t i = 0; i < n; ++i)
+      ++counts[a[i].key_len > depth ? a[i].key[depth] + 1 : 0];
+
+    if(counts[0] == n)
+      return false;
+    int b = 1;
+    while(!counts[b])
+      ++b;
+    if(counts[b] != n)
+      break;
+
+  }
+
+  starts[0] = 0;
+  for(int b = 0; b < 257; ++b)
+    starts[b + 1] = starts[b] + counts[b];
+
+  size_t next[257];
+  memcpy(next, starts, sizeof(next));
+  for(size_t i = 0; i < n; ++i)
+    tmp[next[a[i].key_len > depth ? a[i].key[depth] + 1 : 0]++] = a[i];
+  memcpy(a, tmp, n * sizeof(SortEntry));
+  return true;
+
+}
+
+static void radix_sort(SortEntry* a, SortEntry* tmp, size_t n, size_t depth) {
+
+  if(n < radix_min_bucket) {
+    insertion_sort(a, n, depth);
+    return;
+  }
+
+  size_t starts[258];
+  if(!radix_pass(a, tmp, n, depth, starts))
+    return;
+
+  // Bucket 0's keys have all ended, so they're equal and already in input order.
+  for(int b = 1; b < 257; ++b) {
+    size_t len = starts[b + 1] - starts[b];
+    if(len > 1)
+      radix_sort(a + starts[b], tmp + starts[b], len, depth + 1);
+  }
+
+}
+
+struct RadixTask {
+
+  size_t start, n, depth;
+
+  bool operator<(const RadixTask& other) const {
+    return n > other.n;
+  }
+
+};
+
+// Split a[0, n) into buckets of at most max_task entries, to be sorted independently.
+static void radix_split(SortEntry* a, SortEntry* tmp, size_t start, size_t n, size_t depth, size_t max_task, std::vector<RadixTask>& tasks) {
+
+  if(n <= max_task) {
+    RadixTask t = { start, n, depth };
+    tasks.push_back(t);
+    return;
+  }
+
+  size_t starts[258];
+  if(!radix_pass(a + start, tmp + start, n, depth, starts))
+    return;
+
+  for(int b = 1; b < 257; ++b) {
+    size_t len = starts[b + 1] - starts[b];
+    if(len > 1)
+      radix_split(a, tmp, start + starts[b], len, depth + 1, max_task, tasks);
+  }
+
+}
+
+static void sort_entries(std::vector<SortEntry>& entries, int nthreads) {
+
+  StageTimer timer(tool_stage_compute);
+
+  size_t n = entries.size();
+  if(n < 2)
+    return;
+  std::vector<SortEntry> tmp(n);
+  if(nthreads <= 1 || n < 65536) {
+    radix_sort(&entries[0], &tmp[0], n, 0);
+    return;
+  }
+
+  // Split into several buckets per thread, then hand them out largest first.
+  std::vector<RadixTask> tasks;
+  radix_split(&entries[0], &tmp[0], 0, n, 0, std::max(n / (8 * nthreads), radix_min_bucket), tasks);
+  std::sort(tasks.begin(), tasks.end());
+
+  std::atomic<size_t> next_task(0);
+  std::vector<std::thread> threads;
+  for(int i = 0; i < nthreads; ++i) {
+    threads.push_back(std::thread([&]() {
+	  size_t t;
+	  while((t = next_task.fetch_add(1)) < tasks.size())
+	    radix_sort(&entries[tasks[t].start], &tmp[tasks[t].start], tasks[t].n, tasks[t].depth);
+	}));
+  }
+  for(size_t i = 0; i < threads.size(); ++i)
+    threads[i].join();
+
+}
+
+// The input header with @HD saying it's queryname-sorted.
+static bam_hdr_t* queryname_header(const bam_hdr_t* header) {
+
+  std::string htext = header->text ? std::string(header->text, header->l_text) : "";
+  std::string out;
+  std::string version = "1.6";
+
+  size_t linestart = 0;
+  while(linestart < htext.size()) {
+
+    size_t lineend = htext.find('\n', linestart);
+    if(lineend == std::string::npos)
+      lineend = htext.size();
+    std::string line = htext.substr(linestart, lineend - linestart);
+    linestart = lineend + 1;
+
+    if(!line.compare(0, 4, "@HD\t")) {
+      size_t vn = line.find("\tVN:");
+      if(vn != std::string::npos) {
+	vn += 4;
+	version = line.substr(vn, line.find('\t', vn) - vn);
+      }
+      continue;
+    }
+
+    if(line.empty())
+      continue;
+
+    out += line + "\n";
+
+  }
+
+  out = "@HD\tVN:" + version + "\tSO:queryname\n" + out;
+
+  bam_hdr_t* newheader = bam_hdr_dup(header);
+  free(newheader->text);
+  newheader->text = strdup(out.c_str());
+  newheader->l_text = out.length();
+  return newheader;
+
+}
+
+// Records in key order, from a spilled run, the in-memory batch or a merge of other sources.
+// next() loads the next record and its key, valid until the following call, or returns false at
+// the end.
+
+class RecordSource {
+
+public:
+
+  bam1_t* rec;
+  const uint8_t* key;
+  size_t key_len;
+
+  RecordSource() : rec(0), key(0), key_len(0) {}
+  virtual ~RecordSource() {}
+  virtual bool next() = 0;
+
+};
+
+static bool key_less(const RecordSource* a, const RecordSource* b) {
+
+  int t = memcmp(a->key, b->key, std::min(a->key_len, b->key_len));
+  return t ? t < 0 : a->key_len < b->key_len;
+
+}
+
+// Many runs are open at once, so each is read with htslib's small default buffers, no readahead
+// thread and no share of the thread pool (whose BGZF reader would start a thread per run too);
+// merge_sources spreads the decoding over threads instead. run_read_bytes is roughly what one
+// costs: the hFILE buffer, BGZF's compressed and uncompressed blocks and the current record.
+
+static const size_t run_read_bytes = 256 * 1024;
+
+class RunSource : public RecordSource {
+
+  std::string fname;
+  htsFile* hf;
+  bam_hdr_t* header;
+  qname_order order;
+  std::vector<uint8_t> keybuf;
+
+public:
+
+  RunSource(const std::string& _fname, qname_order _order) : fname(_fname), order(_order) {
+
+    hf = hts_open(fname.c_str(), "r");
+    if(!hf) {
+      fprintf(stderr, "Failed to open %s\n", fname.c_str());
+      exit(1);
+    }
+    header = sam_hdr_read(hf);
+    if(!header) {
+      fprintf(stderr, "Failed to read header from %s\n", fname.c_str());
+      exit(1);
+    }
+    // Open from here on, so it goes away however we exit.
+    unlink(fname.c_str());
+    rec = bam_init1();
+    keybuf.resize(qname_sort_key_bound(255));
+
+  }
+
+  ~RunSource() {
+    bam_destroy1(rec);
+    bam_hdr_destroy(header);
+    hts_close(hf);
+  }
+
+  bool next() {
+
+    int ret = sam_read1(hf, header, rec);
+    if(ret < -1) {
+      fprintf(stderr, "Failed to read %s\n", fname.c_str());
+      exit(1);
+    }
+    if(ret < 0)
+      return false;
+
+    const char* qname = bam_get_qname(rec);
+    size_t bound = qname_sort_key_bound(strlen(qname));
+    if(keybuf.size() < bound)
+      keybuf.resize(bound);
+    key_len = qname_sort_key(order, qname, rec->core.flag, &keybuf[0]);
+    key = &keybuf[0];
+    return true;
+
+  }
+
+};
+
+class BatchSource : public RecordSource {
+
+  const SortBatch& batch;
+  size_t i;
+  bam1_t view;
+
+public:
+
+  BatchSource(const SortBatch& _batch) : batch(_batch), i(0) {
+    rec = &view;
+  }
+
+  bool next() {
+
+    if(i == batch.entries.size())
+      return false;
+    batch.view(i, &view);
+    key = batch.entries[i].key;
+    key_len = batch.entries[i].key_len;
+    ++i;
+    return true;
+
+  }
+
+};
+
+// Heap merge; equal keys come from earlier sources first, and sources are in input order.
+
+class MergeSource : public RecordSource {
+
+  std::vector<RecordSource*> sources;
+  std::vector<int> heap;
+  int current;
+
+  struct HeapCmp {
+
+    const std::vector<RecordSource*>* sources;
+
+    // std::*_heap keep the greatest element at the front, so this is "comes later".
+    bool operator()(int a, int b) const {
+      RecordSource* sa = (*sources)[a];
+      RecordSource* sb = (*sources)[b];
+      if(key_less(sb, sa))
+	return true;
+      if(key_less(sa, sb))
+	return false;
+      return a > b;
+    }
+
+  } heapcmp;
+
+public:
+
+  MergeSource(const std::vector<RecordSource*>& _sources) : sources(_sources), current(-1) {
+    heapcmp.sources = &sources;
+  }
+
+  ~MergeSource() {
+    for(size_t i = 0; i < sources.size(); ++i)
+      delete sources[i];
+  }
+
+  bool next() {
+
+    if(current == -1) {
+      for(int i = 0, ilim = sources.size(); i != ilim; ++i) {
+	if(sources[i]->next())
+	  heap.push_back(i);
+      }
+      std::make_heap(heap.begin(), heap.end(), heapcmp);
+    }
+    else if(sources[current]->next())
+      std::push_heap(heap.begin(), heap.end(), heapcmp);
+    else
+      heap.pop_back();
+
+    if(heap.empty())
+      return false;
+
+    std::pop_heap(heap.begin(), heap.end(), heapcmp);
+    current = heap.back();
+    rec = sources[current]->rec;
+    key = sources[current]->key;
+    key_len = sources[current]->key_len;
+    return true;
+
+  }
+
+};
+
+// Runs another source on its own thread, passing records over in batches, so that several runs'
+// decoding, key building and merging go on at once.
+
+class ThreadedSource : public RecordSource {
+
+  struct Batch {
+
+    std::vector<bam1_t*> recs;
+    std::vector<uint8_t> keys;
+    std::vector<size_t> key_ends;
+    size_t n;
+    bool last;
+
+    Batch() : n(0), last(false) {}
+
+    ~Batch() {
+      for(size_t i = 0; i < recs.size(); ++i)
+	bam_destroy1(recs[i]);
+    }
+
+  };
+
+  static const size_t batch_size = 4096;
+
+  RecordSource* source;
+  Batch batches[3];
+  std::deque<Batch*> full, empty;
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::thread thread;
+  Batch* cur;
+  size_t pos;
+
+  void produce() {
+
+    bool more = true;
+    while(more) {
+
+      Batch* b;
+      {
+	std::unique_lock<std::mutex> lock(mutex);
+	while(empty.empty())
+	  cond.wait(lock);
+	b = empty.front();
+	empty.pop_front();
+      }
+
+      b->n = 0;
+      b->keys.clear();
+      b->key_ends.clear();
+      while(b->n < batch_size && (more = source->next())) {
+	if(b->recs.size() == b->n)
+	  b->recs.push_back(bam_init1());
+	if(!bam_copy1(b->recs[b->n], source->rec)) {
+	  fprintf(stderr, "Out of memory\n");
+	  exit(1);
+	}
+	b->keys.insert(b->keys.end(), source->key, source->key + source->key_len);
+	b->key_ends.push_back(b->keys.size());
+	++b->n;
+      }
+      b->last = !more;
+
+      std::lock_guard<std::mutex> lock(mutex);
+      full.push_back(b);
+      cond.notify_all();
+
+    }
+
+  }
+
+  void next_batch() {
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if(cur) {
+      empty.push_back(cur);
+      cond.notify_all();
+    }
+    while(full.empty())
+      cond.wait(lock);
+    cur = full.front();
+    full.pop_front();
+    pos = 0;
+
+  }
+
+public:
+
+  ThreadedSource(RecordSource* _source) : source(_source), cur(0), pos(0) {
+
+    for(int i = 0; i < 3; ++i)
+      empty.push_back(&batches[i]);
+    thread = std::thread(&ThreadedSource::produce, this);
+
+  }
+
+  ~ThreadedSource() {
+
+    // The producer stops once it's passed over its last batch; drain until then.
+    while(!(cur && cur->last))
+      next_batch();
+    thread.join();
+    delete source;
+
+  }
+
+  bool next() {
+
+    while(!cur || pos == cur->n) {
+      if(cur && cur->last)
+	return false;
+      next_batch();
+    }
+
+    rec = cur->recs[pos];
+    size_t start = pos ? cur->key_ends[pos - 1] : 0;
+    key = &cur->keys[start];
+    key_len = cur->key_ends[pos] - start;
+    ++pos;
+    return true;
+
+  }
+
+};
+
+// Runs are read back soon and only once: compress them lightly.
+
+static htsFile* open_run(const std::string& fname, const bam_hdr_t* header, htsThreadPool* pool) {
+
+  htsFile* hf = hts_open_tuned(fname.c_str(), "wb1");
+  if(!hf) {
+    fprintf(stderr, "Failed to open %s\n", fname.c_str());
+    exit(1);
+  }
+  if(pool->pool)
+    hts_set_thread_pool(hf, pool);
+  if(sam_hdr_write(hf, header)) {
+    fprintf(stderr, "Failed to write header to %s\n", fname.c_str());
+    exit(1);
+  }
+  return hf;
+
+}
+
+static void close_run(htsFile* hf, const std::string& fname) {
+
+  if(hts_close(hf)) {
+    fprintf(stderr, "Failed to close %s\n", fname.c_str());
+    exit(1);
+  }
+
+}
+
+// Sorts full batches and writes them out as runs, on a background thread, while the caller fills
+// the next batch.
+
+class Spiller {
+
+  std::string prefix;
+  const bam_hdr_t* header;
+  htsThreadPool* pool;
+  int nthreads;
+  std::thread thread;
+
+public:
+
+  std::vector<std::string> runs;
+
+  Spiller(const std::string& _prefix, const bam_hdr_t* _header, htsThreadPool* _pool, int _nthreads) :
+    prefix(_prefix), header(_header), pool(_pool), nthreads(_nthreads) {}
+
+  void wait() {
+    if(thread.joinable())
+      thread.join();
+  }
+
+  // Sort and spill batch, which is left empty once the spill is done.
+  void spill(SortBatch* batch) {
+
+    wait();
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%04d.bam", (int)runs.size());
+    runs.push_back(prefix + suffix);
+    std::string fname = runs.back();
+
+    thread = std::thread([=]() {
+
+	batch->fix_keys();
+	sort_entries(batch->entries, nthreads);
+
+	StageTimer timer(tool_stage_write);
+	htsFile* hf = open_run(fname, header, pool);
+	bam1_t view;
+	for(size_t i = 0, ilim = batch->entries.size(); i != ilim; ++i) {
+	  batch->view(i, &view);
+	  if(sam_write1(hf, header, &view) < 0) {
+	    fprintf(stderr, "Failed to write to %s\n", fname.c_str());
+	    exit(1);
+	  }
+	}
+	close_run(hf, fname);
+
+	batch->clear();
+
+      });
+
+  }
+
+};
+
+// Merge runs, and the in-memory batch if given (which must come last in input order). With
+// threads to spare, runs are decoded and merged in parallel: each run gets its own thread if there
+// are few enough, else contiguous groups of runs are merged on a thread each. The batch is already
+// decoded, so it stays on the caller's thread.
+
+static RecordSource* merge_sources(std::vector<RecordSource*> runs, RecordSource* batch, int nthreads) {
+
+  int nruns = runs.size();
+  if(nthreads > 1 && nruns > 1) {
+
+    std::vector<RecordSource*> threaded;
+    if(nruns <= nthreads) {
+      for(int i = 0; i < nruns; ++i)
+	threaded.push_back(new ThreadedSource(runs[i]));
+    }
+    else {
+      for(int g = 0; g < nthreads; ++g) {
+	std::vector<RecordSource*> group(runs.begin() + (size_t)nruns * g / nthreads,
+					 runs.begin() + (size_t)nruns * (g + 1) / nthreads);
+	threaded.push_back(new ThreadedSource(new MergeSource(group)));
+      }
+    }
+    runs = threaded;
+
+  }
+
+  if(batch)
+    runs.push_back(batch);
+  return new MergeSource(runs);
+
+}
+
+// Merge runs into one longer run, fname.
+
+static void merge_to_run(const std::vector<std::string>& runs, const std::string& fname, const bam_hdr_t* header,
+			 htsThreadPool* pool, qname_order order, int nthreads) {
+
+  std::vector<RecordSource*> sources;
+  for(size_t i = 0; i < runs.size(); ++i)
+    sources.push_back(new RunSource(runs[i], order));
+  RecordSource* merge = merge_sources(sources, 0, nthreads);
+
+  htsFile* hf = open_run(fname, header, pool);
+  while(merge->next()) {
+    if(tool_stats_write1(hf, header, merge->rec) < 0) {
+      fprintf(stderr, "Failed to write to %s\n", fname.c_str());
+      exit(1);
+    }
+  }
+  close_run(hf, fname);
+  delete merge;
+
+}
+
+int main(int argc, char** argv) {
+
+  int nthreads = 1;
+  qname_order order = qname_order_samtools;
+  size_t mem = 1024 * 1024 * 1024;
+  std::string tmp_prefix;
+  int level = -1;
+  const char* out_name = "-";
+
+  int c;
+  while((c = getopt(argc, argv, "nN@:m:T:l:uo:")) >= 0) {
+    switch(c) {
+    case 'n':
+      order = qname_order_samtools;
+      break;
+    case 'N':
+      order = qname_order_picard;
+      break;
+    case '@':
+      nthreads = atoi(optarg);
+      break;
+    case 'm':
+      mem = parse_io_size(optarg);
+      break;
+    case 'T':
+      tmp_prefix = optarg;
+      break;
+    case 'l':
+      level = atoi(optarg);
+      break;
+    case 'u':
+      level = 0;
+      break;
+    case 'o':
+      out_name = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(optind + 1 != argc || level > 9)
+    usage();
+
+  if(mem < 16 * 1024 * 1024) {
+    fprintf(stderr, "-m must be at least 16M\n");
+    exit(1);
+  }
+
+  if(tmp_prefix.empty()) {
+    if(strcmp(out_name, "-")) {
+      tmp_prefix = std::string(out_name) + ".tmp";
+    }
+    else {
+      const char* tmpdir = getenv("TMPDIR");
+      char pid[32];
+      snprintf(pid, sizeof(pid), "%d", (int)getpid());
+      tmp_prefix = std::string(tmpdir ? tmpdir : "/tmp") + "/sort_qname." + pid;
+    }
+  }
+
+  const char* in_name = argv[optind];
+  tool_stats_init("sort_qname");
+
+  htsFile* hf = hts_open_tuned(in_name, "r");
+  if(!hf) {
+    fprintf(stderr, "Failed to open %s\n", in_name);
+    exit(1);
+  }
+
+  htsThreadPool pool = { 0, 0 };
+  if(nthreads > 1) {
+    pool.pool = hts_tpool_init(nthreads);
+    if(!pool.pool) {
+      fprintf(stderr, "Failed to start thread pool\n");
+      exit(1);
+    }
+    hts_set_thread_pool(hf, &pool);
+  }
+
+  bam_hdr_t* header = sam_hdr_read(hf);
+  if(!header) {
+    fprintf(stderr, "Failed to read header from %s\n", in_name);
+    exit(1);
+  }
+
+  // Two batches, one filling while the other is sorted and spilled.
+  size_t batch_mem = mem / 2;
+  SortBatch batches[2];
+  SortBatch* filling = &batches[0];
+  SortBatch* spare = &batches[1];
+  Spiller spiller(tmp_prefix, header, &pool, nthreads);
+
+  bam1_t* rec = bam_init1();
+  std::vector<uint8_t> key(qname_sort_key_bound(255));
+  uint64_t total = 0;
+  int ret;
+
+  while((ret = tool_stats_read1(hf, header, rec)) >= 0) {
+
+    const char* qname = bam_get_qname(rec);
+    size_t bound = qname_sort_key_bound(strlen(qname));
+    if(key.size() < bound)
+      key.resize(bound);
+    size_t key_len = qname_sort_key(order, qname, rec->core.flag, &key[0]);
+
+    size_t need = SortBatch::packed_size(rec, key_len) + sizeof(SortEntry) * 2;
+    if(filling->bytes() + need > batch_mem && !filling->entries.empty()) {
+      spiller.spill(filling);
+      std::swap(filling, spare);
+      // The spare was spilled before the one just handed over, so it's empty already.
+    }
+
+    filling->add(rec, &key[0], key_len);
+    ++total;
+
+  }
+
+  if(ret < -1) {
+    fprintf(stderr, "Failed to read %s\n", in_name);
+    exit(1);
+  }
+
+  bam_destroy1(rec);
+  hts_close(hf);
+
+  spiller.wait();
+  spare->release();
+  filling->fix_keys();
+  sort_entries(filling->entries, nthreads);
+
+  // Reading a run costs buffers of its own, which the spare batch's half of -m now has to cover,
+  // so if there are more runs than fit, merge groups of them into longer runs first. The cap on
+  // open files is well inside the usual descriptor limit.
+  size_t fan_in = std::max((size_t)2, std::min((size_t)256, batch_mem / run_read_bytes));
+  std::vector<std::string> runs = spiller.runs;
+  int passes = 0;
+  while(runs.size() > fan_in) {
+
+    ++passes;
+    std::vector<std::string> merged;
+    for(size_t i = 0; i < runs.size(); i += fan_in) {
+
+      std::vector<std::string> group(runs.begin() + i, runs.begin() + std::min(runs.size(), i + fan_in));
+      if(group.size() == 1) {
+	merged.push_back(group[0]);
+	continue;
+      }
+
+      char suffix[32];
+      snprintf(suffix, sizeof(suffix), ".m%d.%04d.bam", passes, (int)merged.size());
+      merged.push_back(tmp_prefix + suffix);
+      merge_to_run(group, merged.back(), header, &pool, order, nthreads);
+
+    }
+    runs.swap(merged);
+
+  }
+
+  std::vector<RecordSource*> sources;
+  for(size_t i = 0; i < runs.size(); ++i)
+    sources.push_back(new RunSource(runs[i], order));
+  RecordSource* merge = merge_sources(sources, new BatchSource(*filling), nthreads);
+
+
+  char out_mode[8] = "wb";
+  if(level >= 0)
+    sprintf(out_mode, "wb%d", level);
+
+  htsFile* hfo = hts_open_output(out_name, out_mode);
+  if(!hfo) {
+    fprintf(stderr, "Failed to open %s\n", out_name);
+    exit(1);
+  }
+  if(pool.pool)
+    hts_set_thread_pool(hfo, &pool);
+
+  bam_hdr_t* outheader = queryname_header(header);
+  if(sam_hdr_write(hfo, outheader)) {
+    fprintf(stderr, "Failed to write header to %s\n", out_name);
+    exit(1);
+  }
+
+  while(merge->next()) {
+    if(output_write1(hfo, outheader, merge->rec) < 0) {
+      fprintf(stderr, "Failed to write BAM record\n");
+      exit(1);
+    }
+  }
+
+  if(hts_close_output(hfo)) {
+    fprintf(stderr, "Failed to close %s\n", out_name);
+    exit(1);
+  }
+
+  fprintf(stderr, "Sorted %llu records", (unsigned long long)total);
+  if(!spiller.runs.empty())
+    fprintf(stderr, " via %lu runs spilled to %s.*", (unsigned long)spiller.runs.size(), tmp_prefix.c_str());
+  if(passes)
+    fprintf(stderr, " and %d extra merge pass%s", passes, passes > 1 ? "es" : "");
+  fprintf(stderr, "\n");
+
+  delete merge;
+  bam_hdr_destroy(outheader);
+  bam_hdr_destroy(header);
+  if(pool.pool)
+    hts_tpool_destroy(pool.pool);
+
+  tool_stats_finish();
+  return 0;
+
+}
@@ -0,0 +1,162 @@
+#ifndef SAMTOYS_STABLE_HASH_H
+#define SAMTOYS_STABLE_HASH_H
+
+// A fixed, seeded 64-bit hash for sampling decisions that must be reproducible
+// between hosts and compiler / standard library versions (unlike std::hash).
+// This is XXH64 (https://github.com/Cyan4973/xxHash, doc/xxhash_spec.md), written
+// out here so the tools don't need another dependency. Input bytes are always read
+// little-endian, so the result doesn't depend on the host either.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Default seed used by the samplers; changing it changes every sample we've ever drawn.
+static const uint64_t stable_hash_default_seed = 0x5a3709e5ULL;
+
+static const uint64_t xxh64_prime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t xxh64_prime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t xxh64_prime3 = 0x165667B19E3779F9ULL;
+static const uint64_t xxh64_prime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t xxh64_prime5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t xxh64_rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh64_read64(const uint8_t* p) {
+
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+
+}
+
+static inline uint32_t xxh64_read32(const uint8_t* p) {
+
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap32(v);
+#endif
+  return v;
+
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+
+  acc += input * xxh64_prime2;
+  acc = xxh64_rotl(acc, 31);
+  return acc * xxh64_prime1;
+
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val) {
+
+  acc ^= xxh64_round(0, val);
+  return acc * xxh64_prime1 + xxh64_prime4;
+
+}
+
+static inline uint64_t stable_hash(const void* data, size_t len, uint64_t seed = stable_hash_default_seed) {
+
+  const uint8_t* p = (const uint8_t*)data;
+  const uint8_t* end = p + len;
+  uint64_t h;
+
+  if(len >= 32) {
+
+    const uint8_t* limit = end - 32;
+    uint64_t v1 = seed + xxh64_prime1 + xxh64_prime2;
+    uint64_t v2 = seed + xxh64_prime2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - xxh64_prime1;
+
+    do {
+      v1 = xxh64_round(v1, xxh64_read64(p));
+      v2 = xxh64_round(v2, xxh64_read64(p + 8));
+      v3 = xxh64_round(v3, xxh64_read64(p + 16));
+      v4 = xxh64_round(v4, xxh64_read64(p + 24));
+      p += 32;
+    } while(p <= limit);
+
+    h = xxh64_rotl(v1, 1) + xxh64_rotl(v2, 7) + xxh64_rotl(v3, 12) + xxh64_rotl(v4, 18);
+    h = xxh64_merge_round(h, v1);
+    h = xxh64_merge_round(h, v2);
+    h = xxh64_merge_round(h, v3);
+    h = xxh64_merge_round(h, v4);
+
+  }
+  else {
+    h = seed + xxh64_prime5;
+  }
+
+  h += (uint64_t)len;
+
+  for(; p + 8 <= end; p += 8) {
+    h ^= xxh64_round(0, xxh64_read64(p));
+    h = xxh64_rotl(h, 27) * xxh64_prime1 + xxh64_prime4;
+  }
+
+  if(p + 4 <= end) {
+    h ^= (uint64_t)xxh64_read32(p) * xxh64_prime1;
+    h = xxh64_rotl(h, 23) * xxh64_prime2 + xxh64_prime3;
+    p += 4;
+  }
+
+  for(; p < end; ++p) {
+    h ^= (*p) * xxh64_prime5;
+    h = xxh64_rotl(h, 11) * xxh64_prime1;
+  }
+
+  h ^= h >> 33;
+  h *= xxh64_prime2;
+  h ^= h >> 29;
+  h *= xxh64_prime3;
+  h ^= h >> 32;
+
+  return h;
+
+}
+
+// Converts a proportion in [0, 1] into a threshold such that stable_hash(x) <= threshold
+// holds for that proportion of keys. Thresholds nest: a smaller proportion's sample is
+// always a subset of a larger one's drawn with the same seed.
+
+static inline uint64_t stable_hash_threshold(double prop) {
+
+  if(prop >= 1)
+    return UINT64_MAX;
+  if(prop <= 0)
+    return 0;
+  return (uint64_t)(prop * 18446744073709551616.0);
+
+}
+
+// Position sampling key shared by the pileup tools: the contig name, a single tab,
+// then the 1-based position in decimal, exactly as the first two mpileup columns read.
+
+static inline uint64_t pileup_position_hash(const char* chrom, size_t chrom_len, const char* pos, size_t pos_len,
+					    uint64_t seed = stable_hash_default_seed) {
+
+  char stackbuf[256];
+  size_t len = chrom_len + 1 + pos_len;
+
+  if(pos == chrom + chrom_len + 1 && chrom[chrom_len] == '\t')
+    return stable_hash(chrom, len, seed);
+
+  char* buf = len <= sizeof(stackbuf) ? stackbuf : new char[len];
+  memcpy(buf, chrom, chrom_len);
+  buf[chrom_len] = '\t';
+  memcpy(buf + chrom_len + 1, pos, pos_len);
+  uint64_t ret = stable_hash(buf, len, seed);
+  if(buf != stackbuf)
+    delete[] buf;
+  return ret;
+
+}
+
+#endif
@@ -9,58 +9,91 @@
 #include <htslib/sam.h>
 #include <htslib/bgzf.h>
 
+#include "tool_stats.h"
+#include "big_hfile.h"
+#include "output_level.h"
+#include "bam_view.h"
+#include "qname_set.h"
+
 int main(int argc, char** argv) {
 
-  // Filter SAM/BAM file on stdin, producing an uncompressed BAM on stdout featuring only those QNAMEs in argv[1]
+  // Filter SAM/BAM file on stdin, producing an uncompressed BAM on stdout featuring only those QNAMEs in argv[1],
+  // or with -s, those in a set held by qname_server.
+
+  bool remote = argc >= 2 && !strcmp(argv[1], "-s");
+  int thread_arg = remote ? 4 : 2;
 
-  if(argc < 2) {
-    std::cerr << "Usage: subset filterfile [thread_count] <samorbam >bam\n";
+  if(argc < thread_arg) {
+    std::cerr << "Usage: subset {filterfile | -s socket setname} [thread_count] <samorbam >bam\n";
     exit(1);
   }
 
+  tool_stats_init("subset");
+
   std::unordered_set<std::string> keep_qnames;
+  std::string qname;
+  QnameSetClient client;
 
-  std::cerr << "Reading Qnames to keep...\n";
+  if(remote) {
 
-  std::ifstream qname_file(argv[1]);
-  std::string qname;
+    client.connect(argv[2], argv[3]);
+    std::cerr << "Using " << client.set_size << " Qnames from set " << argv[3] << "\n";
 
-  while(std::getline(qname_file, qname)) {
+  }
+  else {
 
-    size_t end = qname.find_last_not_of(" \n\r\t");
-    if(end == std::string::npos)
-      continue;
-    qname.erase(end + 1);
-    qname.erase(0, qname.find_first_not_of(" \n\r\t"));
+    std::cerr << "Reading Qnames to keep...\n";
 
-    keep_qnames.insert(qname);
+    std::ifstream qname_file(argv[1]);
 
-  }
+    while(std::getline(qname_file, qname)) {
 
-  std::cerr << "Read " << keep_qnames.size() << " Qnames\n";
+      size_t end = qname.find_last_not_of(" \n\r\t");
+      if(end == std::string::npos)
+	continue;
+      qname.erase(end + 1);
+      qname.erase(0, qname.find_first_not_of(" \n\r\t"));
 
-  htsFile* hfi = hts_open("-", "r");
-  //hts_set_opt(hfi, HTSOL_FILEIO, HTS_FILEIO_BUFFER_SIZE, (size_t)4194304);
-  if(argc >= 3) {
+      keep_qnames.insert(qname);
 
-    int nthreads = strtol(argv[2], 0, 0);
-    if(!hfi->is_bin)
-      std::cerr << "Thread count ignored (non-BAM input)\n";
-    else {
-      hts_set_threads(hfi, nthreads);
-      bgzf_set_cache_size(hfi->fp.bgzf, BGZF_MAX_BLOCK_SIZE * nthreads * 256);
     }
-    
+
+    std::cerr << "Read " << keep_qnames.size() << " Qnames\n";
+
   }
 
-  htsFile* hfo = hts_open("-", "wb0");
+  // Uncompressed BAM in a regular file can be filtered in place, forwarding kept records' bytes
+  // as they are; anything else goes through sam_read1. Queries to qname_server are batched, and
+  // views only last until the next one is read, so -s always uses sam_read1.
+  bam_hdr_t* header = 0;
+  BamView* view = remote ? 0 : BamView::open("-", &header);
+  htsFile* hfi = 0;
+
+  if(!view) {
+
+    hfi = hts_open_tuned("-", "r");
+    if(argc > thread_arg) {
+
+      int nthreads = strtol(argv[thread_arg], 0, 0);
+      if(!hfi->is_bin)
+	std::cerr << "Thread count ignored (non-BAM input)\n";
+      else {
+	hts_set_threads(hfi, nthreads);
+	bgzf_set_cache_size(hfi->fp.bgzf, BGZF_MAX_BLOCK_SIZE * nthreads * 256);
+      }
+
+    }
+
+    header = sam_hdr_read(hfi);
+    if(!header) {
+      std::cerr << "Failed to read SAM/BAM header from stdin\n";
+      exit(1);
+    }
 
-  bam_hdr_t* header = sam_hdr_read(hfi);
-  if(!header) {
-    std::cerr << "Failed to read SAM/BAM header from stdin\n";
-    exit(1);
   }
 
+  htsFile* hfo = hts_open_output("-", "wb0");
+
   if(sam_hdr_write(hfo, header)) {
     std::cerr << "Failed to write SAM/BAM header to stdout\n";
     exit(1);
@@ -68,30 +101,132 @@ int main(int argc, char** argv) {
 
   unsigned long total = 0, kept = 0;
 
-  bam1_t rec;
-  memset(&rec, 0, sizeof(rec));
+  if(view) {
 
-  while(sam_read1(hfi, header, &rec) >= 0) {
+    BamRecordView v;
+    while(true) {
 
-    ++total;
+      {
+	SampledStageTimer timer(tool_stage_read);
+	if(!view->next(v))
+	  break;
+      }
+      tool_stats_add_records(1);
+      ++total;
 
-    qname = bam_get_qname(&rec);
-    if(!keep_qnames.count(qname))
-      continue;
+      qname = bam_get_qname(v.rec);
+      if(!keep_qnames.count(qname))
+	continue;
 
-    ++kept;
+      ++kept;
+
+      SampledStageTimer timer(tool_stage_write);
+      OutputTimer otimer(hfo, v.raw_len);
+      if(bam_view_write(hfo->fp.bgzf, v) < 0) {
+	std::cerr << "Failed to write BAM record\n";
+	exit(1);
+      }
 
-    if(sam_write1(hfo, header, &rec) < 0) {
-      std::cerr << "Failed to write BAM record\n";
-      exit(1);
     }
 
+    delete view;
+
+  }
+  else if(remote) {
+
+    // Ask about one batch while reading the next, so the server's lookups overlap our decoding.
+    const int batch_size = 4096;
+    std::vector<bam1_t*> batches[2];
+    for(int b = 0; b < 2; ++b) {
+      for(int i = 0; i < batch_size; ++i)
+	batches[b].push_back(bam_init1());
+    }
+
+    std::vector<const char*> qnames(batch_size);
+    std::vector<bool> found;
+    int cur = 0, pending = 0;
+    bool eof = false;
+
+    while(true) {
+
+      int n = 0;
+      while(!eof && n < batch_size) {
+	if(tool_stats_read1(hfi, header, batches[cur][n]) < 0)
+	  eof = true;
+	else {
+	  qnames[n] = bam_get_qname(batches[cur][n]);
+	  ++n;
+	}
+      }
+
+      total += n;
+      if(n)
+	client.send(&qnames[0], n);
+
+      if(pending) {
+
+	{
+	  StageTimer timer(tool_stage_compute);
+	  client.receive(found);
+	}
+
+	for(int i = 0; i < pending; ++i) {
+	  if(!found[i])
+	    continue;
+	  ++kept;
+	  if(output_write1(hfo, header, batches[!cur][i]) < 0) {
+	    std::cerr << "Failed to write BAM record\n";
+	    exit(1);
+	  }
+	}
+
+      }
+
+      if(!n)
+	break;
+      pending = n;
+      cur = !cur;
+
+    }
+
+    for(int b = 0; b < 2; ++b) {
+      for(int i = 0; i < batch_size; ++i)
+	bam_destroy1(batches[b][i]);
+    }
+
+    hts_close(hfi);
+
+  }
+  else {
+
+    bam1_t rec;
+    memset(&rec, 0, sizeof(rec));
+
+    while(tool_stats_read1(hfi, header, &rec) >= 0) {
+
+      ++total;
+
+      qname = bam_get_qname(&rec);
+      if(!keep_qnames.count(qname))
+	continue;
+
+      ++kept;
+
+      if(output_write1(hfo, header, &rec) < 0) {
+	std::cerr << "Failed to write BAM record\n";
+	exit(1);
+      }
+
+    }
+
+    hts_close(hfi);
+
   }
 
-  hts_close(hfi);
-  hts_close(hfo);
+  hts_close_output(hfo);
 
   std::cerr << "Kept " << kept << " of " << total << " records\n";
+  tool_stats_finish();
   return 0;
 
 }
@@ -0,0 +1,374 @@
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/thread_pool.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "qname_cmp.h"
+#include "tool_stats.h"
+#include "big_hfile.h"
+
+// Tag each lane's records with a read group derived from its filename and merge the lanes into one
+// sorted BAM, as tagAndMergeLanes.py did with one Picard AddOrReplaceReadGroups per lane feeding
+// samtools merge through FIFOs. Here every lane is read, tagged and k-way merged in one process,
+// with BGZF decoding and encoding for all files sharing one thread pool.
+
+static void usage() {
+
+  fprintf(stderr, "Usage: tag_and_merge_lanes [-@ threads] [-n | -N] [-l level] output.bam lane1.bam [lane2.bam ...]\n");
+  fprintf(stderr, "\tLane files must be named samplename_L???_R?_001.bam; each gets read group ID L??? and sample samplename\n");
+  fprintf(stderr, "\t-n\tInputs are name-sorted as per samtools sort -n (default: coordinate-sorted)\n");
+  fprintf(stderr, "\t-N\tInputs are name-sorted as per Picard / htsjdk (strcmp)\n");
+  fprintf(stderr, "\t-l\tOutput compression level (default as for hts_open)\n");
+  fprintf(stderr, "\t-@\tThreads for BGZF decoding / encoding\n");
+  exit(1);
+
+}
+
+enum merge_order {
+
+  merge_order_coordinate,
+  merge_order_name
+
+};
+
+struct Lane {
+
+  const char* fname;
+  std::string rgid, sample;
+  htsFile* hf;
+  bam_hdr_t* header;
+  bam1_t* rec;
+  bam1_t* prev;
+  unsigned long nrecs;
+
+};
+
+// As tagAndMergeLanes.py: everything before the last three _-separated fields is the sample, and
+// the first of those three is the lane.
+
+static void parse_lane_name(const char* fname, std::string& sample, std::string& lane) {
+
+  const char* bn = strrchr(fname, '/');
+  bn = bn ? bn + 1 : fname;
+
+  std::vector<std::string> bits;
+  const char* start = bn;
+  for(const char* p = bn; ; ++p) {
+    if(*p == '_' || !*p) {
+      bits.push_back(std::string(start, p));
+      start = p + 1;
+    }
+    if(!*p)
+      break;
+  }
+
+  if(bits.size() < 4) {
+    fprintf(stderr, "Filename %s is not in the expected samplename_L???_R?_001.bam format\n", fname);
+    exit(1);
+  }
+
+  sample = bits[0];
+  for(size_t i = 1; i < bits.size() - 3; ++i)
+    sample += "_" + bits[i];
+  lane = bits[bits.size() - 3];
+
+}
+
+// The first lane's header, less its read groups (which AddOrReplaceReadGroups would have replaced),
+// with @HD's sort order set to match the merge and one @RG line per distinct lane.
+
+static bam_hdr_t* merged_header(const std::vector<Lane>& lanes, merge_order order) {
+
+  std::string htext = lanes[0].header->text ? lanes[0].header->text : "";
+  std::string out;
+  std::string version = "1.6";
+
+  size_t linestart = 0;
+  while(linestart < htext.size()) {
+
+    size_t lineend = htext.find('\n', linestart);
+    if(lineend == std::string::npos)
+      lineend = htext.size();
+    std::string line = htext.substr(linestart, lineend - linestart);
+    linestart = lineend + 1;
+
+    if(!line.compare(0, 4, "@HD\t")) {
+      size_t vn = line.find("\tVN:");
+      if(vn != std::string::npos) {
+	vn += 4;
+	version = line.substr(vn, line.find('\t', vn) - vn);
+      }
+      continue;
+    }
+
+    if(!line.compare(0, 4, "@RG\t") || line.empty())
+      continue;
+
+    out += line + "\n";
+
+  }
+
+  std::string hd = "@HD\tVN:" + version + "\tSO:" + (order == merge_order_coordinate ? "coordinate" : "queryname") + "\n";
+  out = hd + out;
+
+  std::map<std::string, std::string> rg_samples;
+  for(size_t i = 0; i < lanes.size(); ++i) {
+
+    std::map<std::string, std::string>::iterator it = rg_samples.find(lanes[i].rgid);
+    if(it != rg_samples.end()) {
+      if(it->second != lanes[i].sample) {
+	fprintf(stderr, "Lane %s appears for samples %s and %s\n", lanes[i].rgid.c_str(), it->second.c_str(), lanes[i].sample.c_str());
+	exit(1);
+      }
+      continue;
+    }
+
+    rg_samples[lanes[i].rgid] = lanes[i].sample;
+    out += "@RG\tID:" + lanes[i].rgid + "\tPL:illumina\tPU:unit1\tLB:" + lanes[i].sample + "\tSM:" + lanes[i].sample + "\n";
+
+  }
+
+  bam_hdr_t* newheader = bam_hdr_dup(lanes[0].header);
+  free(newheader->text);
+  newheader->text = strdup(out.c_str());
+  newheader->l_text = out.length();
+  return newheader;
+
+}
+
+static void check_same_contigs(const Lane& a, const Lane& b) {
+
+  bool same = a.header->n_targets == b.header->n_targets;
+  for(int32_t i = 0; same && i < a.header->n_targets; ++i)
+    same = !strcmp(a.header->target_name[i], b.header->target_name[i]) && a.header->target_len[i] == b.header->target_len[i];
+
+  if(!same) {
+    fprintf(stderr, "%s and %s have different reference sequences\n", a.fname, b.fname);
+    exit(1);
+  }
+
+}
+
+// As samtools merge: coordinate order is by contig (unmapped last), position and then strand; name
+// order is by qname and then READ1 / READ2. Ties are broken by input order by the caller.
+
+static int rec_cmp_coordinate(const bam1_t* a, const bam1_t* b) {
+
+  uint64_t ka = ((uint64_t)(uint32_t)a->core.tid << 32 | (uint32_t)(a->core.pos + 1)) << 1 | bam_is_rev(a);
+  uint64_t kb = ((uint64_t)(uint32_t)b->core.tid << 32 | (uint32_t)(b->core.pos + 1)) << 1 | bam_is_rev(b);
+  return ka < kb ? -1 : ka > kb ? 1 : 0;
+
+}
+
+static int rec_cmp_name(qname_order order, const bam1_t* a, const bam1_t* b) {
+
+  int t = qname_cmp_order(order, bam_get_qname(a), bam_get_qname(b));
+  if(t)
+    return t;
+  return (int)(a->core.flag & (BAM_FREAD1 | BAM_FREAD2)) - (int)(b->core.flag & (BAM_FREAD1 | BAM_FREAD2));
+
+}
+
+struct LaneHeapCmp {
+
+  const std::vector<Lane>* lanes;
+  merge_order order;
+  qname_order name_order;
+
+  int cmp(const bam1_t* a, const bam1_t* b) const {
+    return order == merge_order_coordinate ? rec_cmp_coordinate(a, b) : rec_cmp_name(name_order, a, b);
+  }
+
+  // std::*_heap keep the greatest element at the front, so this is "comes later".
+  bool operator()(int a, int b) const {
+    int t = cmp((*lanes)[a].rec, (*lanes)[b].rec);
+    return t ? t > 0 : a > b;
+  }
+
+};
+
+// Read the next record into lane.rec, checking it doesn't go backwards. Returns false at EOF.
+
+static bool advance(Lane& lane, const LaneHeapCmp& heapcmp) {
+
+  std::swap(lane.rec, lane.prev);
+
+  int ret = tool_stats_read1(lane.hf, lane.header, lane.rec);
+  if(ret < -1) {
+    fprintf(stderr, "Failed to read %s\n", lane.fname);
+    exit(1);
+  }
+  if(ret < 0)
+    return false;
+
+  if(lane.nrecs++ && heapcmp.cmp(lane.prev, lane.rec) > 0) {
+    fprintf(stderr, "%s is not sorted: %s comes after %s\n", lane.fname, bam_get_qname(lane.rec), bam_get_qname(lane.prev));
+    exit(1);
+  }
+
+  // Replace any existing read group, as AddOrReplaceReadGroups does.
+  uint8_t* rg = bam_aux_get(lane.rec, "RG");
+  if(rg)
+    bam_aux_del(lane.rec, rg);
+  bam_aux_append(lane.rec, "RG", 'Z', lane.rgid.size() + 1, (uint8_t*)lane.rgid.c_str());
+
+  return true;
+
+}
+
+int main(int argc, char** argv) {
+
+  int nthreads = 1;
+  int level = -1;
+  merge_order order = merge_order_coordinate;
+  qname_order name_order = qname_order_samtools;
+
+  int c;
+  while((c = getopt(argc, argv, "@:nNl:")) >= 0) {
+    switch(c) {
+    case '@':
+      nthreads = atoi(optarg);
+      break;
+    case 'n':
+      order = merge_order_name;
+      name_order = qname_order_samtools;
+      break;
+    case 'N':
+      order = merge_order_name;
+      name_order = qname_order_picard;
+      break;
+    case 'l':
+      level = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(argc - optind < 2 || level > 9)
+    usage();
+
+  const char* out_name = argv[optind];
+  tool_stats_init("tag_and_merge_lanes");
+
+  htsThreadPool pool = { 0, 0 };
+  if(nthreads > 1) {
+    pool.pool = hts_tpool_init(nthreads);
+    if(!pool.pool) {
+      fprintf(stderr, "Failed to start thread pool\n");
+      exit(1);
+    }
+  }
+
+  std::vector<Lane> lanes(argc - optind - 1);
+  for(size_t i = 0; i < lanes.size(); ++i) {
+
+    Lane& lane = lanes[i];
+    lane.fname = argv[optind + 1 + i];
+    parse_lane_name(lane.fname, lane.sample, lane.rgid);
+
+    lane.hf = hts_open_tuned(lane.fname, "r");
+    if(!lane.hf) {
+      fprintf(stderr, "Failed to open %s\n", lane.fname);
+      exit(1);
+    }
+    if(pool.pool)
+      hts_set_thread_pool(lane.hf, &pool);
+
+    lane.header = sam_hdr_read(lane.hf);
+    if(!lane.header) {
+      fprintf(stderr, "Failed to read header from %s\n", lane.fname);
+      exit(1);
+    }
+    if(i)
+      check_same_contigs(lanes[0], lane);
+
+    lane.rec = bam_init1();
+    lane.prev = bam_init1();
+    lane.nrecs = 0;
+
+    fprintf(stderr, "%s: RGID=%s RGSM=%s\n", lane.fname, lane.rgid.c_str(), lane.sample.c_str());
+
+  }
+
+  char out_mode[8] = "wb";
+  if(level >= 0)
+    sprintf(out_mode, "wb%d", level);
+
+  htsFile* hfo = hts_open_tuned(out_name, out_mode);
+  if(!hfo) {
+    fprintf(stderr, "Failed to open %s\n", out_name);
+    exit(1);
+  }
+  if(pool.pool)
+    hts_set_thread_pool(hfo, &pool);
+
+  bam_hdr_t* outheader = merged_header(lanes, order);
+  if(sam_hdr_write(hfo, outheader)) {
+    fprintf(stderr, "Failed to write header to %s\n", out_name);
+    exit(1);
+  }
+
+  LaneHeapCmp heapcmp;
+  heapcmp.lanes = &lanes;
+  heapcmp.order = order;
+  heapcmp.name_order = name_order;
+
+  std::vector<int> heap;
+  for(int i = 0, ilim = lanes.size(); i != ilim; ++i) {
+    if(advance(lanes[i], heapcmp))
+      heap.push_back(i);
+  }
+  std::make_heap(heap.begin(), heap.end(), heapcmp);
+
+  unsigned long total = 0;
+
+  while(!heap.empty()) {
+
+    std::pop_heap(heap.begin(), heap.end(), heapcmp);
+    Lane& lane = lanes[heap.back()];
+
+    if(tool_stats_write1(hfo, outheader, lane.rec) < 0) {
+      fprintf(stderr, "Failed to write BAM record\n");
+      exit(1);
+    }
+    ++total;
+
+    if(advance(lane, heapcmp))
+      std::push_heap(heap.begin(), heap.end(), heapcmp);
+    else
+      heap.pop_back();
+
+  }
+
+  if(hts_close(hfo)) {
+    fprintf(stderr, "Failed to close %s\n", out_name);
+    exit(1);
+  }
+
+  for(size_t i = 0; i < lanes.size(); ++i) {
+    bam_destroy1(lanes[i].rec);
+    bam_destroy1(lanes[i].prev);
+    bam_hdr_destroy(lanes[i].header);
+    hts_close(lanes[i].hf);
+  }
+
+  bam_hdr_destroy(outheader);
+  if(pool.pool)
+    hts_tpool_destroy(pool.pool);
+
+  fprintf(stderr, "Merged %lu records from %lu lanes\n", total, (unsigned long)lanes.size());
+  tool_stats_finish();
+  return 0;
+
+}
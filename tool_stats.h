@@ -0,0 +1,358 @@
+#ifndef SAMTOYS_TOOL_STATS_H
+#define SAMTOYS_TOOL_STATS_H
+
+// Per-tool timing and progress, off (and close to free) unless SAMTOYS_STATS is set:
+//   SAMTOYS_STATS=1 or stderr    progress lines on stderr
+//   SAMTOYS_STATS=path           the same as JSON lines, appended to path
+//   SAMTOYS_STATS_INTERVAL=secs  how often to report (default 10)
+//   SAMTOYS_PERF=1               also count cycles, instructions, cache misses and branch misses
+//                                for the whole process using perf_event_open (Linux only)
+// Tools call tool_stats_init at startup and tool_stats_finish at the end, count records with
+// tool_stats_add_records (or read them with tool_stats_read1), and bracket reading, per-record
+// work and writing with StageTimer (or tool_stats_read1 / tool_stats_write1). Timers around a
+// single record use SampledStageTimer. Time not covered by a timer on single-threaded tools is
+// reported as compute. Bytes in and out are the process's totals from /proc/self/io, so they
+// cover every file, pipe and index without per-file plumbing; they're left out elsewhere.
+
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+enum tool_stage {
+
+  tool_stage_read,
+  tool_stage_compute,
+  tool_stage_write,
+  tool_n_stages
+
+};
+
+static const char* const tool_stage_names[tool_n_stages] = { "read", "compute", "write" };
+
+static const int tool_n_perf_counters = 4;
+static const char* const tool_perf_names[tool_n_perf_counters] = { "cycles", "instructions", "cache_misses", "branch_misses" };
+
+struct ToolStats {
+
+  bool enabled;
+  const char* name;
+  FILE* out;
+  bool json;
+  uint64_t interval_ns;
+
+  uint64_t start_ns, last_report_ns;
+  std::atomic<uint64_t> records;
+  std::atomic<uint64_t> next_check;
+  std::atomic<uint64_t> stage_ns[tool_n_stages];
+  std::mutex report_lock;
+
+  int perf_fds[tool_n_perf_counters];
+
+};
+
+// Zero-initialised, so disabled until tool_stats_init finds SAMTOYS_STATS.
+static ToolStats tool_stats;
+
+static inline uint64_t tool_stats_now() {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+}
+
+static void tool_stats_open_perf() {
+
+#ifdef __linux__
+  static const uint64_t configs[tool_n_perf_counters] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+  };
+
+  for(int i = 0; i < tool_n_perf_counters; ++i) {
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[i];
+    // Count threads started from now on too (BGZF pools, workers).
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    tool_stats.perf_fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if(tool_stats.perf_fds[i] < 0)
+      fprintf(stderr, "%s: SAMTOYS_PERF: can't count %s (%s); see /proc/sys/kernel/perf_event_paranoid\n",
+	      tool_stats.name, tool_perf_names[i], strerror(errno));
+
+  }
+#else
+  fprintf(stderr, "%s: SAMTOYS_PERF: hardware counters are only available on Linux\n", tool_stats.name);
+#endif
+
+}
+
+static void tool_stats_init(const char* name) {
+
+  const char* dest = getenv("SAMTOYS_STATS");
+  if(!dest || !*dest || !strcmp(dest, "0"))
+    return;
+
+  tool_stats.name = name;
+  if(!strcmp(dest, "1") || !strcmp(dest, "stderr")) {
+    tool_stats.out = stderr;
+    tool_stats.json = false;
+  }
+  else {
+    tool_stats.out = fopen(dest, "a");
+    if(!tool_stats.out) {
+      fprintf(stderr, "Failed to open SAMTOYS_STATS file %s\n", dest);
+      exit(1);
+    }
+    setvbuf(tool_stats.out, 0, _IOLBF, 0);
+    tool_stats.json = true;
+  }
+
+  const char* interval = getenv("SAMTOYS_STATS_INTERVAL");
+  double secs = interval ? atof(interval) : 10;
+  tool_stats.interval_ns = (uint64_t)((secs > 0 ? secs : 10) * 1e9);
+
+  for(int i = 0; i < tool_n_perf_counters; ++i)
+    tool_stats.perf_fds[i] = -1;
+  const char* perf = getenv("SAMTOYS_PERF");
+  if(perf && *perf && strcmp(perf, "0"))
+    tool_stats_open_perf();
+
+  tool_stats.start_ns = tool_stats.last_report_ns = tool_stats_now();
+  tool_stats.next_check = 65536;
+  tool_stats.enabled = true;
+
+}
+
+// rchar and wchar: bytes passed to read() and write()-like calls by the whole process. Returns
+// false if they aren't available.
+
+static bool tool_stats_io(uint64_t* in, uint64_t* out) {
+
+  *in = *out = 0;
+#ifdef __linux__
+  FILE* f = fopen("/proc/self/io", "r");
+  if(!f)
+    return false;
+
+  char line[128];
+  unsigned long long val;
+  while(fgets(line, sizeof(line), f)) {
+    if(sscanf(line, "rchar: %llu", &val) == 1)
+      *in = val;
+    else if(sscanf(line, "wchar: %llu", &val) == 1)
+      *out = val;
+  }
+  fclose(f);
+  return true;
+#else
+  return false;
+#endif
+
+}
+
+static void tool_stats_report(bool final) {
+
+  uint64_t now = tool_stats_now();
+  double elapsed = (now - tool_stats.start_ns) / 1e9;
+  uint64_t records = tool_stats.records;
+  uint64_t bytes_in, bytes_out;
+  bool have_io = tool_stats_io(&bytes_in, &bytes_out);
+
+  double stage_s[tool_n_stages];
+  for(int i = 0; i < tool_n_stages; ++i)
+    stage_s[i] = tool_stats.stage_ns[i] / 1e9;
+  // Nothing timed compute explicitly: it's whatever reading and writing didn't account for.
+  if(!tool_stats.stage_ns[tool_stage_compute])
+    stage_s[tool_stage_compute] = std::max(0.0, elapsed - stage_s[tool_stage_read] - stage_s[tool_stage_write]);
+
+  long long perf[tool_n_perf_counters];
+  for(int i = 0; i < tool_n_perf_counters; ++i) {
+    perf[i] = -1;
+    if(tool_stats.perf_fds[i] >= 0 && read(tool_stats.perf_fds[i], &perf[i], sizeof(perf[i])) != sizeof(perf[i]))
+      perf[i] = -1;
+  }
+
+  FILE* out = tool_stats.out;
+  double rate = elapsed > 0 ? records / elapsed : 0;
+
+  if(tool_stats.json) {
+
+    fprintf(out, "{\"tool\": \"%s\", \"pid\": %d, \"final\": %s, \"elapsed_s\": %.3f, \"records\": %llu, \"records_per_s\": %.0f",
+	    tool_stats.name, (int)getpid(), final ? "true" : "false", elapsed, (unsigned long long)records, rate);
+    if(have_io)
+      fprintf(out, ", \"bytes_in\": %llu, \"bytes_out\": %llu", (unsigned long long)bytes_in, (unsigned long long)bytes_out);
+    for(int i = 0; i < tool_n_stages; ++i)
+      fprintf(out, ", \"%s_s\": %.3f", tool_stage_names[i], stage_s[i]);
+    for(int i = 0; i < tool_n_perf_counters; ++i) {
+      if(perf[i] >= 0)
+	fprintf(out, ", \"%s\": %lld", tool_perf_names[i], perf[i]);
+    }
+    fprintf(out, "}\n");
+
+  }
+  else {
+
+    fprintf(out, "[%s] %s%.1fs: %llu records (%.0f/s)",
+	    tool_stats.name, final ? "done in " : "", elapsed, (unsigned long long)records, rate);
+    if(have_io)
+      fprintf(out, ", in %.1f MB (%.1f MB/s), out %.1f MB", bytes_in / 1e6, elapsed > 0 ? bytes_in / 1e6 / elapsed : 0, bytes_out / 1e6);
+    fprintf(out, "; read %.1fs, compute %.1fs, write %.1fs",
+	    stage_s[tool_stage_read], stage_s[tool_stage_compute], stage_s[tool_stage_write]);
+    if(perf[0] > 0 && perf[1] >= 0)
+      fprintf(out, "; %.2f IPC", (double)perf[1] / perf[0]);
+    for(int i = 0; i < tool_n_perf_counters; ++i) {
+      if(perf[i] >= 0)
+	fprintf(out, ", %lld %s", perf[i], tool_perf_names[i]);
+    }
+    fprintf(out, "\n");
+
+  }
+
+  tool_stats.last_report_ns = now;
+
+}
+
+// Checking the clock every record would cost more than the rest of this put together, so the
+// interval is only checked every 64k records.
+
+static void tool_stats_check_progress(uint64_t records) {
+
+  std::unique_lock<std::mutex> guard(tool_stats.report_lock, std::try_to_lock);
+  if(!guard.owns_lock() || records < tool_stats.next_check)
+    return;
+
+  tool_stats.next_check = records + 65536;
+  if(tool_stats_now() - tool_stats.last_report_ns >= tool_stats.interval_ns)
+    tool_stats_report(false);
+
+}
+
+static inline void tool_stats_add_records(uint64_t n) {
+
+  if(!tool_stats.enabled)
+    return;
+
+  uint64_t records = tool_stats.records.fetch_add(n, std::memory_order_relaxed) + n;
+  if(records >= tool_stats.next_check.load(std::memory_order_relaxed))
+    tool_stats_check_progress(records);
+
+}
+
+static void tool_stats_finish() {
+
+  if(!tool_stats.enabled)
+    return;
+
+  {
+    std::lock_guard<std::mutex> guard(tool_stats.report_lock);
+    tool_stats_report(true);
+  }
+
+  for(int i = 0; i < tool_n_perf_counters; ++i) {
+    if(tool_stats.perf_fds[i] >= 0)
+      close(tool_stats.perf_fds[i]);
+  }
+  if(tool_stats.out != stderr)
+    fclose(tool_stats.out);
+  tool_stats.enabled = false;
+
+}
+
+// Adds the time until it goes out of scope to a stage's total. May be used on any thread; time on
+// several threads at once is summed.
+
+class StageTimer {
+
+  tool_stage stage;
+  uint64_t start;
+
+public:
+
+  StageTimer(tool_stage _stage) : stage(_stage), start(tool_stats.enabled ? tool_stats_now() : 0) {}
+
+  ~StageTimer() {
+    if(start)
+      tool_stats.stage_ns[stage].fetch_add(tool_stats_now() - start, std::memory_order_relaxed);
+  }
+
+};
+
+// StageTimer for spans of one record or line, where two clock reads would cost about as much as
+// the work being timed and skew the split between stages: times a random one in 16 and counts it
+// 16 times over, so the totals are estimates, but close ones over the millions of records that
+// make them worth reading.
+
+static const int tool_stats_sample_shift = 4;
+
+class SampledStageTimer {
+
+  tool_stage stage;
+  uint64_t start;
+
+  static bool sample() {
+    // xorshift32, so sampling can't fall into step with a period in the input, e.g. BGZF blocks.
+    static thread_local uint32_t state = 0x9e3779b9;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return !(state >> (32 - tool_stats_sample_shift));
+  }
+
+public:
+
+  SampledStageTimer(tool_stage _stage) : stage(_stage), start(tool_stats.enabled && sample() ? tool_stats_now() : 0) {}
+
+  ~SampledStageTimer() {
+    if(start)
+      tool_stats.stage_ns[stage].fetch_add((tool_stats_now() - start) << tool_stats_sample_shift, std::memory_order_relaxed);
+  }
+
+};
+
+// sam_read1, timed as reading and counting the record.
+
+static inline int tool_stats_read1(htsFile* hf, bam_hdr_t* header, bam1_t* rec) {
+
+  int ret;
+  {
+    SampledStageTimer timer(tool_stage_read);
+    ret = sam_read1(hf, header, rec);
+  }
+  if(ret >= 0)
+    tool_stats_add_records(1);
+  return ret;
+
+}
+
+// sam_write1, timed as writing.
+
+static inline int tool_stats_write1(htsFile* hf, const bam_hdr_t* header, const bam1_t* rec) {
+
+  SampledStageTimer timer(tool_stage_write);
+  return sam_write1(hf, header, rec);
+
+}
+
+#endif